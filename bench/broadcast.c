@@ -0,0 +1,192 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2024  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares broadcastop() with calling writeop() for each client.
+ *
+ * usage: broadcast_bench [clients] [rounds]
+ *
+ * A copy of this program is spawned for each client, to read and
+ * count what it's sent. Each run sends rounds messages of one size to
+ * every client, then waits for all of them to say they've read them.
+ */
+
+#include "srvsh.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define OP_DATA 1
+#define OP_DONE 2
+
+static long received = 0;
+
+static void count_message(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	// large broadcasts come with a memfd
+	close_cmsg_fds(msg);
+
+	if (opcode == OP_DONE) {
+		writesrv(OP_DONE, &received, sizeof(received));
+		received = 0;
+		return;
+	}
+	if (opcode == OP_DATA)
+		received++;
+}
+
+static int sink(void)
+{
+	for (;;) {
+		struct pollfd result = pollopsrv(count_message, NULL, -1);
+		if (result.fd < 0)
+			return 1;
+		if (result.revents & POLLHUP)
+			return 0;
+	}
+}
+
+static void wait_done(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	if (opcode == OP_DONE)
+		memcpy(context, buf, sizeof(long));
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool send_loop(const int *fds, int clients, const void *payload, int size)
+{
+	for (int i = 0; i < clients; i++)
+		if (writeop(fds[i], OP_DATA, payload, size) < 0)
+			return false;
+	return true;
+}
+
+static bool send_broadcast(const int *fds, int clients, const void *payload, int size)
+{
+	return broadcastop(fds, clients, OP_DATA, payload, size) == clients;
+}
+
+static bool run(
+	const char *name,
+	bool (*send)(const int *, int, const void *, int),
+	const int *fds,
+	int clients,
+	long rounds,
+	int size
+)
+{
+	static char payload[1 << 18];
+
+	double start = now();
+	for (long round = 0; round < rounds; round++)
+		if (!send(fds, clients, payload, size))
+			return false;
+
+	long short_count = 0;
+	for (int i = 0; i < clients; i++) {
+		if (writeop(fds[i], OP_DONE, NULL, 0) < 0)
+			return false;
+
+		long counted = -1;
+		struct pollfd fd = { .fd = fds[i] };
+		while (counted < 0)
+			if (pollopfd(fd, wait_done, &counted, -1).fd < 0)
+				return false;
+		if (counted != rounds)
+			short_count++;
+	}
+	double elapsed = now() - start;
+
+	printf("%-9s %7d %12.0f %12.1f\n",
+		name,
+		size,
+		(double)rounds * clients / elapsed,
+		(double)rounds * clients * size / elapsed / (1 << 20));
+	if (short_count)
+		printf("%ld clients missed messages\n", short_count);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "sink") == 0)
+		return sink();
+
+	int clients = argc > 1 ? atoi(argv[1]) : 100;
+	long rounds = argc > 2 ? atol(argv[2]) : 2000;
+	if (clients <= 0 || rounds <= 0)
+		return 1;
+
+	struct clistate *children = calloc(clients, sizeof(*children));
+	int *fds = calloc(clients, sizeof(*fds));
+	if (!children || !fds)
+		return 1;
+	for (int i = 0; i < clients; i++) {
+		children[i] = cliexecl("/proc/self/exe", "/proc/self/exe", "sink", NULL);
+		if (children[i].socket < 0) {
+			perror("broadcast_bench");
+			return 1;
+		}
+		fds[i] = children[i].socket;
+	}
+
+	printf("%-9s %7s %12s %12s\n", "method", "size", "messages/s", "MiB/s");
+	static const int sizes[] = { 64, 4096, 1 << 18 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		const long sized_rounds = sizes[i] > 4096 ? rounds / 10 + 1 : rounds;
+		if (
+			!run("writeop", send_loop, fds, clients, sized_rounds, sizes[i])
+			|| !run("broadcast", send_broadcast, fds, clients, sized_rounds, sizes[i])
+		) {
+			perror("broadcast_bench");
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < clients; i++) {
+		close(children[i].socket);
+		waitpid(children[i].pid, NULL, 0);
+	}
+	free(children);
+	free(fds);
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2024  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares reading many connections from coroutines with reading them
+ * from a pollopfds() callback.
+ *
+ * usage: coroutine_bench [sessions] [messages]
+ *
+ * Each run opens a socketpair per session, fills it with messages and
+ * hangs up the writing end, then times how long it takes to read every
+ * message and hang-up.
+ */
+
+#include "srvsh.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OP_DATA 1
+
+static long received = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool fill(int *fds, int sessions, int messages)
+{
+	for (int i = 0; i < sessions; i++) {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+			return false;
+		for (int message = 0; message < messages; message++)
+			if (writeop(pair[1], OP_DATA, &message, sizeof(message)) < 0)
+				return false;
+		close(pair[1]);
+		fds[i] = pair[0];
+	}
+	return true;
+}
+
+static void count_message(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	if (opcode == OP_DATA)
+		received++;
+}
+
+static bool read_callbacks(int *fds, int sessions)
+{
+	static struct pollfd *polls = NULL;
+	if (!polls && !(polls = calloc(sessions, sizeof(*polls))))
+		return false;
+	for (int i = 0; i < sessions; i++)
+		polls[i] = (struct pollfd) { .fd = fds[i], .events = POLLIN };
+
+	// Each one that hangs up is marked by negating its fd
+	for (int open = sessions; open > 0;) {
+		if (pollopfds(polls, sessions, count_message, NULL, -1).fd < 0)
+			return false;
+		open = 0;
+		for (int i = 0; i < sessions; i++)
+			if (polls[i].fd >= 0)
+				open++;
+	}
+	return true;
+}
+
+static void session(int fd, void *context)
+{
+	struct op_message message;
+	while (recvop(fd, &message) > 0)
+		received++;
+}
+
+static bool read_coroutines(int *fds, int sessions)
+{
+	for (int i = 0; i < sessions; i++)
+		if (spawn_coroutine(fds[i], session, NULL) < 0)
+			return false;
+	return run_coroutines() == 0;
+}
+
+static bool run(
+	const char *name,
+	bool (*read_all)(int *, int),
+	int *fds,
+	int sessions,
+	int messages
+)
+{
+	if (!fill(fds, sessions, messages))
+		return false;
+
+	received = 0;
+	double start = now();
+	if (!read_all(fds, sessions))
+		return false;
+	double elapsed = now() - start;
+
+	for (int i = 0; i < sessions; i++)
+		close(fds[i]);
+
+	printf("%-10s %8d %12.0f\n", name, sessions, (double)received / elapsed);
+	if (received != (long)sessions * messages)
+		printf("%ld messages missed\n", (long)sessions * messages - received);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	int sessions = argc > 1 ? atoi(argv[1]) : 256;
+	int messages = argc > 2 ? atoi(argv[2]) : 100;
+	if (sessions <= 0 || messages <= 0)
+		return 1;
+
+	int *fds = calloc(sessions, sizeof(*fds));
+	if (!fds)
+		return 1;
+
+	printf("%-10s %8s %12s\n", "method", "sessions", "messages/s");
+	for (int i = 0; i < 3; i++) {
+		if (
+			!run("callback", read_callbacks, fds, sessions, messages)
+			|| !run("coroutine", read_coroutines, fds, sessions, messages)
+		) {
+			perror("coroutine_bench");
+			return 1;
+		}
+	}
+
+	free(fds);
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2024  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how dispatchop() scales with the number of threads.
+ *
+ * usage: dispatch_bench [clients] [messages] [work] [max threads]
+ *
+ * Every client is a socket written by a thread of its own. One client
+ * in eight is hot, and sends eight times as many messages as the rest,
+ * so the threads that own them have to be relieved by the others. The
+ * callback spins for `work` rounds on each message, and checks that
+ * every client's messages arrive in the order they were sent.
+ */
+
+#include "srvsh.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define OPCODE 1
+#define BATCH 64
+#define HOT_EVERY 8
+#define HOT_FACTOR 8
+
+struct message {
+	unsigned int seq;
+	unsigned char payload[60];
+};
+
+struct frame {
+	struct srvsh_header header;
+	struct message message;
+};
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	unsigned int messages;
+};
+
+static unsigned int *expected = NULL;
+static unsigned long *sink = NULL;
+static atomic_ulong out_of_order;
+static int work = 1000;
+
+static void *write_messages(void *arg)
+{
+	struct writer *writer = arg;
+	struct frame frames[BATCH] = { 0 };
+	for (unsigned int sent = 0; sent < writer->messages;) {
+		int count = 0;
+		for (; count < BATCH && sent < writer->messages; count++, sent++) {
+			frames[count].header = (struct srvsh_header) {
+				.opcode = OPCODE,
+				.size = sizeof(struct message),
+			};
+			frames[count].message.seq = sent;
+		}
+
+		size_t size = (size_t)count * sizeof(*frames);
+		if (write(writer->fd, frames, size) != (ssize_t)size)
+			break;
+	}
+	close(writer->fd);
+	return NULL;
+}
+
+static void count_message(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	struct message message;
+	memcpy(&message, buf, sizeof(message));
+	if (message.seq != expected[fd]++)
+		atomic_fetch_add(&out_of_order, 1);
+
+	unsigned long x = message.seq;
+	for (int i = 0; i < work; i++)
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+	sink[fd] += x;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double run(int threads, int clients, unsigned int messages, unsigned long *total)
+{
+	struct writer *writers = calloc((size_t)clients, sizeof(*writers));
+	if (!writers)
+		return -1;
+
+	*total = 0;
+	for (int i = 0; i < clients; i++) {
+		int sockets[2] = { 0 };
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+			return -1;
+
+		// keep the writers' ends clear of the client range
+		writers[i].fd = fcntl(sockets[1], F_DUPFD_CLOEXEC, CLI_BEGIN + clients);
+		close(sockets[1]);
+		if (dup2(sockets[0], CLI_BEGIN + i) < 0)
+			return -1;
+		close(sockets[0]);
+
+		writers[i].messages = messages * (i % HOT_EVERY ? 1 : HOT_FACTOR);
+		*total += writers[i].messages;
+		expected[CLI_BEGIN + i] = 0;
+	}
+
+	double start = now();
+	for (int i = 0; i < clients; i++)
+		pthread_create(&writers[i].thread, NULL, write_messages, &writers[i]);
+
+	int result = dispatchop(threads, count_message, NULL);
+	double elapsed = now() - start;
+
+	for (int i = 0; i < clients; i++) {
+		pthread_join(writers[i].thread, NULL);
+		close(CLI_BEGIN + i);
+	}
+	free(writers);
+	return result < 0 ? -1 : elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int clients = argc > 1 ? atoi(argv[1]) : 64;
+	unsigned int messages = argc > 2 ? (unsigned int)atoi(argv[2]) : 20000;
+	work = argc > 3 ? atoi(argv[3]) : 1000;
+	if (clients <= 0)
+		return 1;
+
+	// CLI_BEGIN + clients + the writers' ends
+	int fds = CLI_BEGIN + 2 * clients + 1;
+	char end[16];
+	snprintf(end, sizeof(end), "%d", CLI_BEGIN + clients);
+	if (setenv("SRVSH_CLIENTS_END", end, 1) < 0)
+		return 1;
+
+	expected = calloc((size_t)fds, sizeof(*expected));
+	sink = calloc((size_t)fds, sizeof(*sink));
+	if (!expected || !sink)
+		return 1;
+
+	int cpus = argc > 4 ? atoi(argv[4]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 0)
+		return 1;
+	printf("%d clients, %u messages each (%dx for hot clients), %d rounds of work per message\n",
+		clients, messages, HOT_FACTOR, work);
+	printf("%8s %10s %14s %8s\n", "threads", "seconds", "messages/s", "speedup");
+
+	double single = 0;
+	for (int threads = 1;; threads = threads * 2 < cpus ? threads * 2 : cpus) {
+		unsigned long total = 0;
+		double elapsed = run(threads, clients, messages, &total);
+		if (elapsed < 0) {
+			perror("dispatchop");
+			return 1;
+		}
+		if (threads == 1)
+			single = elapsed;
+
+		printf("%8d %10.3f %14.0f %7.2fx\n",
+			threads, elapsed, (double)total / elapsed, single / elapsed);
+
+		if (threads >= cpus)
+			break;
+	}
+
+	unsigned long errors = atomic_load(&out_of_order);
+	if (errors)
+		printf("%lu messages out of order\n", errors);
+
+	free(expected);
+	free(sink);
+	return errors ? 1 : 0;
+}
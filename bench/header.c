@@ -0,0 +1,167 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2024  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares the standard and compact (SRVSH_HEADER=compact) headers
+ * on small messages.
+ *
+ * usage: header_bench [messages]
+ *
+ * A copy of this program is spawned to read each run's messages, once
+ * with each header. Messages are corked into 64KiB writes, as a busy
+ * sender would, so the time is spent moving bytes rather than making
+ * system calls.
+ */
+
+#include "srvsh.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define OP_DATA 1
+#define OP_DONE 2
+
+static long received = 0;
+static bool done = false;
+
+static void count_message(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	if (opcode == OP_DONE) {
+		writesrv(OP_DONE, &received, sizeof(received));
+		received = 0;
+		return;
+	}
+	if (opcode == OP_DATA)
+		received++;
+}
+
+static int sink(void)
+{
+	// compact headers are always read buffered, so read the standard
+	// ones the same way for a fair comparison
+	if (recvbufop(SRV_FILENO, 1 << 16) < 0)
+		return 1;
+
+	for (;;) {
+		struct pollfd result = pollopsrv(count_message, NULL, -1);
+		if (result.fd < 0)
+			return 1;
+		if (result.revents & POLLHUP)
+			return 0;
+	}
+}
+
+static void wait_done(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	if (opcode == OP_DONE) {
+		memcpy(context, buf, sizeof(long));
+		done = true;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool run(const char *header, long messages)
+{
+	setenv("SRVSH_HEADER", header, 1);
+	struct clistate child = cliexecl("/proc/self/exe", "/proc/self/exe", "sink", NULL);
+	unsetenv("SRVSH_HEADER");
+	if (child.socket < 0)
+		return false;
+
+	static const int sizes[] = { 0, 4, 8, 64 };
+	char payload[64] = { 0 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		if (corkop(child.socket, 1 << 16, -1) < 0)
+			return false;
+
+		long bytes = 0;
+		double start = now();
+		for (long sent = 0; sent < messages; sent++) {
+			ssize_t result = writeop(child.socket, OP_DATA, payload, sizes[i]);
+			if (result < 0)
+				return false;
+			bytes += result;
+		}
+		if (flushop(child.socket) < 0 || corkop(child.socket, 0, 0) < 0)
+			return false;
+
+		long counted = 0;
+		done = false;
+		writeop(child.socket, OP_DONE, NULL, 0);
+		struct pollfd fd = { .fd = child.socket };
+		while (!done)
+			if (pollopfd(fd, wait_done, &counted, -1).fd < 0)
+				return false;
+		double elapsed = now() - start;
+
+		printf("%-9s %5d %12.2f %14.0f %12.1f\n",
+			header,
+			sizes[i],
+			(double)bytes / (double)messages,
+			(double)messages / elapsed,
+			(double)bytes / elapsed / (1 << 20));
+		if (counted != messages)
+			printf("%ld of %ld messages arrived\n", counted, messages);
+	}
+
+	close(child.socket);
+	waitpid(child.pid, NULL, 0);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "sink") == 0)
+		return sink();
+
+	long messages = argc > 1 ? atol(argv[1]) : 2000000;
+	if (messages <= 0)
+		return 1;
+
+	printf("%-9s %5s %12s %14s %12s\n",
+		"header", "size", "bytes/msg", "messages/s", "MiB/s");
+	if (!run("standard", messages) || !run("compact", messages)) {
+		perror("header_bench");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,352 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2024  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures the basic costs of talking to other processes: writeop()
+ * throughput and round-trip latency across payload sizes, passing
+ * file descriptors with sendmsgop(), and many clients writing to one
+ * server read with pollopfds().
+ *
+ * usage: ipc_bench [max-clients] [messages]
+ *
+ * A copy of this program is spawned for each client. The results are
+ * printed as tab-separated values, one line per run, so they can be
+ * kept and compared between builds; columns that don't apply to a run
+ * are "-". Latencies are in microseconds.
+ */
+
+#include "srvsh.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define OP_DATA 1
+#define OP_DONE 2
+#define OP_PING 3
+#define OP_GO 4
+
+// fewer messages are sent of the larger sizes, to about this many bytes
+#define THROUGHPUT_BYTES (256L << 20)
+#define LATENCY_BYTES (64L << 20)
+
+struct burst {
+	int messages;
+	int size;
+};
+
+static char payload[4 << 20];
+static long received = 0;
+
+static void child_message(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	close_cmsg_fds(msg);
+
+	switch (opcode) {
+	case OP_DATA:
+		received++;
+		break;
+	case OP_DONE:
+		writesrv(OP_DONE, &received, sizeof(received));
+		received = 0;
+		break;
+	case OP_PING:
+		writesrv(OP_PING, buf, size);
+		break;
+	case OP_GO: {
+		struct burst burst;
+		memcpy(&burst, buf, sizeof(burst));
+		for (int i = 0; i < burst.messages; i++)
+			writesrv(OP_DATA, payload, burst.size);
+		break;
+	}
+	}
+}
+
+static int child(void)
+{
+	for (;;) {
+		struct pollfd result = pollopsrv(child_message, NULL, -1);
+		if (result.fd < 0)
+			return 1;
+		if (result.revents & POLLHUP)
+			return 0;
+	}
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void reply(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	if (opcode == OP_DONE)
+		memcpy(context, buf, sizeof(long));
+	else if (opcode == OP_PING)
+		*(long *)context = size;
+}
+
+static void print_header(void)
+{
+	printf("bench\tsize\tclients\tmessages\tseconds\tmessages/s\tMiB/s\tp50\tp90\tp99\tp99.9\tmax\n");
+}
+
+static void print_row(
+	const char *name,
+	int size,
+	int clients,
+	long messages,
+	unsigned long long elapsed
+)
+{
+	const double seconds = (double)elapsed / 1e9;
+	printf("%s\t%d\t%d\t%ld\t%.6f\t%.0f\t%.1f",
+		name,
+		size,
+		clients,
+		messages,
+		seconds,
+		(double)messages / seconds,
+		(double)messages * size / seconds / (1 << 20));
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	const unsigned long long left = *(const unsigned long long *)a;
+	const unsigned long long right = *(const unsigned long long *)b;
+	return (left > right) - (left < right);
+}
+
+static void print_percentiles(unsigned long long *samples, long count)
+{
+	if (!samples) {
+		printf("\t-\t-\t-\t-\t-\n");
+		return;
+	}
+	qsort(samples, count, sizeof(*samples), compare_ns);
+	static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++)
+		printf("\t%.1f", (double)samples[(long)(percentiles[i] * (count - 1))] / 1e3);
+	printf("\t%.1f\n", (double)samples[count - 1] / 1e3);
+}
+
+static long scaled(long messages, long budget, int size)
+{
+	const long limit = size ? budget / size : messages;
+	return limit < messages ? (limit > 16 ? limit : 16) : messages;
+}
+
+// Sends one message, with a descriptor of /dev/null if fd_to_pass >= 0
+static bool send_one(int fd, int opcode, int size, int fd_to_pass)
+{
+	if (fd_to_pass < 0)
+		return writeop(fd, opcode, payload, size) >= 0;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = { 0 };
+	control.align.cmsg_level = SOL_SOCKET;
+	control.align.cmsg_type = SCM_RIGHTS;
+	control.align.cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(&control.align), &fd_to_pass, sizeof(int));
+	return sendmsgop(fd, opcode, payload, size, &control, sizeof(control)) >= 0;
+}
+
+static bool throughput(const char *name, int fd, int size, long messages, int fd_to_pass)
+{
+	const unsigned long long start = now_ns();
+	for (long i = 0; i < messages; i++)
+		if (!send_one(fd, OP_DATA, size, fd_to_pass))
+			return false;
+
+	long counted = -1;
+	if (writeop(fd, OP_DONE, NULL, 0) < 0)
+		return false;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while (counted < 0)
+		if (pollopfd(pfd, reply, &counted, -1).fd < 0)
+			return false;
+	const unsigned long long elapsed = now_ns() - start;
+
+	print_row(name, size, 1, messages, elapsed);
+	print_percentiles(NULL, 0);
+	if (counted != messages)
+		fprintf(stderr, "%s: %ld of %ld messages arrived\n", name, counted, messages);
+	return true;
+}
+
+static bool latency(const char *name, int fd, int size, long samples, int fd_to_pass)
+{
+	unsigned long long *times = calloc(samples, sizeof(*times));
+	if (!times)
+		return false;
+
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	const unsigned long long start = now_ns();
+	for (long i = 0; i < samples; i++) {
+		const unsigned long long sent = now_ns();
+		if (!send_one(fd, OP_PING, size, fd_to_pass))
+			goto fail;
+		long echoed = -1;
+		while (echoed < 0)
+			if (pollopfd(pfd, reply, &echoed, -1).fd < 0)
+				goto fail;
+		times[i] = now_ns() - sent;
+	}
+
+	print_row(name, size, 1, samples, now_ns() - start);
+	print_percentiles(times, samples);
+	free(times);
+	return true;
+fail:
+	free(times);
+	return false;
+}
+
+/*
+ * Each of the first clients sends its share of the messages at once,
+ * and they're read from all of them with pollopfds().
+ */
+static bool fan_in(const struct clistate *children, int clients, long messages, int size)
+{
+	struct pollfd *polls = calloc(clients, sizeof(*polls));
+	if (!polls)
+		return false;
+	for (int i = 0; i < clients; i++)
+		polls[i] = (struct pollfd) { .fd = children[i].socket, .events = POLLIN };
+
+	const struct burst burst = {
+		.messages = (int)(messages / clients > 0 ? messages / clients : 1),
+		.size = size,
+	};
+	const long expected = (long)burst.messages * clients;
+
+	// counted as a child would count them
+	received = 0;
+	const unsigned long long start = now_ns();
+	for (int i = 0; i < clients; i++)
+		if (writeop(children[i].socket, OP_GO, &burst, sizeof(burst)) < 0)
+			goto fail;
+	while (received < expected)
+		if (pollopfds(polls, clients, child_message, NULL, -1).fd < 0)
+			goto fail;
+	const unsigned long long elapsed = now_ns() - start;
+
+	print_row("fan-in", size, clients, expected, elapsed);
+	print_percentiles(NULL, 0);
+	free(polls);
+	return true;
+fail:
+	free(polls);
+	return false;
+}
+
+static struct clistate spawn(void)
+{
+	return cliexecl("/proc/self/exe", "/proc/self/exe", "child", NULL);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "child") == 0)
+		return child();
+
+	int max_clients = argc > 1 ? atoi(argv[1]) : 1024;
+	long messages = argc > 2 ? atol(argv[2]) : 20000;
+	if (max_clients <= 0 || messages <= 0)
+		return 1;
+
+	// a socket for each client, and a few to spare
+	struct rlimit files = { 0 };
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+	if (files.rlim_cur != RLIM_INFINITY && (rlim_t)max_clients + 32 > files.rlim_cur)
+		max_clients = (int)files.rlim_cur - 32;
+
+	int fd_to_pass = open("/dev/null", O_RDONLY);
+	struct clistate *children = calloc(max_clients, sizeof(*children));
+	if (fd_to_pass < 0 || !children)
+		return 1;
+	children[0] = spawn();
+	if (children[0].socket < 0)
+		goto fail;
+
+	print_header();
+	static const int sizes[] = { 0, 64, 4096, 65536, 1 << 20, 4 << 20 };
+	const int size_count = sizeof(sizes) / sizeof(*sizes);
+	const int fd = children[0].socket;
+	for (int i = 0; i < size_count; i++)
+		if (!throughput("writeop", fd, sizes[i], scaled(messages, THROUGHPUT_BYTES, sizes[i]), -1))
+			goto fail;
+	for (int i = 0; i < size_count; i++)
+		if (!latency("roundtrip", fd, sizes[i], scaled(messages / 2, LATENCY_BYTES, sizes[i]), -1))
+			goto fail;
+	if (
+		!throughput("sendmsgop", fd, 64, messages, fd_to_pass)
+		|| !latency("sendmsgop-rt", fd, 64, messages / 2, fd_to_pass)
+	)
+		goto fail;
+
+	int spawned = 1;
+	for (int clients = 1; clients <= max_clients; clients *= 4) {
+		for (; spawned < clients; spawned++) {
+			children[spawned] = spawn();
+			if (children[spawned].socket < 0)
+				goto fail;
+		}
+		if (!fan_in(children, clients, messages * 5, 64))
+			goto fail;
+		fflush(stdout);
+	}
+
+	for (int i = 0; i < spawned; i++) {
+		close(children[i].socket);
+		waitpid(children[i].pid, NULL, 0);
+	}
+	free(children);
+	close(fd_to_pass);
+	return 0;
+fail:
+	perror("ipc_bench");
+	return 1;
+}
@@ -0,0 +1,172 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2024  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compares lockstep calls, waiting for each reply before the next
+ * request, with pipelined ones, keeping several outstanding.
+ *
+ * usage: rpc_bench [calls] [payload size]
+ *
+ * A copy of this program is spawned to answer the calls, replying to
+ * each with the payload it was sent.
+ */
+
+#include "srvsh.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define OP_ECHO 1
+
+static void answer(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	unsigned id,
+	void *context
+)
+{
+	replyop(fd, id, opcode, buf, size);
+}
+
+static int server(void)
+{
+	// pipelined requests arrive several to a read
+	rpc *served = open_rpc(answer, NULL, NULL);
+	if (!served || recvbufop(SRV_FILENO, 1 << 16) < 0)
+		return 1;
+
+	for (;;) {
+		struct pollfd result = pollopsrv(rpc_callback, served, -1);
+		if (result.fd < 0)
+			return 1;
+		if (result.revents & POLLHUP)
+			break;
+	}
+	close_rpc(served);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+struct run {
+	long completed;
+	double total_latency;
+	double max_latency;
+};
+
+struct call {
+	struct run *run;
+	double start;
+};
+
+static void completed(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	struct call *call = context;
+	double latency = now() - call->start;
+	call->run->completed++;
+	call->run->total_latency += latency;
+	if (latency > call->run->max_latency)
+		call->run->max_latency = latency;
+}
+
+static bool run(int fd, long calls, int window, const char *payload, int size)
+{
+	rpc *caller = open_rpc(NULL, NULL, NULL);
+	struct call *outstanding = calloc(window, sizeof(*outstanding));
+	if (!caller || !outstanding)
+		return false;
+
+	struct run result = { 0 };
+	double start = now();
+	for (long sent = 0; sent < calls || result.completed < sent;) {
+		// each slot is reused once the call in it has completed
+		while (sent < calls && sent - result.completed < window) {
+			struct call *call = &outstanding[sent % window];
+			*call = (struct call) { &result, now() };
+			if (callop(caller, fd, OP_ECHO, payload, size, completed, call) < 0)
+				return false;
+			sent++;
+		}
+
+		if (pollopfd((struct pollfd) { .fd = fd }, rpc_callback, caller, -1).fd < 0)
+			return false;
+	}
+	double elapsed = now() - start;
+
+	printf("%6d %14.0f %14.1f %14.1f\n",
+		window,
+		(double)calls / elapsed,
+		result.total_latency / (double)calls * 1e6,
+		result.max_latency * 1e6);
+
+	free(outstanding);
+	close_rpc(caller);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "server") == 0)
+		return server();
+
+	long calls = argc > 1 ? atol(argv[1]) : 200000;
+	int size = argc > 2 ? atoi(argv[2]) : 64;
+	if (calls <= 0 || size < 0)
+		return 1;
+
+	char *payload = calloc(1, size + 1);
+	struct clistate child = cliexecl("/proc/self/exe", "/proc/self/exe", "server", NULL);
+	if (!payload || child.socket < 0 || recvbufop(child.socket, 1 << 16) < 0) {
+		perror("rpc_bench");
+		return 1;
+	}
+
+	// a window of 1 is lockstep
+	printf("%6s %14s %14s %14s\n", "window", "calls/s", "mean us", "max us");
+	static const int windows[] = { 1, 4, 16, 64, 256 };
+	for (size_t i = 0; i < sizeof(windows) / sizeof(*windows); i++) {
+		if (!run(child.socket, calls, windows[i], payload, size)) {
+			perror("rpc_bench");
+			return 1;
+		}
+	}
+
+	close(child.socket);
+	waitpid(child.pid, NULL, 0);
+	free(payload);
+	return 0;
+}
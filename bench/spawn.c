@@ -0,0 +1,399 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2024  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how long scripts take to start, for a few shapes of
+ * process tree.
+ *
+ * usage: spawn_bench [processes] [runs]
+ *
+ * Each topology is generated as a script of about that many
+ * processes, all of them copies of this program, and run the way srvsh
+ * runs a script, with srvsh_parse_script(). Every copy notes when it
+ * started, and says hello to its server, which notes when it heard
+ * from it. The times, from just before parsing, are the median of the
+ * runs, in milliseconds, printed as tab-separated values:
+ * 	- lex: walking the script's tokens, without starting anything
+ * 	- parse: srvsh_parse_script() returning, after starting the
+ * 	  top-level statements; blocks are parsed in their server's
+ * 	  process
+ * 	- spawned: the last process starting
+ * 	- connected: the last process being heard from by its server
+ *
+ * The topologies are:
+ * 	- wide: a single server with every other process as a client
+ * 	- deep: each process the only client of the one before
+ * 	- mixed: a tree where every server has up to four clients, with
+ * 	  an assignment in front of each server
+ */
+
+#define _GNU_SOURCE
+#include "srvsh.h"
+#include "parse.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <libadt/lptr.h>
+#include <scallop-lang/classifier.h>
+#include <scallop-lang/lex.h>
+
+#define OP_HELLO 1
+
+#define MIXED_FANOUT 4
+
+// shared by every process in a run, through COUNTERS_ENV
+struct counters {
+	atomic_int spawned;
+	atomic_int connected;
+	atomic_ullong start;
+	atomic_ullong parsed;
+	atomic_ullong last_spawned;
+	atomic_ullong last_connected;
+};
+
+#define COUNTERS_ENV "SPAWN_BENCH_COUNTERS"
+
+static struct counters *counters = NULL;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void note(atomic_int *count, atomic_ullong *last)
+{
+	const unsigned long long now = now_ns();
+	unsigned long long seen = atomic_load(last);
+	while (seen < now && !atomic_compare_exchange_weak(last, &seen, now))
+		;
+	atomic_fetch_add(count, 1);
+}
+
+static void hello(
+	int fd,
+	int opcode,
+	void *buf,
+	int size,
+	struct msghdr msg,
+	void *context
+)
+{
+	if (opcode == OP_HELLO)
+		note(&counters->connected, &counters->last_connected);
+}
+
+static struct counters *map_counters(int fd)
+{
+	void *map = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+// Each process in a script runs this, until its server hangs up
+static int node(void)
+{
+	const char *path = getenv(COUNTERS_ENV);
+	int fd = path ? open(path, O_RDWR) : -1;
+	if (fd < 0)
+		return 1;
+	counters = map_counters(fd);
+	close(fd);
+	if (!counters)
+		return 1;
+
+	note(&counters->spawned, &counters->last_spawned);
+	if (writesrv(OP_HELLO, NULL, 0) < 0)
+		return 1;
+
+	for (;;) {
+		struct pollfd result = pollop(hello, NULL, -1);
+		if (result.fd < 0)
+			return 1;
+		if (result.fd == SRV_FILENO && (result.revents & POLLHUP))
+			return 0;
+	}
+}
+
+struct script {
+	char *text;
+	size_t length;
+	int processes;
+};
+
+static void write_wide(FILE *out, const char *self, int processes)
+{
+	fprintf(out, "%s node {\n", self);
+	for (int i = 1; i < processes; i++)
+		fprintf(out, "\t%s node\n", self);
+	fprintf(out, "}\n");
+}
+
+static void write_deep(FILE *out, const char *self, int processes)
+{
+	for (int i = 0; i < processes; i++)
+		fprintf(out, "%*s%s node%s\n", i, "", self, i + 1 < processes ? " {" : "");
+	for (int i = processes - 2; i >= 0; i--)
+		fprintf(out, "%*s}\n", i, "");
+}
+
+// Process i's clients are i * MIXED_FANOUT + 1 onwards
+static void write_mixed_node(FILE *out, const char *self, int processes, int i, int depth)
+{
+	const int first = i * MIXED_FANOUT + 1;
+	if (first >= processes) {
+		fprintf(out, "%*s%s node\n", depth, "", self);
+		return;
+	}
+
+	fprintf(out, "%*sBENCH_DEPTH=%d %s node {\n", depth, "", depth, self);
+	for (int child = first; child < first + MIXED_FANOUT && child < processes; child++)
+		write_mixed_node(out, self, processes, child, depth + 1);
+	fprintf(out, "%*s}\n", depth, "");
+}
+
+static void write_mixed(FILE *out, const char *self, int processes)
+{
+	write_mixed_node(out, self, processes, 0, 0);
+}
+
+static bool generate(
+	struct script *script,
+	void (*write)(FILE *, const char *, int),
+	const char *self,
+	int processes
+)
+{
+	FILE *out = open_memstream(&script->text, &script->length);
+	if (!out)
+		return false;
+	write(out, self, processes);
+	script->processes = processes;
+	return fclose(out) == 0;
+}
+
+static struct libadt_const_lptr script_lptr(const struct script *script)
+{
+	return (struct libadt_const_lptr) {
+		.buffer = script->text,
+		.size = 1,
+		.length = (ssize_t)script->length,
+	};
+}
+
+// The tokens srvsh_parse_script() reads, and the words it copies
+static bool lex(const struct script *script)
+{
+	struct scallop_lang_lex token = scallop_lang_lex_init(script_lptr(script));
+	for (;;) {
+		token = scallop_lang_lex_next(token);
+		if (token.type == scallop_lang_classifier_end)
+			return true;
+		if (token.type == scallop_lang_classifier_unexpected)
+			return false;
+		if (
+			token.type == scallop_lang_classifier_word
+			&& scallop_lang_lex_normalize_word(token.value, (struct libadt_lptr){ 0 }) < 0
+		)
+			return false;
+	}
+}
+
+// The lowest free descriptor, as srvsh works out where clients end
+static int lowest_free_fd(void)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0)
+		close(fd);
+	return fd;
+}
+
+struct timing {
+	double lex;
+	double parse;
+	double spawned;
+	double connected;
+};
+
+// Runs the script as srvsh does, until every process has said hello
+static void shell(const struct script *script)
+{
+	const int first = lowest_free_fd();
+	atomic_store(&counters->start, now_ns());
+	if (srvsh_parse_script(script_lptr(script)) < 0)
+		return;
+	atomic_store(&counters->parsed, now_ns());
+
+	// The top-level processes are our clients
+	const int top = lowest_free_fd() - first;
+	struct pollfd *polls = calloc(top, sizeof(*polls));
+	if (!polls)
+		return;
+	for (int i = 0; i < top; i++)
+		polls[i] = (struct pollfd) { .fd = first + i, .events = POLLIN };
+
+	// The last hello may be to some other server, so keep looking
+	while (atomic_load(&counters->connected) < script->processes)
+		if (pollopfds(polls, top, hello, NULL, 1).fd < 0)
+			break;
+	free(polls);
+}
+
+static bool run(const struct script *script, struct timing *timing)
+{
+	*counters = (struct counters) { 0 };
+
+	const unsigned long long start = now_ns();
+	if (!lex(script))
+		return false;
+	timing->lex = (double)(now_ns() - start) / 1e6;
+
+	// A server's clients can outlive it, so rather than being hung up
+	// on, the whole tree is stopped through its process group
+	const pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		setpgid(0, 0);
+		shell(script);
+		kill(0, SIGKILL);
+		_exit(1);
+	}
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	// and we're their reaper, once the shell is gone
+	while (wait(NULL) >= 0 || errno == EINTR)
+		;
+
+	const unsigned long long began = atomic_load(&counters->start);
+	timing->parse = (double)(atomic_load(&counters->parsed) - began) / 1e6;
+	timing->spawned = (double)(atomic_load(&counters->last_spawned) - began) / 1e6;
+	timing->connected = (double)(atomic_load(&counters->last_connected) - began) / 1e6;
+	return atomic_load(&counters->parsed)
+		&& atomic_load(&counters->spawned) == script->processes
+		&& atomic_load(&counters->connected) == script->processes;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	const double left = *(const double *)a;
+	const double right = *(const double *)b;
+	return (left > right) - (left < right);
+}
+
+static double median(double *values, int count)
+{
+	qsort(values, count, sizeof(*values), compare_double);
+	return values[count / 2];
+}
+
+static bool measure(const char *name, const struct script *script, int runs)
+{
+	double *values = calloc((size_t)runs * 4, sizeof(*values));
+	if (!values)
+		return false;
+	double *lexes = values;
+	double *parses = values + runs;
+	double *spawns = values + runs * 2;
+	double *connects = values + runs * 3;
+
+	for (int i = 0; i < runs; i++) {
+		struct timing timing = { 0 };
+		if (!run(script, &timing)) {
+			fprintf(stderr, "%s: not every process started\n", name);
+			free(values);
+			return false;
+		}
+		lexes[i] = timing.lex;
+		parses[i] = timing.parse;
+		spawns[i] = timing.spawned;
+		connects[i] = timing.connected;
+	}
+
+	printf("%s\t%d\t%zu\t%.3f\t%.3f\t%.3f\t%.3f\n",
+		name,
+		script->processes,
+		script->length,
+		median(lexes, runs),
+		median(parses, runs),
+		median(spawns, runs),
+		median(connects, runs));
+	fflush(stdout);
+	free(values);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "node") == 0)
+		return node();
+
+	int processes = argc > 1 ? atoi(argv[1]) : 256;
+	int runs = argc > 2 ? atoi(argv[2]) : 5;
+	if (processes <= 0 || runs <= 0)
+		return 1;
+
+	char self[4096];
+	const ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (length < 0)
+		return 1;
+	self[length] = '\0';
+
+	// Every process opens the counters through our descriptor
+	int fd = memfd_create("spawn_bench", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, sizeof(*counters)) < 0 || !(counters = map_counters(fd)))
+		return 1;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)getpid(), fd);
+	if (setenv(COUNTERS_ENV, path, 1) < 0)
+		return 1;
+	if (prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+		return 1;
+
+	static const struct {
+		const char *name;
+		void (*write)(FILE *, const char *, int);
+	} topologies[] = {
+		{ "wide", write_wide },
+		{ "deep", write_deep },
+		{ "mixed", write_mixed },
+	};
+
+	printf("topology\tprocesses\tbytes\tlex\tparse\tspawned\tconnected\n");
+	for (size_t i = 0; i < sizeof(topologies) / sizeof(*topologies); i++) {
+		struct script script = { 0 };
+		if (!generate(&script, topologies[i].write, self, processes))
+			return 1;
+		const bool measured = measure(topologies[i].name, &script, runs);
+		free(script.text);
+		if (!measured)
+			return 1;
+	}
+	return 0;
+}
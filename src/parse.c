@@ -1,6 +1,9 @@
 #include "srvsh/parse.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -38,6 +41,8 @@ typedef struct scallop_lang_lex token_t;
 
 #define LPTR_WITH LIBADT_LPTR_WITH
 
+extern char **environ;
+
 typedef struct word_list_s {
 	lptr_t word;
 	struct word_list_s *next;
@@ -69,6 +74,62 @@ static char** word_list_to_array(word_list_t *words, int count)
 	return error;
 }
 
+/*
+ * Returns true for words of the form NAME=value, which set an
+ * environment variable for the command they come before.
+ */
+static bool is_assignment(const char *word)
+{
+	if (!isalpha((unsigned char)*word) && *word != '_')
+		return false;
+
+	for (; *word && *word != '='; word++)
+		if (!isalnum((unsigned char)*word) && *word != '_')
+			return false;
+	return *word == '=';
+}
+
+static int count_assignments(char **statement)
+{
+	int count = 0;
+	while (statement[count] && is_assignment(statement[count]))
+		count++;
+	return count;
+}
+
+static bool apply_assignments(char **assignments, int count)
+{
+	for (int i = 0; i < count; i++) {
+		char *value = strchr(assignments[i], '=');
+		*value = '\0';
+		const int result = setenv(assignments[i], value + 1, 1);
+		*value = '=';
+		if (result < 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Returns a copy of the current environment with the assignments
+ * added to the end, where they take precedence.
+ */
+static char **with_assignments(char **assignments, int count)
+{
+	int length = 0;
+	while (environ[length])
+		length++;
+
+	// +1 for the NULL terminator
+	char **envp = calloc((size_t)(length + count) + 1, sizeof(char*));
+	if (!envp)
+		return NULL;
+
+	memcpy(envp, environ, (size_t)length * sizeof(char*));
+	memcpy(envp + length, assignments, (size_t)count * sizeof(char*));
+	return envp;
+}
+
 static token_t skip_context(token_t token)
 {
 	token = token_next(token);
@@ -96,10 +157,22 @@ static token_t parse_script_impl(
 	token_t token
 );
 
+struct subtree {
+	token_t token;
+	char **assignments;
+	int count;
+};
+
 static bool spawn_clients(void *context)
 {
-	token_t *token = context;
-	token_t result = parse_script_impl(*token);
+	struct subtree *subtree = context;
+
+	// The assignments in front of a server apply to everything
+	// started in its block too
+	if (!apply_assignments(subtree->assignments, subtree->count))
+		return false;
+
+	token_t result = parse_script_impl(subtree->token);
 	const bool error = result.type == NULL
 		|| result.type == lex_unexpected;
 
@@ -155,7 +228,29 @@ static token_t parse_statement_impl(
 		char **statement = word_list_to_array(previous, count);
 		if (!statement)
 			return resource_error;
-		srvexecvp(spawn_clients, &token, *statement, statement);
+
+		// a block needs a server to run it
+		const int assignments = count_assignments(statement);
+		char **command = statement + assignments;
+		if (!*command) {
+			free(statement);
+			token.type = lex_unexpected;
+			return token;
+		}
+
+		char **envp = with_assignments(statement, assignments);
+		if (!envp) {
+			free(statement);
+			return resource_error;
+		}
+
+		struct subtree subtree = {
+			token,
+			statement,
+			assignments,
+		};
+		srvexecvpe(spawn_clients, &subtree, *command, command, envp);
+		free(envp);
 		free(statement);
 
 		token = skip_context(token);
@@ -168,7 +263,23 @@ static token_t parse_statement_impl(
 		char **statement = word_list_to_array(previous, count);
 		if (!statement)
 			return resource_error;
-		cliexecvp(*statement, statement);
+
+		// Assignments on their own apply to the statements after them
+		const int assignments = count_assignments(statement);
+		char **command = statement + assignments;
+		if (!*command) {
+			const bool applied = apply_assignments(statement, assignments);
+			free(statement);
+			return applied ? token : resource_error;
+		}
+
+		char **envp = with_assignments(statement, assignments);
+		if (!envp) {
+			free(statement);
+			return resource_error;
+		}
+		cliexecvpe(*command, command, envp);
+		free(envp);
 		free(statement);
 		return token;
 	}
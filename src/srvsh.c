@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "srvsh/srvsh.h"
+#include "srvsh/trace.h"
 
 #include <stdbool.h>
 #include <unistd.h>
@@ -15,13 +17,37 @@
 #include <glob.h>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 #include <libadt.h>
 
+#ifdef SRVSH_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#ifdef SRVSH_ZLIB
+#include <zlib.h>
+#endif
+
 #define MAX libadt_util_max
 #define MIN libadt_util_min
 #define SIGNAL_RETURN_VALUE(x) (128 + (x))
@@ -37,513 +63,7244 @@ typedef enum {
 	ERROR,
 } pollfd_read_t;
 
+// matches the ancillary buffer process_pollfd() has always used
+#define CMSG_BUFFER_SIZE 1024
+
 /*
- * Returns the amount of space necessary for a null-terminated
- * string. Always terminates the string with a null.
+ * The largest record sent on a SOCK_SEQPACKET connection. Frames
+ * larger than this are split across several records, which keeps
+ * them under the kernel's limit and lets the receiver always have
+ * room for a whole record.
+ */
+#define SEQPACKET_RECORD 65536
+
+/*
+ * The smallest payload broadcastop() writes once to a memfd, rather
+ * than into every client's socket.
+ */
+#define BROADCAST_BULK_MIN 65536
+
+/*
+ * The smallest body a forwarding rule splices from one socket to the
+ * other, rather than reading it in; below this, the extra system
+ * calls cost more than the copy. A whole body is taken into the pipe
+ * before any of the frame is sent, so the pipe is asked to hold the
+ * most an unprivileged process can have by default, and larger
+ * bodies are read in.
+ */
+#define FORWARD_SPLICE_MIN 16384
+#define FORWARD_PIPE_SIZE (1 << 20)
+
+/*
+ * The most bytes a header can take on the wire. A compact header is
+ * a varint opcode, zigzag-encoded so negative opcodes stay short,
+ * followed by a varint size, each at most five bytes.
+ */
+#define HEADER_MAX 10
+
+/*
+ * Receive state for a connection in buffered mode.
  *
- * Seriously, why does C leave footguns like this all over the
- * place...?
+ * Bytes between start and end have been received but not yet
+ * passed to a callback. Ancillary data is held until the frame
+ * it arrived with is delivered; cmsg_at is the offset of that
+ * frame's header.
  */
-static int vslprintf(char *str, size_t size, const char *format, va_list list)
+struct recvbuf {
+	char *buffer;
+	size_t size;
+	size_t start;
+	size_t end;
+	bool delivering;
+	bool has_cmsg;
+	size_t cmsg_at;
+	size_t cmsg_len;
+	char cmsg[CMSG_BUFFER_SIZE];
+
+	// Set for SOCK_SEQPACKET connections, where a read that doesn't
+	// fit the whole record loses the rest of it
+	bool records;
+	bool compact;
+
+	// Set up by the pollop* functions to hold a frame that arrived in
+	// pieces on an unbuffered connection, and dropped once it's empty
+	bool transient;
+
+	// A read handed to io_uring, which owns the space after end
+	// until it completes
+	bool armed;
+	struct iovec pending_iov;
+	struct msghdr pending_msg;
+};
+
+/*
+ * Send state for a corked connection.
+ *
+ * Frames are appended to the buffer until it fills, flushop() is
+ * called, or the deadline passes. Buffers holding data with a
+ * deadline are kept on the pending list so the pollop* functions
+ * can find them without walking every connection.
+ */
+struct sendbuf {
+	int fd;
+	char *buffer;
+	size_t size;
+	size_t length;
+	int delay;
+	long long deadline;
+	struct sendbuf *prev;
+	struct sendbuf *next;
+
+	// A flush handed to io_uring; appends carry on in buffer
+	// while the kernel sends from spare
+	bool sending;
+	char *spare;
+	size_t spare_length;
+	size_t spare_sent;
+};
+
+/*
+ * A write that a non-blocking connection couldn't send straight away.
+ * Each one holds what a single sendmsg() call would have sent, along
+ * with duplicates of any file descriptors it passes, which are closed
+ * once the first byte has gone.
+ */
+struct outmsg {
+	struct outmsg *next;
+	size_t length;
+	size_t sent;
+	size_t cmsg_len;
+	char *cmsg;
+	char data[];
+};
+
+/*
+ * The writes waiting on a non-blocking connection. Queues holding
+ * data are kept on the writable list, so the pollop* functions can
+ * wait for their sockets to drain.
+ *
+ * A blocking connection only has one when broadcastop() left the
+ * rest of a frame behind for a client that wouldn't take it; the
+ * next write waits for that, as a blocking write would have.
+ */
+struct outq {
+	int fd;
+	bool blocking;
+	size_t limit;
+	size_t queued;
+	struct outmsg *head;
+	struct outmsg **tail;
+	struct outq *prev;
+	struct outq *next;
+};
+
+/*
+ * Opcodes libsrvsh sends for its own purposes. These are handled by
+ * deliver() and never reach a callback.
+ */
+enum {
+	OP_SHM_OFFER = SRVSH_OPCODE_RESERVED,
+	OP_SHM_START,
+	OP_SHM_DOORBELL,
+	OP_SHM_SOCKET,
+	OP_BULK,
+	OP_COMPRESSED,
+	OP_RPC_CALL,
+	OP_RPC_REPLY,
+	OP_CREDIT,
+};
+
+static bool opcode_is_reserved(int opcode)
 {
-	int result = vsnprintf(str, size, format, list) + 1;
-	int last = MIN(result, size) - 1;
-	if (str && size > 0)
-		str[last] = '\0';
-	return result;
+	return opcode >= SRVSH_OPCODE_RESERVED && opcode <= SRVSH_OPCODE_RESERVED + 255;
 }
 
-static int slprintf(char *str, size_t size, const char *format, ...)
+/*
+ * The payload of an OP_COMPRESSED frame, followed by the compressed
+ * bytes.
+ */
+struct compressed_header {
+	int opcode;
+	int codec;
+	int size;
+};
+
+/*
+ * Compression settings and counters for a connection. A threshold of
+ * 0 means messages sent on it aren't compressed, though ones received
+ * still are decompressed and counted.
+ */
+struct compress {
+	enum compress_codec codec;
+	size_t threshold;
+	struct compress_stats stats;
+};
+
+/*
+ * Where messages from a connection are forwarded to, by opcode.
+ */
+struct forward_rule {
+	int opcode;
+	int to;
+};
+
+struct forward {
+	struct forward_rule *rules;
+	int count;
+	bool all;
+	int all_to;
+};
+
+/*
+ * A message held back until the peer grants the credit to send it.
+ */
+struct heldmsg {
+	struct heldmsg *next;
+	int opcode;
+	int size;
+	// The connection a forwarded message came from, which gets its
+	// credit back once the message is sent, or -1
+	int from;
+	size_t cmsg_len;
+	char *cmsg;
+	char data[];
+};
+
+/*
+ * Credit-based flow control for a connection, in both directions.
+ * The first half is what this end may still send, as granted by the
+ * peer; the second is the window this end grants the peer, given
+ * back as its messages are handled. Bytes are payload bytes as sent
+ * on the wire, so the two ends count them the same way.
+ */
+struct credit {
+	bool limited;
+	bool bytes_limited;
+	long messages;
+	long long bytes;
+	struct heldmsg *head;
+	struct heldmsg **tail;
+	size_t held;
+	size_t held_bytes;
+	unsigned long stalls;
+	// The most the peer has granted at once, which is as much as
+	// the sender's own messages may be held
+	long peer_window;
+	long long peer_window_bytes;
+
+	int window;
+	int window_bytes;
+	int handled;
+	long long handled_bytes;
+};
+
+/*
+ * The payload of an OP_CREDIT frame. Negative messages lift the
+ * limit altogether, and negative bytes mean bytes aren't limited.
+ */
+struct credit_grant {
+	int messages;
+	int bytes;
+};
+
+/*
+ * One direction of a shared-memory connection. Positions only ever
+ * increase, and are reduced modulo the ring size when used. The two
+ * halves are on separate cache lines, since each is written by a
+ * different process.
+ */
+struct shm_ring {
+	_Alignas(64) uint32_t head;
+	uint32_t writer_waiting;
+	_Alignas(64) uint32_t tail;
+	uint32_t reader_idle;
+};
+
+/*
+ * The first page of the memfd shared by both ends of a connection.
+ * The ring data follows, one ring after another.
+ */
+struct shm_layout {
+	struct shm_ring rings[2];
+	uint32_t size;
+};
+
+/*
+ * A process's view of a shared-memory connection. Each ring's data is
+ * mapped twice in a row, so a frame that wraps around the end can still
+ * be read and written as one piece.
+ *
+ * sending is set once OP_SHM_START has been sent, and receiving once
+ * it has been received; before that, messages use the socket.
+ */
+struct shm {
+	struct shm_layout *layout;
+	struct shm_ring *tx;
+	struct shm_ring *rx;
+	char *tx_data;
+	char *rx_data;
+	uint32_t size;
+	bool sending;
+	bool receiving;
+	bool at_marker;
+	// Frames that came over the socket before their markers were in
+	// the ring, whose markers are skipped when they turn up
+	unsigned markers_owed;
+};
+
+/*
+ * What a connection has sent and received, as the application sees
+ * it: one message per call, whatever libsrvsh wrapped it in.
+ */
+struct traffic {
+	atomic_ulong messages_in;
+	atomic_ulong bytes_in;
+	atomic_ulong messages_out;
+	atomic_ulong bytes_out;
+	atomic_ulong errors;
+	atomic_ulong hangups;
+};
+
+/*
+ * Library-side state for a single file descriptor, created the
+ * first time a feature needs to remember something about it.
+ */
+struct conn {
+	struct recvbuf *recv;
+	struct sendbuf *send;
+	struct shm *shm;
+	bool shm_probed;
+	// The ring a spawner's server offers once it has exec'd
+	size_t shm_ring;
+	int type;
+	struct outq *out;
+
+	// Settings taken from the spawned program's environment
+	bool configured;
+	bool compact;
+	struct compress *compress;
+	struct credit *credit;
+	struct forward *forward;
+
+	struct traffic traffic;
+
+	// Bumped each time the connection is forgotten, so state kept
+	// outside of it can tell the descriptor number has been reused
+	atomic_uint generation;
+};
+
+static struct sendbuf *pending_sends = NULL;
+static struct outq *pending_writes = NULL;
+
+static struct conn **conns = NULL;
+static int conns_size = 0;
+
+static struct conn *find_conn(int fd)
 {
-	va_list list;
-	va_start(list, format);
-	int result = vslprintf(str, size, format, list);
-	va_end(list);
-	return result;
+	if (fd < 0 || fd >= conns_size)
+		return NULL;
+	return conns[fd];
 }
 
-static void fork_waiter(
-	int (*exec)(const char *, char * const*),
-	const char *path,
-	char * const argv[]
-)
+static void traffic_setup(void);
+static void trace_setup(void);
+
+static struct conn *get_conn(int fd)
 {
-	switch (fork()) {
-		case -1:
-			exit(1);
-		case 0:
-			exec(path, argv);
-			exit(1);
-		default: {
-			int worst_exit = EXIT_SUCCESS;
-			int wstatus;
-			int wreturn;
-			while ((wreturn = wait(&wstatus))) {
-				if (wreturn < 0 && errno == ECHILD)
-					exit(worst_exit);
-				if (WIFEXITED(wstatus))
-					worst_exit = MAX(worst_exit, WEXITSTATUS(wstatus));
-				else if (WIFSIGNALED(wstatus))
-					worst_exit = MAX(worst_exit, SIGNAL_RETURN_VALUE(WTERMSIG(wstatus)));
-			}
-			exit(worst_exit);
-		}
+	if (fd < 0)
+		return NULL;
+
+	if (fd >= conns_size) {
+		int new_size = MAX(fd + 1, conns_size * 2);
+		struct conn **attempt = realloc(
+			conns,
+			(size_t)new_size * sizeof(*conns)
+		);
+		if (!attempt)
+			return NULL;
+
+		memset(
+			attempt + conns_size,
+			0,
+			(size_t)(new_size - conns_size) * sizeof(*conns)
+		);
+		conns = attempt;
+		conns_size = new_size;
 	}
-}
 
-int cli_end(void)
-{
-	static int _cli_end = 0;
-	if (!_cli_end) {
-		const char *envvar = getenv("SRVSH_CLIENTS_END");
-		if (!envvar)
-			_cli_end = CLI_BEGIN;
-		else
-			_cli_end = atoi(envvar);
+	if (!conns[fd]) {
+		conns[fd] = calloc(1, sizeof(**conns));
+		traffic_setup();
+		trace_setup();
 	}
-	return _cli_end;
+	return conns[fd];
 }
 
-int cli_count(void)
+/*
+ * Returns SOCK_STREAM or SOCK_SEQPACKET for a connection, asking the
+ * kernel the first time.
+ */
+static int socket_type(int fd)
 {
-	return cli_end() - CLI_BEGIN;
+	struct conn *conn = get_conn(fd);
+	if (conn && conn->type)
+		return conn->type;
+
+	int type = SOCK_STREAM;
+	socklen_t length = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0)
+		type = SOCK_STREAM;
+
+	if (conn)
+		conn->type = type;
+	return type;
 }
 
-bool is_cli(int fd)
+/*
+ * Looks a variable up in an environment that isn't necessarily the
+ * current one. As with putenv(), the last definition wins.
+ */
+static const char *env_value(char *const envp[], const char *name)
 {
-	return CLI_BEGIN <= fd
-		&& fd < cli_end();
+	const char *value = NULL;
+	const size_t length = strlen(name);
+	for (char *const *env = envp; env && *env; env++)
+		if (strncmp(*env, name, length) == 0 && (*env)[length] == '=')
+			value = *env + length + 1;
+	return value;
 }
 
-static const char *next_line(const char *str)
+static bool is_compact_header(const char *value)
 {
-	for (; *str; str++) {
-		if (*str == '\n') {
-			return ++str;
-		}
-	}
-	return str;
+	return value && strcmp(value, "compact") == 0;
 }
 
-static const char *skip_spaces(const char *str)
+#ifdef SRVSH_ZLIB
+#define COMPRESS_DEFAULT COMPRESS_ZLIB
+#else
+#define COMPRESS_DEFAULT COMPRESS_LZ
+#endif
+
+/*
+ * Parses a size in bytes with an optional k or M suffix. Returns 0 for
+ * sizes over INT_MAX.
+ */
+static size_t size_setting(const char *value, char **end)
 {
-	for (; *str; str++) {
-		if (!isspace(*str))
-			break;
+	char *suffix = NULL;
+	unsigned long long size = strtoull(value, &suffix, 10);
+	if (*suffix == 'k' || *suffix == 'K') {
+		size <<= 10;
+		suffix++;
+	} else if (*suffix == 'm' || *suffix == 'M') {
+		size <<= 20;
+		suffix++;
 	}
-	return str;
+
+	if (end)
+		*end = suffix;
+	return size > INT_MAX ? 0 : (size_t)size;
 }
 
-static const char *skip_words(const char *str)
+/*
+ * Parses SRVSH_COMPRESS, which is a threshold in bytes with an optional
+ * k or M suffix, optionally preceded by "lz:" or "zlib:" to pick the
+ * codec. Returns 0 if compression isn't wanted.
+ */
+static size_t compress_setting(const char *value, enum compress_codec *codec)
 {
-	for (; *str; str++) {
-		if (!isalnum(*str) && !ispunct(*str))
-			break;
+	*codec = COMPRESS_DEFAULT;
+	if (!value)
+		return 0;
+
+	if (strncmp(value, "lz:", 3) == 0) {
+		*codec = COMPRESS_LZ;
+		value += 3;
+	} else if (strncmp(value, "zlib:", 5) == 0) {
+		*codec = COMPRESS_ZLIB;
+		value += 5;
 	}
-	return str;
+
+	return size_setting(value, NULL);
 }
 
-int get_opcode(const opcode_db *db, const char *name)
+/*
+ * Parses SRVSH_CREDIT, which is a window of messages, optionally
+ * followed by a colon and a window of bytes in the same form as
+ * SRVSH_COMPRESS. Returns false if flow control isn't wanted.
+ */
+static bool credit_setting(const char *value, int *messages, int *bytes)
 {
-	char **files = (char **)db;
-	const size_t len = strlen(name);
-	int current = 0;
+	if (!value)
+		return false;
 
-	for (; *files; files++) {
-		char *value_end = *files;
-		for (const char *line = *files; *line; line = next_line(value_end)) {
-			const char *name_start = skip_spaces(line);
+	char *end = NULL;
+	const long count = strtol(value, &end, 10);
+	if (count <= 0 || count > INT_MAX)
+		return false;
 
-			if (name_start[0] == '#') {
-				value_end = (char*)name_start;
-				continue;
-			}
+	*messages = (int)count;
+	*bytes = *end == ':' ? (int)size_setting(end + 1, NULL) : 0;
+	return true;
+}
 
-			const char *name_end = skip_words(name_start);
-			const bool selected = !strncmp(name_start, name, len);
-			const bool common_prefix = selected && name_end - name_start != (ssize_t)len;
+static int set_compress(struct conn *conn, enum compress_codec codec, size_t threshold);
+static struct credit *get_credit(struct conn *conn);
 
-			long attempt = strtol(name_end, &value_end, 10);
+/*
+ * Applies the settings the environment of a spawned program asks for
+ * to one of its connections. Both ends of a connection decide from
+ * the same environment: the spawned program for its server socket,
+ * the first time it's used, and the spawning end in exec_impl(), or
+ * after it has exec'd, through clients_configure().
+ */
+static void conn_configure(struct conn *conn, char *const envp[])
+{
+	conn->configured = true;
+	conn->compact = is_compact_header(env_value(envp, "SRVSH_HEADER"));
+	if (conn->recv)
+		conn->recv->compact = conn->compact;
 
-			const bool error
-				= attempt > INT_MAX
-				|| attempt < 0;
+	enum compress_codec codec = COMPRESS_DEFAULT;
+	size_t threshold = compress_setting(env_value(envp, "SRVSH_COMPRESS"), &codec);
+	if (threshold)
+		set_compress(conn, codec, threshold);
 
-			if (error)
-				return -1;
+	// Both ends start out with the window, so neither has to wait
+	// for a grant before sending
+	int messages = 0;
+	int bytes = 0;
+	struct credit *credit = NULL;
+	if (
+		credit_setting(env_value(envp, "SRVSH_CREDIT"), &messages, &bytes)
+		&& (credit = get_credit(conn))
+	) {
+		credit->window = credit->messages = messages;
+		credit->window_bytes = bytes;
+		credit->bytes = bytes;
+		credit->peer_window = messages;
+		credit->peer_window_bytes = bytes;
+		credit->bytes_limited = bytes > 0;
+		credit->limited = true;
+	}
+}
 
-			const bool autoval = value_end == name_end;
+/*
+ * Clients started by a spawner are set up before their server is
+ * exec'd, in memory the exec throws away, so exec_impl() passes their
+ * settings on in SRVSH_CLIENTS_CONFIG: each client's descriptor and the
+ * variables that chose its settings, separated by commas, for each
+ * client with any, separated by spaces.
+ */
+#define CLIENT_SETTINGS_MAX 192
+#define CLIENT_SETTINGS_COUNT 8
 
-			if (autoval)
-				current++;
-			else
-				current = (int)attempt;
+// Set once the settings have been applied, or can't apply here
+static bool clients_configured = false;
 
-			if (selected && !common_prefix)
-				return current;
-		}
-	}
-	return -1;
+// Set in a spawner, whose clients' server is yet to exec
+static bool spawning_clients = false;
+
+static void shm_offer(int fd, const char *ring_size);
+
+// Writes the variables that give a connection its settings
+static bool conn_describe(const struct conn *conn, char *out, size_t size)
+{
+	int length = 0;
+	*out = '\0';
+	if (conn->compact)
+		length += snprintf(out + length, size - length, ",SRVSH_HEADER=compact");
+	if (conn->shm_ring)
+		length += snprintf(out + length, size - length, ",SRVSH_SHM_RING=%zu", conn->shm_ring);
+	if (conn->compress && conn->compress->threshold)
+		length += snprintf(
+			out + length,
+			size - length,
+			",SRVSH_COMPRESS=%s%zu",
+			conn->compress->codec == COMPRESS_ZLIB ? "zlib:" : "lz:",
+			conn->compress->threshold
+		);
+	if (conn->credit && conn->credit->window)
+		length += snprintf(
+			out + length,
+			size - length,
+			",SRVSH_CREDIT=%d:%d",
+			conn->credit->window,
+			conn->credit->window_bytes
+		);
+	return length > 0 && (size_t)length < size;
 }
 
-static char *map_path(const char *path)
+static bool clients_describe(int end)
 {
-	int fd = open(path, O_RDONLY);
-	if (fd < 0)
-		return NULL;
+	const int count = end - CLI_BEGIN;
+	if (count <= 0)
+		return unsetenv("SRVSH_CLIENTS_CONFIG") == 0;
 
-	off_t length = lseek(fd, 0, SEEK_END);
-	if (length <= 0) {
-		close(fd);
-		return NULL;
+	// each client's settings, with room for its descriptor
+	const size_t size = (size_t)count * (CLIENT_SETTINGS_MAX + 16);
+	char *value = malloc(size);
+	if (!value)
+		return false;
+
+	size_t length = 0;
+	for (int fd = CLI_BEGIN; fd < end; fd++) {
+		const struct conn *conn = find_conn(fd);
+		char settings[CLIENT_SETTINGS_MAX];
+		if (!conn || !conn_describe(conn, settings, sizeof(settings)))
+			continue;
+		length += snprintf(
+			value + length,
+			size - length,
+			"%s%d%s",
+			length ? " " : "",
+			fd,
+			settings
+		);
 	}
 
-	char *raw_file = mmap(
-		NULL,
-		(size_t)length,
-		PROT_READ,
-		MAP_PRIVATE,
-		fd,
-		0
-	);
-	close(fd);
-	return raw_file;
+	const int result = length ?
+		setenv("SRVSH_CLIENTS_CONFIG", value, 1) :
+		unsetenv("SRVSH_CLIENTS_CONFIG");
+	free(value);
+	return result == 0;
 }
 
-opcode_db *open_opcode_db_at(const char *db_path)
+static void clients_configure(void)
 {
-	// haven't made up my mind whether it's better to return
-	// the pattern, the globs object, or the file contents
-	//
-	// in reality the best solution would probably to build
-	// a whole-ass hashtable or something but I'm far too
-	// lazy for that
-	//
-	// Also this function is a perfect example of why I hate
-	// returning heap-allocated memory. Whatever. Applications should
-	// call this at the beginning, get the codes they need, then
-	// free before doing any real work anyway.
-	if (!db_path)
-		return NULL;
+	if (clients_configured)
+		return;
+	clients_configured = true;
 
-	int pattern_length = slprintf(NULL, 0, "%s{,.d/*}", db_path);
-	if (pattern_length < 0)
-		return NULL;
+	const char *value = getenv("SRVSH_CLIENTS_CONFIG");
+	char *copy = value ? strdup(value) : NULL;
+	if (!copy)
+		return;
 
-	int success = 0;
-	char **result = NULL;
-	glob_t globs = { 0 };
+	char *clients = NULL;
+	for (
+		char *client = strtok_r(copy, " ", &clients);
+		client;
+		client = strtok_r(NULL, " ", &clients)
+	) {
+		char *settings = NULL;
+		const int fd = atoi(strtok_r(client, ",", &settings));
+		char *envp[CLIENT_SETTINGS_COUNT + 1] = { 0 };
+		for (
+			int i = 0;
+			i < CLIENT_SETTINGS_COUNT && (envp[i] = strtok_r(NULL, ",", &settings));
+			i++
+		)
+			;
+
+		struct conn *conn = is_cli(fd) ? get_conn(fd) : NULL;
+		if (conn) {
+			conn_configure(conn, envp);
+			shm_offer(fd, env_value(envp, "SRVSH_SHM_RING"));
+		}
+	}
+	free(copy);
+}
+
+static struct conn *find_configured(int fd)
+{
+	clients_configure();
+
+	struct conn *conn = find_conn(fd);
+	if (fd == SRV_FILENO && !(conn && conn->configured)) {
+		conn = get_conn(fd);
+		if (conn)
+			conn_configure(conn, environ);
+	}
+	return conn;
+}
+
+/*
+ * The ring written when SRVSH_TRACE is set, mapped from a file so it
+ * outlives the process. Any thread claims a record by bumping the
+ * head, and zeroes the slot's sequence while it writes, so the reader
+ * skips a record it catches half written. A writer that laps a slow
+ * one while both are still writing the same slot can leave a record
+ * mixing the two under the later one's sequence, which the reader
+ * can't tell apart; that takes the whole ring being claimed during a
+ * handful of stores, so it isn't guarded against.
+ */
+#define TRACE_SIZE_DEFAULT (4 << 20)
+#define TRACE_RECORDS_MIN 64
+
+static struct {
+	struct trace_file *file;
+	struct trace_record *records;
+	int32_t pid;
+} trace = { 0 };
+
+static unsigned long long now_ns(void);
+
+static void trace_forked(void)
+{
+	// a forked child keeps writing to its parent's ring until it execs
+	trace.pid = (int32_t)getpid();
+}
+
+/*
+ * Reads SRVSH_TRACE, which is the directory to write the trace to,
+ * optionally followed by a colon and the size of the file in the same
+ * form as SRVSH_COMPRESS.
+ */
+static void trace_setup(void)
+{
+	static bool done = false;
+	if (done)
+		return;
+	done = true;
+
+	const char *value = getenv("SRVSH_TRACE");
+	if (!value || !*value)
+		return;
+
+	size_t dir_length = strlen(value);
+	size_t size = TRACE_SIZE_DEFAULT;
+	const char *colon = strrchr(value, ':');
+	if (colon && isdigit((unsigned char)colon[1])) {
+		dir_length = (size_t)(colon - value);
+		size = size_setting(colon + 1, NULL);
+	}
+
+	uint64_t capacity = size > sizeof(struct trace_file)
+		? (size - sizeof(struct trace_file)) / sizeof(struct trace_record)
+		: 0;
+	if (capacity < TRACE_RECORDS_MIN)
+		capacity = TRACE_RECORDS_MIN;
+	size = sizeof(struct trace_file) + capacity * sizeof(struct trace_record);
+
+	char path[PATH_MAX];
+	const int length = snprintf(
+		path,
+		sizeof(path),
+		"%.*s/srvsh-%d.trace",
+		(int)dir_length,
+		value,
+		(int)getpid()
+	);
+	if (length < 0 || (size_t)length >= sizeof(path))
+		return;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	void *map = MAP_FAILED;
+	if (ftruncate(fd, (off_t)size) == 0)
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(path);
+		return;
+	}
+
+	trace.file = map;
+	trace.records = (struct trace_record *)(trace.file + 1);
+	trace.pid = (int32_t)getpid();
+	trace.file->version = TRACE_VERSION;
+	trace.file->capacity = capacity;
+	atomic_store_explicit(&trace.file->head, 0, memory_order_relaxed);
+	// the magic goes last, so a reader never sees half a header
+	atomic_thread_fence(memory_order_release);
+	trace.file->magic = TRACE_MAGIC;
+	pthread_atfork(NULL, NULL, trace_forked);
+}
+
+static void trace_event(enum trace_direction direction, int fd, int opcode, size_t len)
+{
+	if (!trace.file)
+		return;
+
+	const uint64_t index = atomic_fetch_add_explicit(
+		&trace.file->head,
+		1,
+		memory_order_relaxed
+	);
+	struct trace_record *record = &trace.records[index % trace.file->capacity];
+	atomic_store_explicit(&record->sequence, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	record->time = now_ns();
+	record->size = len;
+	record->pid = trace.pid;
+	record->fd = fd;
+	record->opcode = opcode;
+	record->direction = direction;
+	atomic_store_explicit(&record->sequence, index + 1, memory_order_release);
+}
+
+/*
+ * Messages and bytes for each opcode, across every connection. The
+ * table never grows, so it's updated without a lock from any thread;
+ * opcodes that don't fit are only counted per connection.
+ */
+#define OPCODE_TRAFFIC 1024
+
+struct opcode_traffic {
+	// the opcode with its sign bit flipped, so 0 is SRVSH_OPCODE_RESERVED,
+	// which is never counted, and marks a free slot
+	atomic_uint key;
+	atomic_ulong messages_in;
+	atomic_ulong bytes_in;
+	atomic_ulong messages_out;
+	atomic_ulong bytes_out;
+};
+
+static struct opcode_traffic opcode_traffic[OPCODE_TRAFFIC];
+
+static struct opcode_traffic *opcode_traffic_find(int opcode, bool claim)
+{
+	const unsigned key = (unsigned)opcode ^ 0x80000000u;
+	unsigned slot = (key * 2654435761u) % OPCODE_TRAFFIC;
+	for (int probes = 0; probes < OPCODE_TRAFFIC; probes++) {
+		struct opcode_traffic *entry = &opcode_traffic[slot];
+		unsigned found = atomic_load_explicit(&entry->key, memory_order_acquire);
+		if (found == key)
+			return entry;
+		if (!found) {
+			if (!claim)
+				return NULL;
+			if (atomic_compare_exchange_strong(&entry->key, &found, key) || found == key)
+				return entry;
+		}
+		slot = (slot + 1) % OPCODE_TRAFFIC;
+	}
+	return NULL;
+}
+
+/*
+ * The counters are updated from dispatchop()'s workers too, so they
+ * only count connections whose state already exists, rather than
+ * creating it where the table could move under another thread.
+ */
+static void traffic_in(int fd, int opcode, size_t len)
+{
+	struct conn *conn = find_conn(fd);
+	trace_event(TRACE_RECV, fd, opcode, len);
+	if (conn) {
+		atomic_fetch_add_explicit(&conn->traffic.messages_in, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&conn->traffic.bytes_in, len, memory_order_relaxed);
+	}
+
+	struct opcode_traffic *entry = opcode_traffic_find(opcode, true);
+	if (entry) {
+		atomic_fetch_add_explicit(&entry->messages_in, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&entry->bytes_in, len, memory_order_relaxed);
+	}
+}
+
+static void traffic_out(int fd, int opcode, size_t len)
+{
+	struct conn *conn = find_conn(fd);
+	trace_event(TRACE_SEND, fd, opcode, len);
+	if (conn) {
+		atomic_fetch_add_explicit(&conn->traffic.messages_out, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&conn->traffic.bytes_out, len, memory_order_relaxed);
+	}
+
+	struct opcode_traffic *entry = opcode_traffic_find(opcode, true);
+	if (entry) {
+		atomic_fetch_add_explicit(&entry->messages_out, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&entry->bytes_out, len, memory_order_relaxed);
+	}
+}
+
+static void traffic_error(int fd)
+{
+	struct conn *conn = find_conn(fd);
+	if (conn)
+		atomic_fetch_add_explicit(&conn->traffic.errors, 1, memory_order_relaxed);
+}
+
+int get_traffic_stats(int fd, struct traffic_stats *stats)
+{
+	*stats = (struct traffic_stats) { 0 };
+	struct conn *conn = find_conn(fd);
+	if (conn) {
+		const struct traffic *traffic = &conn->traffic;
+		stats->messages_in = atomic_load_explicit(&traffic->messages_in, memory_order_relaxed);
+		stats->bytes_in = atomic_load_explicit(&traffic->bytes_in, memory_order_relaxed);
+		stats->messages_out = atomic_load_explicit(&traffic->messages_out, memory_order_relaxed);
+		stats->bytes_out = atomic_load_explicit(&traffic->bytes_out, memory_order_relaxed);
+		stats->errors = atomic_load_explicit(&traffic->errors, memory_order_relaxed);
+		stats->hangups = atomic_load_explicit(&traffic->hangups, memory_order_relaxed);
+	}
+
+	// Whatever isn't a socket has nothing queued
+	int queued = 0;
+	if (ioctl(fd, SIOCINQ, &queued) == 0)
+		stats->queued_in = queued;
+	if (ioctl(fd, SIOCOUTQ, &queued) == 0)
+		stats->queued_out = queued;
+	return fcntl(fd, F_GETFD) < 0 ? -1 : 0;
+}
+
+int get_opcode_stats(int opcode, struct traffic_stats *stats)
+{
+	*stats = (struct traffic_stats) { 0 };
+	const struct opcode_traffic *entry = opcode_traffic_find(opcode, false);
+	if (!entry)
+		return 0;
+	stats->messages_in = atomic_load_explicit(&entry->messages_in, memory_order_relaxed);
+	stats->bytes_in = atomic_load_explicit(&entry->bytes_in, memory_order_relaxed);
+	stats->messages_out = atomic_load_explicit(&entry->messages_out, memory_order_relaxed);
+	stats->bytes_out = atomic_load_explicit(&entry->bytes_out, memory_order_relaxed);
+	return 0;
+}
+
+int dump_traffic_stats(int out)
+{
+	struct traffic_stats stats = { 0 };
+	if (dprintf(
+		out,
+		"%-12s %12s %14s %12s %14s %8s %8s %10s %10s\n",
+		"fd", "msgs_in", "bytes_in", "msgs_out", "bytes_out",
+		"errors", "hangups", "queued_in", "queued_out"
+	) < 0)
+		return -1;
+	for (int fd = 0; fd < conns_size; fd++) {
+		if (!conns[fd])
+			continue;
+		get_traffic_stats(fd, &stats);
+		if (!stats.messages_in && !stats.messages_out)
+			continue;
+		dprintf(
+			out,
+			"%-12d %12lu %14lu %12lu %14lu %8lu %8lu %10d %10d\n",
+			fd,
+			stats.messages_in, stats.bytes_in,
+			stats.messages_out, stats.bytes_out,
+			stats.errors, stats.hangups,
+			stats.queued_in, stats.queued_out
+		);
+	}
+
+	dprintf(
+		out,
+		"%-12s %12s %14s %12s %14s\n",
+		"opcode", "msgs_in", "bytes_in", "msgs_out", "bytes_out"
+	);
+	for (int slot = 0; slot < OPCODE_TRAFFIC; slot++) {
+		const unsigned key = atomic_load_explicit(&opcode_traffic[slot].key, memory_order_acquire);
+		if (!key)
+			continue;
+		const int opcode = (int)(key ^ 0x80000000u);
+		get_opcode_stats(opcode, &stats);
+		dprintf(
+			out,
+			"%-12d %12lu %14lu %12lu %14lu\n",
+			opcode,
+			stats.messages_in, stats.bytes_in,
+			stats.messages_out, stats.bytes_out
+		);
+	}
+	return 0;
+}
+
+// the process that asked for the dump, and not a child forked from it
+static pid_t traffic_dump_pid = 0;
+
+static void traffic_dump_at_exit(void)
+{
+	if (getpid() == traffic_dump_pid)
+		dump_traffic_stats(STDERR_FILENO);
+}
+
+static void traffic_dump_on_signal(int signo, const struct signalfd_siginfo *info, void *context)
+{
+	(void)signo;
+	(void)info;
+	(void)context;
+	dump_traffic_stats(STDERR_FILENO);
+}
+
+/*
+ * Reads SRVSH_STATS, a comma-separated list of when to dump the
+ * statistics to stderr: "exit", and signals, by number or as "USR1"
+ * or "USR2".
+ */
+static void traffic_setup(void)
+{
+	static bool done = false;
+	if (done)
+		return;
+	done = true;
+
+	const char *value = getenv("SRVSH_STATS");
+	while (value && *value) {
+		const size_t length = strcspn(value, ",");
+		char *end = NULL;
+		const long number = strtol(value, &end, 10);
+		int signo = end == value + length && length ? (int)number : 0;
+		if (length == 4 && strncmp(value, "exit", 4) == 0) {
+			traffic_dump_pid = getpid();
+			atexit(traffic_dump_at_exit);
+		} else if (length == 4 && strncmp(value, "USR1", 4) == 0)
+			signo = SIGUSR1;
+		else if (length == 4 && strncmp(value, "USR2", 4) == 0)
+			signo = SIGUSR2;
+		if (signo > 0)
+			watch_signal(signo, traffic_dump_on_signal, NULL);
+
+		value += length;
+		if (*value)
+			value++;
+	}
+}
+
+// Whether frames on the socket have compact headers
+static bool compact_headers(int fd)
+{
+	struct conn *conn = find_configured(fd);
+	return conn && conn->compact;
+}
+
+static size_t varint_encode(char *out, uint32_t value)
+{
+	size_t length = 0;
+	for (; value >= 0x80; value >>= 7)
+		out[length++] = (char)(value | 0x80);
+	out[length++] = (char)value;
+	return length;
+}
+
+static ssize_t varint_decode(const char *in, size_t available, uint32_t *value)
+{
+	*value = 0;
+	for (size_t i = 0; i < 5; i++) {
+		if (i == available)
+			return 0;
+
+		const uint8_t byte = (uint8_t)in[i];
+		if (i == 4 && byte > 0x0f)
+			return -1;
+
+		*value |= (uint32_t)(byte & 0x7f) << (7 * i);
+		if (!(byte & 0x80))
+			return (ssize_t)i + 1;
+	}
+	return -1;
+}
+
+static uint32_t zigzag(int value)
+{
+	return (uint32_t)value << 1 ^ (uint32_t)(value >> 31);
+}
+
+static size_t varint_size(uint32_t value)
+{
+	return 1
+		+ (value >= 1u << 7)
+		+ (value >= 1u << 14)
+		+ (value >= 1u << 21)
+		+ (value >= 1u << 28);
+}
+
+/*
+ * Returns the number of bytes header_encode() writes for a header,
+ * which is never more than HEADER_MAX.
+ */
+static size_t header_size(bool compact, const struct srvsh_header *hd)
+{
+	if (!compact)
+		return sizeof(*hd);
+	return varint_size(zigzag(hd->opcode)) + varint_size((uint32_t)hd->size);
+}
+
+/*
+ * Writes a header the way it's sent on the wire, returning its length.
+ */
+static size_t header_encode(bool compact, const struct srvsh_header *hd, char *out)
+{
+	if (!compact) {
+		memcpy(out, hd, sizeof(*hd));
+		return sizeof(*hd);
+	}
+
+	size_t length = varint_encode(out, zigzag(hd->opcode));
+	return length + varint_encode(out + length, (uint32_t)hd->size);
+}
+
+/*
+ * Reads a header from the start of the given bytes, returning its
+ * length, 0 if it isn't complete yet, or -1 if it's invalid.
+ */
+static ssize_t header_decode(
+	bool compact,
+	const char *in,
+	size_t available,
+	struct srvsh_header *hd
+)
+{
+	if (!compact) {
+		if (available < sizeof(*hd))
+			return 0;
+		memcpy(hd, in, sizeof(*hd));
+		return hd->size < 0 ? -1 : (ssize_t)sizeof(*hd);
+	}
+
+	uint32_t opcode = 0;
+	uint32_t size = 0;
+
+	// most headers are a byte each
+	if (available >= 2 && !((in[0] | in[1]) & 0x80)) {
+		opcode = (uint8_t)in[0];
+		hd->opcode = (int)(opcode >> 1 ^ -(opcode & 1));
+		hd->size = (uint8_t)in[1];
+		return 2;
+	}
+
+	ssize_t opcode_length = varint_decode(in, available, &opcode);
+	if (opcode_length <= 0)
+		return opcode_length;
+
+	ssize_t size_length = varint_decode(
+		in + opcode_length,
+		available - (size_t)opcode_length,
+		&size
+	);
+	if (size_length <= 0)
+		return size_length;
+	if (size > INT_MAX)
+		return -1;
+
+	hd->opcode = (int)(opcode >> 1 ^ -(opcode & 1));
+	hd->size = (int)size;
+	return opcode_length + size_length;
+}
+
+/*
+ * Returns the amount of space necessary for a null-terminated
+ * string. Always terminates the string with a null.
+ *
+ * Seriously, why does C leave footguns like this all over the
+ * place...?
+ */
+static int vslprintf(char *str, size_t size, const char *format, va_list list)
+{
+	int result = vsnprintf(str, size, format, list) + 1;
+	int last = MIN(result, size) - 1;
+	if (str && size > 0)
+		str[last] = '\0';
+	return result;
+}
+
+static int slprintf(char *str, size_t size, const char *format, ...)
+{
+	va_list list;
+	va_start(list, format);
+	int result = vslprintf(str, size, format, list);
+	va_end(list);
+	return result;
+}
+
+static void fork_waiter(
+	int (*exec)(const char *, char * const*),
+	const char *path,
+	char * const argv[],
+	int clients_end
+)
+{
+	switch (fork()) {
+		case -1:
+			_exit(1);
+		case 0:
+			exec(path, argv);
+			_exit(1);
+		default: {
+			// the server has the connections now, and its peers
+			// should see them hang up when it goes
+			for (int fd = SRV_FILENO; fd < clients_end; fd++)
+				close(fd);
+
+			int worst_exit = EXIT_SUCCESS;
+			int wstatus;
+			int wreturn;
+			while ((wreturn = wait(&wstatus))) {
+				if (wreturn < 0 && errno == ECHILD)
+					_exit(worst_exit);
+				if (WIFEXITED(wstatus))
+					worst_exit = MAX(worst_exit, WEXITSTATUS(wstatus));
+				else if (WIFSIGNALED(wstatus))
+					worst_exit = MAX(worst_exit, SIGNAL_RETURN_VALUE(WTERMSIG(wstatus)));
+			}
+			_exit(worst_exit);
+		}
+	}
+}
+
+int cli_end(void)
+{
+	static int _cli_end = 0;
+	if (!_cli_end) {
+		const char *envvar = getenv("SRVSH_CLIENTS_END");
+		if (!envvar)
+			_cli_end = CLI_BEGIN;
+		else
+			_cli_end = atoi(envvar);
+	}
+	return _cli_end;
+}
+
+int cli_count(void)
+{
+	return cli_end() - CLI_BEGIN;
+}
+
+bool is_cli(int fd)
+{
+	return CLI_BEGIN <= fd
+		&& fd < cli_end();
+}
+
+static const char *next_line(const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '\n') {
+			return ++str;
+		}
+	}
+	return str;
+}
+
+static const char *skip_spaces(const char *str)
+{
+	for (; *str; str++) {
+		if (!isspace(*str))
+			break;
+	}
+	return str;
+}
+
+static const char *skip_words(const char *str)
+{
+	for (; *str; str++) {
+		if (!isalnum(*str) && !ispunct(*str))
+			break;
+	}
+	return str;
+}
+
+int get_opcode(const opcode_db *db, const char *name)
+{
+	char **files = (char **)db;
+	const size_t len = strlen(name);
+	int current = 0;
+
+	for (; *files; files++) {
+		char *value_end = *files;
+		for (const char *line = *files; *line; line = next_line(value_end)) {
+			const char *name_start = skip_spaces(line);
+
+			if (name_start[0] == '#') {
+				value_end = (char*)name_start;
+				continue;
+			}
+
+			const char *name_end = skip_words(name_start);
+			const bool selected = !strncmp(name_start, name, len);
+			const bool common_prefix = selected && name_end - name_start != (ssize_t)len;
+
+			long attempt = strtol(name_end, &value_end, 10);
+
+			const bool error
+				= attempt > INT_MAX
+				|| attempt < 0;
+
+			if (error)
+				return -1;
+
+			const bool autoval = value_end == name_end;
+
+			if (autoval)
+				current++;
+			else
+				current = (int)attempt;
+
+			if (selected && !common_prefix)
+				return current;
+		}
+	}
+	return -1;
+}
+
+int get_opcode_name(const opcode_db *db, int opcode, char *name, size_t len)
+{
+	char **files = (char **)db;
+	int current = 0;
+
+	for (; files && *files; files++) {
+		char *value_end = *files;
+		for (const char *line = *files; *line; line = next_line(value_end)) {
+			const char *name_start = skip_spaces(line);
+
+			if (name_start[0] == '#') {
+				value_end = (char*)name_start;
+				continue;
+			}
+
+			const char *name_end = skip_words(name_start);
+			long attempt = strtol(name_end, &value_end, 10);
+
+			if (attempt > INT_MAX || attempt < 0)
+				return -1;
+
+			if (value_end == name_end)
+				current++;
+			else
+				current = (int)attempt;
+
+			if (current == opcode && name_end != name_start)
+				return snprintf(
+					name,
+					len,
+					"%.*s",
+					(int)(name_end - name_start),
+					name_start
+				);
+		}
+	}
+	return -1;
+}
+
+static char *map_path(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	off_t length = lseek(fd, 0, SEEK_END);
+	if (length <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	char *raw_file = mmap(
+		NULL,
+		(size_t)length,
+		PROT_READ,
+		MAP_PRIVATE,
+		fd,
+		0
+	);
+	close(fd);
+	return raw_file;
+}
+
+opcode_db *open_opcode_db_at(const char *db_path)
+{
+	// haven't made up my mind whether it's better to return
+	// the pattern, the globs object, or the file contents
+	//
+	// in reality the best solution would probably to build
+	// a whole-ass hashtable or something but I'm far too
+	// lazy for that
+	//
+	// Also this function is a perfect example of why I hate
+	// returning heap-allocated memory. Whatever. Applications should
+	// call this at the beginning, get the codes they need, then
+	// free before doing any real work anyway.
+	if (!db_path)
+		return NULL;
+
+	int pattern_length = slprintf(NULL, 0, "%s{,.d/*}", db_path);
+	if (pattern_length < 0)
+		return NULL;
+
+	int success = 0;
+	char **result = NULL;
+	glob_t globs = { 0 };
 	WITH(pattern, pattern_length) {
 		slprintf(pattern, pattern_length, "%s{,.d/*}", db_path);
 		success = !glob(pattern, GLOB_BRACE, NULL, &globs);
 	}
 
-	if (!success)
-		return NULL;
+	if (!success)
+		return NULL;
+
+	result = calloc(
+		globs.gl_pathc + 1,
+		sizeof(glob_t)
+	);
+
+	for (
+		char
+			**path = globs.gl_pathv,
+			**c = result;
+		*path;
+		path++, c++
+	) {
+		*c = map_path(*path);
+	}
+	globfree(&globs);
+	return result;
+}
+
+opcode_db *open_opcode_db(void)
+{
+	return open_opcode_db_at(getenv("OPCODE_DATABASE"));
+}
+
+ssize_t writesrv(int opcode, const void *buf, size_t len)
+{
+	return writeop(SRV_FILENO, opcode, buf, len);
+}
+
+ssize_t writeop(
+	int fd,
+	int opcode,
+	const void *buf,
+	int len
+)
+{
+	return sendmsgop(
+		fd,
+		opcode,
+		buf,
+		len,
+		NULL,
+		0
+	);
+}
+
+static long long now_ms(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sendbuf_unlink(struct sendbuf *sb)
+{
+	if (sb->prev)
+		sb->prev->next = sb->next;
+	else if (pending_sends == sb)
+		pending_sends = sb->next;
+
+	if (sb->next)
+		sb->next->prev = sb->prev;
+
+	sb->prev = sb->next = NULL;
+}
+
+static void outq_link(struct outq *q)
+{
+	if (q->prev || pending_writes == q)
+		return;
+
+	q->next = pending_writes;
+	if (pending_writes)
+		pending_writes->prev = q;
+	pending_writes = q;
+}
+
+static void outq_unlink(struct outq *q)
+{
+	if (q->prev)
+		q->prev->next = q->next;
+	else if (pending_writes == q)
+		pending_writes = q->next;
+
+	if (q->next)
+		q->next->prev = q->prev;
+
+	q->prev = q->next = NULL;
+}
+
+static void outmsg_free(struct outmsg *msg)
+{
+	if (msg->cmsg) {
+		struct msghdr stale = {
+			.msg_control = msg->cmsg,
+			.msg_controllen = msg->cmsg_len,
+		};
+		close_cmsg_fds(stale);
+		free(msg->cmsg);
+	}
+	free(msg);
+}
+
+static void outq_clear(struct outq *q)
+{
+	while (q->head) {
+		struct outmsg *next = q->head->next;
+		outmsg_free(q->head);
+		q->head = next;
+	}
+	q->tail = &q->head;
+	q->queued = 0;
+	outq_unlink(q);
+}
+
+/*
+ * Copies a file descriptor-carrying control buffer, duplicating the
+ * descriptors so the caller is free to close its own.
+ */
+static char *cmsg_dup(const void *cmsg, size_t cmsg_len)
+{
+	char *copy = malloc(cmsg_len);
+	if (!copy)
+		return NULL;
+	memcpy(copy, cmsg, cmsg_len);
+
+	struct msghdr hdr = {
+		.msg_control = copy,
+		.msg_controllen = cmsg_len,
+	};
+	for (
+		struct cmsghdr *chdr = CMSG_FIRSTHDR(&hdr);
+		chdr;
+		chdr = CMSG_NXTHDR(&hdr, chdr)
+	) {
+		if (chdr->cmsg_level != SOL_SOCKET || chdr->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		int *fds = (int*)CMSG_DATA(chdr);
+		size_t count = (chdr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++) {
+			int fd = -1;
+			memcpy(&fd, &fds[i], sizeof(fd));
+			fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+			memcpy(&fds[i], &fd, sizeof(fd));
+		}
+	}
+	return copy;
+}
+
+/*
+ * Queues whatever is left of a message after the first sent bytes.
+ */
+static bool outq_push(struct outq *q, const struct msghdr *msg, size_t sent)
+{
+	size_t length = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; i++)
+		length += msg->msg_iov[i].iov_len;
+
+	struct outmsg *out = malloc(sizeof(*out) + length - sent);
+	if (!out)
+		return false;
+
+	// the file descriptors went with the first byte, if it was sent
+	const bool with_cmsg = msg->msg_controllen && !sent;
+
+	*out = (struct outmsg) { .length = length - sent };
+	size_t at = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; i++) {
+		const struct iovec *iov = &msg->msg_iov[i];
+		size_t skip = MIN(sent, iov->iov_len);
+		memcpy(out->data + at, (char*)iov->iov_base + skip, iov->iov_len - skip);
+		at += iov->iov_len - skip;
+		sent -= skip;
+	}
+
+	if (with_cmsg) {
+		out->cmsg = cmsg_dup(msg->msg_control, msg->msg_controllen);
+		if (!out->cmsg) {
+			free(out);
+			return false;
+		}
+		out->cmsg_len = msg->msg_controllen;
+	}
+
+	*q->tail = out;
+	q->tail = &out->next;
+	q->queued += out->length;
+	outq_link(q);
+	return true;
+}
+
+/*
+ * Sends as much of the queue as the socket will take without blocking.
+ * On an error, the queue is dropped, for the same reason a failed
+ * corked flush is.
+ */
+static bool outq_flush(struct outq *q)
+{
+	while (q->head) {
+		struct outmsg *out = q->head;
+		struct iovec iov = {
+			.iov_base = out->data + out->sent,
+			.iov_len = out->length - out->sent,
+		};
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = out->sent ? NULL : out->cmsg,
+			.msg_controllen = out->sent ? 0 : out->cmsg_len,
+		};
+
+		// this can run from a pollop* function, which shouldn't
+		// be where a closed peer raises SIGPIPE
+		ssize_t sent = sendmsg(q->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (sent < 0) {
+			outq_clear(q);
+			return false;
+		}
+
+		out->sent += (size_t)sent;
+		q->queued -= (size_t)sent;
+		if (out->sent < out->length)
+			return true;
+
+		q->head = out->next;
+		if (!q->head)
+			q->tail = &q->head;
+		outmsg_free(out);
+	}
+
+	outq_unlink(q);
+	return true;
+}
+
+/*
+ * Waits for the socket to take everything queued, then frees the
+ * queue, leaving the connection to block on its writes again.
+ */
+static int outq_finish(struct conn *conn)
+{
+	struct outq *q = conn->out;
+	int result = 0;
+	while (q->head) {
+		struct pollfd writable = { .fd = q->fd, .events = POLLOUT };
+		if (poll(&writable, 1, -1) < 0 && errno != EINTR) {
+			result = -1;
+			break;
+		}
+		if (!outq_flush(q)) {
+			result = -1;
+			break;
+		}
+	}
+
+	outq_clear(q);
+	free(q);
+	conn->out = NULL;
+	return result;
+}
+
+/*
+ * Every message written to a socket goes through here, so that a
+ * non-blocking connection can queue what the socket won't take. The
+ * queue's limit is only checked when a frame starts, so the records
+ * after the first of a split frame are always taken, and the frame
+ * is never torn.
+ */
+static ssize_t send_out(int fd, struct msghdr *msg, bool starts_frame)
+{
+	struct conn *conn = find_conn(fd);
+	struct outq *q = conn ? conn->out : NULL;
+	if (q && q->blocking && outq_finish(conn) < 0)
+		return -1;
+	if (!conn || !conn->out)
+		return sendmsg(fd, msg, 0);
+
+	size_t length = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; i++)
+		length += msg->msg_iov[i].iov_len;
+
+	// Queued data has to go first, so this can only join it
+	if (q->head) {
+		if (starts_frame && q->queued > q->limit) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (!outq_push(q, msg, 0))
+			return -1;
+		outq_flush(q);
+		return (ssize_t)length;
+	}
+
+	ssize_t sent = 0;
+	do {
+		sent = sendmsg(fd, msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+	if (sent < 0)
+		sent = 0;
+
+	if ((size_t)sent < length && !outq_push(q, msg, (size_t)sent))
+		return -1;
+	return (ssize_t)length;
+}
+
+#ifdef SRVSH_IO_URING
+
+#define URING_RECV 1ULL
+#define URING_SEND 2ULL
+#define URING_USER_DATA(op, fd) ((op) << 32 | (uint32_t)(fd))
+#define URING_MAX_ENTRIES 32768
+
+/*
+ * A single io_uring instance, driven through the raw system calls.
+ *
+ * Completed reads are copied out of the completion queue as soon as
+ * they're reaped, so that waiting on a send never has to call back
+ * into user code; pollop() passes them to callbacks afterwards.
+ */
+static struct {
+	int fd;
+	unsigned entries;
+	unsigned sq_tail;
+	unsigned to_submit;
+	unsigned *sq_head;
+	unsigned *sq_ktail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	struct io_uring_cqe *completed;
+	unsigned completed_count;
+	unsigned completed_next;
+
+	int *fds;
+	int fds_count;
+} uring = { .fd = -1 };
+
+static void sendbuf_settle(struct sendbuf *sb);
+
+static void uring_exit(void)
+{
+	if (uring.fd < 0)
+		return;
+
+	// Closing the ring cancels reads in flight, but sends have to
+	// finish to keep the stream intact
+	for (int fd = 0; fd < conns_size; fd++) {
+		if (!conns[fd])
+			continue;
+		if (conns[fd]->send)
+			sendbuf_settle(conns[fd]->send);
+		if (conns[fd]->recv)
+			conns[fd]->recv->armed = false;
+	}
+
+	close(uring.fd);
+	if (uring.cq_ring && uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+	if (uring.sq_ring)
+		munmap(uring.sq_ring, uring.sq_ring_size);
+	if (uring.sqes)
+		munmap(uring.sqes, uring.sqes_size);
+	free(uring.completed);
+	free(uring.fds);
+	uring = (typeof(uring)) { .fd = -1 };
+}
+
+static bool uring_setup(unsigned entries)
+{
+	struct io_uring_params params = { 0 };
+	uring.fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (uring.fd < 0)
+		return false;
+
+	// EXT_ARG (5.11) is needed to wait with a timeout without
+	// spending a submission on it
+	if (!(params.features & IORING_FEAT_EXT_ARG)) {
+		uring_exit();
+		return false;
+	}
+
+	uring.entries = params.sq_entries;
+	uring.sq_ring_size = params.sq_off.array
+		+ params.sq_entries * sizeof(unsigned);
+	uring.cq_ring_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+
+	const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap)
+		uring.sq_ring_size = uring.cq_ring_size
+			= MAX(uring.sq_ring_size, uring.cq_ring_size);
+
+	uring.sq_ring = mmap(
+		NULL,
+		uring.sq_ring_size,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		uring.fd,
+		IORING_OFF_SQ_RING
+	);
+	if (uring.sq_ring == MAP_FAILED) {
+		uring.sq_ring = NULL;
+		uring_exit();
+		return false;
+	}
+
+	uring.cq_ring = single_mmap ? uring.sq_ring : mmap(
+		NULL,
+		uring.cq_ring_size,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		uring.fd,
+		IORING_OFF_CQ_RING
+	);
+	if (uring.cq_ring == MAP_FAILED) {
+		uring.cq_ring = NULL;
+		uring_exit();
+		return false;
+	}
+
+	uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(
+		NULL,
+		uring.sqes_size,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		uring.fd,
+		IORING_OFF_SQES
+	);
+	if (uring.sqes == MAP_FAILED) {
+		uring.sqes = NULL;
+		uring_exit();
+		return false;
+	}
+
+	char *sq = uring.sq_ring;
+	char *cq = uring.cq_ring;
+	uring.sq_head = (unsigned *)(sq + params.sq_off.head);
+	uring.sq_ktail = (unsigned *)(sq + params.sq_off.tail);
+	uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+	uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+	uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	uring.sq_tail = *uring.sq_ktail;
+
+	uring.completed = calloc(params.cq_entries, sizeof(*uring.completed));
+	if (!uring.completed) {
+		uring_exit();
+		return false;
+	}
+	return true;
+}
+
+static int uring_enter(unsigned min_complete, int timeout)
+{
+	__atomic_store_n(uring.sq_ktail, uring.sq_tail, __ATOMIC_RELEASE);
+
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000LL,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = timeout < 0 ? 0 : (uint64_t)(uintptr_t)&ts,
+	};
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	if (min_complete)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	int submitted = (int)syscall(
+		__NR_io_uring_enter,
+		uring.fd,
+		uring.to_submit,
+		min_complete,
+		flags,
+		&arg,
+		sizeof(arg)
+	);
+	if (submitted > 0)
+		uring.to_submit -= MIN((unsigned)submitted, uring.to_submit);
+	if (submitted < 0 && errno == ETIME)
+		return 0;
+	return submitted;
+}
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+	unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+	if (uring.sq_tail - head >= uring.entries) {
+		if (uring_enter(0, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+		if (uring.sq_tail - head >= uring.entries)
+			return NULL;
+	}
+
+	unsigned index = uring.sq_tail & *uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq_array[index] = index;
+	uring.sq_tail++;
+	uring.to_submit++;
+	return sqe;
+}
+
+static bool uring_send(struct sendbuf *sb)
+{
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sb->fd;
+	sqe->addr = (uint64_t)(uintptr_t)(sb->spare + sb->spare_sent);
+	sqe->len = (uint32_t)(sb->spare_length - sb->spare_sent);
+	sqe->user_data = URING_USER_DATA(URING_SEND, sb->fd);
+	sb->sending = true;
+	return true;
+}
+
+static void uring_send_done(int fd, int result)
+{
+	struct conn *conn = find_conn(fd);
+	struct sendbuf *sb = conn ? conn->send : NULL;
+	if (!sb)
+		return;
+
+	if (result > 0)
+		sb->spare_sent += (size_t)result;
+
+	// see sendbuf_flush() for why failed data is dropped
+	if (result > 0 && sb->spare_sent < sb->spare_length && uring_send(sb))
+		return;
+
+	sb->sending = false;
+	sb->spare_length = sb->spare_sent = 0;
+}
+
+static void uring_reap(void)
+{
+	unsigned head = *uring.cq_head;
+	unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+		const int fd = (int)(uint32_t)cqe->user_data;
+		if (cqe->user_data >> 32 == URING_SEND)
+			uring_send_done(fd, cqe->res);
+		else
+			uring.completed[uring.completed_count++] = *cqe;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Waits for a flush handed to io_uring to finish, so the buffer
+ * can be written to or sent from directly again.
+ */
+static void sendbuf_settle(struct sendbuf *sb)
+{
+	while (sb->sending) {
+		if (uring_enter(1, -1) < 0 && errno != EINTR) {
+			sb->sending = false;
+			return;
+		}
+		uring_reap();
+	}
+}
+
+/*
+ * Hands the buffer to io_uring, to be submitted with the next wait.
+ */
+static bool sendbuf_flush_async(struct sendbuf *sb)
+{
+	// a non-blocking connection's queue has to stay in order
+	if (uring.fd < 0 || find_conn(sb->fd)->out)
+		return false;
+
+	sendbuf_settle(sb);
+	if (!sb->spare && !(sb->spare = malloc(sb->size)))
+		return false;
+
+	char *sending = sb->buffer;
+	sb->buffer = sb->spare;
+	sb->spare = sending;
+	sb->spare_length = sb->length;
+	sb->spare_sent = 0;
+	sb->length = 0;
+	sendbuf_unlink(sb);
+
+	if (!uring_send(sb)) {
+		sb->spare_length = 0;
+		return false;
+	}
+	return true;
+}
+
+#else
+
+static void sendbuf_settle(struct sendbuf *sb)
+{
+	(void)sb;
+}
+
+static bool sendbuf_flush_async(struct sendbuf *sb)
+{
+	(void)sb;
+	return false;
+}
+
+#endif
+
+static ssize_t sendbuf_flush(struct sendbuf *sb)
+{
+	sendbuf_settle(sb);
+
+	size_t sent = 0;
+	ssize_t result = 0;
+	while (sent < sb->length) {
+		struct iovec iov = {
+			.iov_base = sb->buffer + sent,
+			.iov_len = sb->length - sent,
+		};
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+		};
+		result = send_out(sb->fd, &msg, true);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result < 0)
+			break;
+		sent += (size_t)result;
+	}
+
+	// A full queue empties as the peer reads, so what it wouldn't
+	// take stays corked for a later flush. On any other failure it's
+	// dropped: the connection isn't going to recover, and keeping it
+	// would only make every later write fail the same way
+	if (result < 0 && errno == EAGAIN) {
+		memmove(sb->buffer, sb->buffer + sent, sb->length - sent);
+		sb->length -= sent;
+		return -1;
+	}
+	sb->length = 0;
+	sendbuf_unlink(sb);
+	return result < 0 ? -1 : (ssize_t)sent;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; i++)
+		length += iov[i].iov_len;
+	return length;
+}
+
+static void iov_copy(char *out, const struct iovec *iov, int iovcnt)
+{
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len)
+			memcpy(out, iov[i].iov_base, iov[i].iov_len);
+		out += iov[i].iov_len;
+	}
+}
+
+/*
+ * Fills out with the segments covering length bytes of iov from
+ * offset, and returns how many it took. out needs room for iovcnt.
+ */
+static int iov_slice(
+	const struct iovec *iov,
+	int iovcnt,
+	size_t offset,
+	size_t length,
+	struct iovec *out
+)
+{
+	int count = 0;
+	for (int i = 0; i < iovcnt && length; i++) {
+		if (offset >= iov[i].iov_len) {
+			offset -= iov[i].iov_len;
+			continue;
+		}
+
+		const size_t take = MIN(iov[i].iov_len - offset, length);
+		out[count++] = (struct iovec) {
+			.iov_base = (char *)iov[i].iov_base + offset,
+			.iov_len = take,
+		};
+		offset = 0;
+		length -= take;
+	}
+	return count;
+}
+
+static ssize_t sendmsg_framev(
+	int fd,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	char header[HEADER_MAX];
+	const size_t header_length = header_encode(compact_headers(fd), hd, header);
+	const size_t length = header_length + (size_t)hd->size;
+
+	// The file descriptors go with the first record, which also
+	// carries the header; the rest of the body follows on its own
+	const bool split = length > SEQPACKET_RECORD && socket_type(fd) == SOCK_SEQPACKET;
+	const size_t first = split ? SEQPACKET_RECORD - header_length : (size_t)hd->size;
+
+	struct iovec inputs[iovcnt + 1];
+	inputs[0] = (struct iovec) {
+		.iov_base = header,
+		.iov_len = header_length,
+	};
+	struct msghdr msg = {
+		.msg_iov = inputs,
+		.msg_iovlen = 1 + iov_slice(iov, iovcnt, 0, first, inputs + 1),
+		.msg_control = cmsg,
+		.msg_controllen = cmsg_len,
+	};
+	if (!split)
+		return send_out(fd, &msg, true);
+
+	if (send_out(fd, &msg, true) < 0)
+		return -1;
+
+	for (size_t sent = first; sent < (size_t)hd->size;) {
+		const size_t record = MIN((size_t)hd->size - sent, SEQPACKET_RECORD);
+		struct msghdr next = {
+			.msg_iov = inputs,
+			.msg_iovlen = iov_slice(iov, iovcnt, sent, record, inputs),
+		};
+		if (send_out(fd, &next, false) < 0)
+			return -1;
+		sent += record;
+	}
+	return (ssize_t)length;
+}
+
+static ssize_t sendmsg_frame(
+	int fd,
+	struct srvsh_header *hd,
+	const void *buf,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	const struct iovec iov = {
+		.iov_base = (void*)buf,
+		.iov_len = hd->size,
+	};
+	return sendmsg_framev(fd, hd, &iov, 1, cmsg, cmsg_len);
+}
+
+static size_t page_size(void)
+{
+	static size_t size = 0;
+	if (!size)
+		size = (size_t)sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+/*
+ * Returns the ring size requested by a SRVSH_SHM_RING value, rounded
+ * up to a power of two of at least a page, or 0 if it isn't set.
+ */
+static size_t shm_ring_size(const char *value)
+{
+	if (!value || !*value)
+		return 0;
+
+	char *suffix = NULL;
+	unsigned long long requested = strtoull(value, &suffix, 10);
+	if (*suffix == 'k' || *suffix == 'K')
+		requested <<= 10;
+	else if (*suffix == 'm' || *suffix == 'M')
+		requested <<= 20;
+
+	if (!requested || requested > (1ULL << 30))
+		return 0;
+
+	size_t size = page_size();
+	while (size < requested)
+		size <<= 1;
+	return size;
+}
+
+static char *map_mirrored(int memfd, off_t offset, size_t size)
+{
+	char *base = mmap(
+		NULL,
+		2 * size,
+		PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	for (int i = 0; i < 2; i++) {
+		void *half = mmap(
+			base + i * size,
+			size,
+			PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED,
+			memfd,
+			offset
+		);
+		if (half == MAP_FAILED) {
+			munmap(base, 2 * size);
+			return NULL;
+		}
+	}
+	return base;
+}
+
+static void shm_detach(struct conn *conn)
+{
+	struct shm *shm = conn->shm;
+	if (!shm)
+		return;
+
+	if (shm->tx_data)
+		munmap(shm->tx_data, 2 * (size_t)shm->size);
+	if (shm->rx_data)
+		munmap(shm->rx_data, 2 * (size_t)shm->size);
+	if (shm->layout)
+		munmap(shm->layout, page_size());
+	free(shm);
+	conn->shm = NULL;
+}
+
+static bool shm_attach(struct conn *conn, int memfd, int role)
+{
+	if (conn->shm || (role != 0 && role != 1))
+		return false;
+
+	struct shm *shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return false;
+	conn->shm = shm;
+
+	shm->layout = mmap(
+		NULL,
+		page_size(),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED,
+		memfd,
+		0
+	);
+	if (shm->layout == MAP_FAILED) {
+		shm->layout = NULL;
+		shm_detach(conn);
+		return false;
+	}
+
+	const size_t size = shm->layout->size;
+	if (size < page_size() || size & (size - 1)) {
+		shm_detach(conn);
+		return false;
+	}
+	shm->size = (uint32_t)size;
+
+	const off_t rings[] = {
+		(off_t)page_size(),
+		(off_t)(page_size() + size),
+	};
+	shm->tx = &shm->layout->rings[role];
+	shm->rx = &shm->layout->rings[!role];
+	shm->tx_data = map_mirrored(memfd, rings[role], size);
+	shm->rx_data = map_mirrored(memfd, rings[!role], size);
+	if (!shm->tx_data || !shm->rx_data) {
+		shm_detach(conn);
+		return false;
+	}
+	return true;
+}
+
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static bool shm_wait_space(int fd, struct shm *shm, uint32_t tail, uint32_t length)
+{
+	struct shm_ring *tx = shm->tx;
+	for (;;) {
+		uint32_t head = __atomic_load_n(&tx->head, __ATOMIC_ACQUIRE);
+		if (shm->size - (tail - head) >= length)
+			return true;
+
+		__atomic_store_n(&tx->writer_waiting, 1, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&tx->head, __ATOMIC_SEQ_CST);
+		if (shm->size - (tail - head) >= length)
+			return true;
+
+		// the reader can't wake us if it's gone, but the socket
+		// will say so
+		const struct timespec timeout = { 0, 100 * 1000000 };
+		futex(&tx->head, FUTEX_WAIT, head, &timeout);
+
+		struct pollfd peer = { .fd = fd };
+		if (poll(&peer, 1, 0) > 0 && peer.revents & (POLLHUP | POLLERR)) {
+			errno = EPIPE;
+			return false;
+		}
+	}
+}
+
+static bool shm_write(
+	int fd,
+	struct shm *shm,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt
+)
+{
+	struct shm_ring *tx = shm->tx;
+	const uint32_t length = sizeof(*hd) + (uint32_t)hd->size;
+	const uint32_t tail = tx->tail;
+	if (!shm_wait_space(fd, shm, tail, length))
+		return false;
+
+	char *at = shm->tx_data + (tail & (shm->size - 1));
+	memcpy(at, hd, sizeof(*hd));
+	iov_copy(at + sizeof(*hd), iov, iovcnt);
+	__atomic_store_n(&tx->tail, tail + length, __ATOMIC_SEQ_CST);
+
+	// Only ring the bell if the reader ran out of data and went back
+	// to polling the socket; otherwise it'll find this on its own
+	if (__atomic_exchange_n(&tx->reader_idle, 0, __ATOMIC_SEQ_CST)) {
+		struct srvsh_header bell = { .opcode = OP_SHM_DOORBELL };
+		if (sendmsg_frame(fd, &bell, NULL, NULL, 0) < 0)
+			return false;
+	}
+	return true;
+}
+
+static ssize_t shm_send(
+	int fd,
+	struct shm *shm,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	const size_t length = sizeof(*hd) + (size_t)hd->size;
+
+	// File descriptors can't go through the ring, and neither can a
+	// frame bigger than it, so these go over the socket, with a marker
+	// in the ring to say where they belong. The marker follows the
+	// frame, so one that isn't sent doesn't leave the reader waiting
+	// on a marker for it
+	if (cmsg || length > shm->size) {
+		const ssize_t sent = sendmsg_framev(fd, hd, iov, iovcnt, cmsg, cmsg_len);
+		struct srvsh_header marker = { .opcode = OP_SHM_SOCKET };
+		if (sent < 0 || !shm_write(fd, shm, &marker, NULL, 0))
+			return -1;
+		return sent;
+	}
+
+	if (!shm_write(fd, shm, hd, iov, iovcnt))
+		return -1;
+	return (ssize_t)length;
+}
+
+static void shm_advance(struct shm *shm, uint32_t length)
+{
+	struct shm_ring *rx = shm->rx;
+	__atomic_store_n(&rx->head, rx->head + length, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&rx->writer_waiting, 0, __ATOMIC_SEQ_CST))
+		futex(&rx->head, FUTEX_WAKE, 1, NULL);
+}
+
+static bool pass_on(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr msg,
+	pollop_callback *callback,
+	void *context
+);
+static void credit_handled(int fd, int len);
+
+/*
+ * Passes every frame in the ring to the callback, stopping early at
+ * a marker for a frame that was sent over the socket.
+ */
+static void shm_drain(
+	int fd,
+	struct shm *shm,
+	pollop_callback *callback,
+	void *context
+)
+{
+	struct shm_ring *rx = shm->rx;
+	while (shm->receiving && !shm->at_marker) {
+		const uint32_t head = rx->head;
+		uint32_t tail = __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			__atomic_store_n(&rx->reader_idle, 1, __ATOMIC_SEQ_CST);
+			tail = __atomic_load_n(&rx->tail, __ATOMIC_SEQ_CST);
+			if (head == tail)
+				return;
+			__atomic_store_n(&rx->reader_idle, 0, __ATOMIC_SEQ_CST);
+		}
+
+		char *at = shm->rx_data + (head & (shm->size - 1));
+		struct srvsh_header header = { 0 };
+		memcpy(&header, at, sizeof(header));
+		if (header.opcode == OP_SHM_SOCKET && shm->markers_owed) {
+			shm->markers_owed--;
+			shm_advance(shm, sizeof(header));
+			continue;
+		}
+		if (header.opcode == OP_SHM_SOCKET) {
+			shm->at_marker = true;
+			return;
+		}
+
+		const bool handled = pass_on(
+			fd,
+			header.opcode,
+			header.size ? at + sizeof(header) : NULL,
+			header.size,
+			(struct msghdr) { 0 },
+			callback,
+			context
+		);
+		shm_advance(shm, sizeof(header) + (uint32_t)header.size);
+		if (handled)
+			credit_handled(fd, header.size);
+	}
+}
+
+static void shm_start(int fd, struct conn *conn)
+{
+	if (!conn->shm || conn->shm->sending)
+		return;
+
+	// anything corked has to arrive before the ring is read
+	if (conn->send)
+		sendbuf_flush(conn->send);
+
+	struct srvsh_header start = { .opcode = OP_SHM_START };
+	if (sendmsg_frame(fd, &start, NULL, NULL, 0) >= 0)
+		conn->shm->sending = true;
+}
+
+static void shm_offered(int fd, struct conn *conn, void *buf, int len, struct msghdr msg)
+{
+	int memfd = -1;
+	struct cmsghdr *chdr = msg.msg_control ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (
+		chdr
+		&& chdr->cmsg_level == SOL_SOCKET
+		&& chdr->cmsg_type == SCM_RIGHTS
+		&& chdr->cmsg_len >= CMSG_LEN(sizeof(int))
+	)
+		memcpy(&memfd, CMSG_DATA(chdr), sizeof(memfd));
+
+	int role = -1;
+	if (len == sizeof(role))
+		memcpy(&role, buf, sizeof(role));
+
+	if (memfd >= 0 && shm_attach(conn, memfd, role))
+		shm_start(fd, conn);
+	close_cmsg_fds(msg);
+}
+
+/*
+ * Takes the offer of a shared-memory connection if it's the first
+ * thing waiting on the socket, so the first message sent can use it.
+ * Only done when SRVSH_SHM_RING is set, since it costs a system call;
+ * a process spawned with it set inherits it.
+ */
+static void shm_probe(int fd)
+{
+	static int enabled = -1;
+	if (enabled < 0)
+		enabled = shm_ring_size(getenv("SRVSH_SHM_RING")) > 0;
+	if (!enabled)
+		return;
+
+	struct conn *conn = get_conn(fd);
+	if (!conn || conn->shm_probed)
+		return;
+	conn->shm_probed = true;
+
+	if (conn->recv && (conn->recv->armed || conn->recv->start != conn->recv->end))
+		return;
+
+	char wire[HEADER_MAX];
+	ssize_t peeked = recv(fd, wire, sizeof(wire), MSG_PEEK | MSG_DONTWAIT);
+	if (peeked <= 0)
+		return;
+
+	struct srvsh_header header = { 0 };
+	ssize_t header_length = header_decode(compact_headers(fd), wire, (size_t)peeked, &header);
+	if (header_length <= 0 || header.opcode != OP_SHM_OFFER)
+		return;
+
+	int role = -1;
+	char cmsg_buf[CMSG_SPACE(sizeof(int))] = { 0 };
+	struct iovec iov[] = {
+		{ wire, (size_t)header_length },
+		{ &role, sizeof(role) },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+		.msg_control = cmsg_buf,
+		.msg_controllen = sizeof(cmsg_buf),
+	};
+	if (recvmsg(fd, &msg, MSG_WAITALL) != header_length + (ssize_t)sizeof(role))
+		return;
+
+	shm_offered(fd, conn, &role, sizeof(role), msg);
+}
+
+/*
+ * Creates the shared memory for a new connection. The spawning end
+ * attaches straight away, and the new process is sent an offer it
+ * will find before anything else on its socket, unless its server
+ * is yet to exec, and would lose the mapping. A client started by a
+ * spawner is offered the ring by the server it gets, once that's
+ * exec'd, which the client takes whenever it arrives.
+ */
+static void shm_offer(int fd, const char *ring_size)
+{
+	const size_t size = shm_ring_size(ring_size);
+	if (!size)
+		return;
+
+	int memfd = memfd_create("srvsh-ring", MFD_CLOEXEC);
+	if (memfd < 0)
+		return;
+
+	if (ftruncate(memfd, (off_t)(page_size() + 2 * size)) < 0) {
+		close(memfd);
+		return;
+	}
+
+	struct shm_layout *layout = mmap(
+		NULL,
+		page_size(),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED,
+		memfd,
+		0
+	);
+	if (layout == MAP_FAILED) {
+		close(memfd);
+		return;
+	}
+	layout->size = (uint32_t)size;
+	layout->rings[0].reader_idle = layout->rings[1].reader_idle = 1;
+	munmap(layout, page_size());
+
+	union {
+		char buf[CMSG_SPACE(sizeof(memfd))];
+		struct cmsghdr align;
+	} cmsg = { 0 };
+	cmsg.align.cmsg_level = SOL_SOCKET;
+	cmsg.align.cmsg_type = SCM_RIGHTS;
+	cmsg.align.cmsg_len = CMSG_LEN(sizeof(memfd));
+	memcpy(CMSG_DATA(&cmsg.align), &memfd, sizeof(memfd));
+
+	const int role = 0;
+	struct srvsh_header hd = {
+		.opcode = OP_SHM_OFFER,
+		.size = sizeof(role),
+	};
+	if (sendmsg_frame(fd, &hd, &role, &cmsg, sizeof(cmsg)) >= 0) {
+		struct conn *conn = get_conn(fd);
+		if (conn) {
+			conn->shm_probed = true;
+			if (shm_attach(conn, memfd, !role))
+				shm_start(fd, conn);
+		}
+	}
+	close(memfd);
+}
+
+/*
+ * A small LZ77 codec in the style of LZ4, always available for
+ * compressing large messages. Each sequence is a token byte holding a
+ * literal count and a match length less 4, in four bits each, with 15
+ * meaning more follow in bytes of 255 and a final smaller one; then
+ * the literals, then a two-byte little-endian offset back to the
+ * match. The last sequence is literals only.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_hash(const uint8_t *at)
+{
+	uint32_t sequence = 0;
+	memcpy(&sequence, at, sizeof(sequence));
+	return sequence * 2654435761u >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_length(uint8_t *out, size_t length)
+{
+	for (; length >= 255; length -= 255)
+		*out++ = 255;
+	*out++ = (uint8_t)length;
+	return out;
+}
+
+static bool lz_get_length(const uint8_t **in, const uint8_t *end, size_t *length)
+{
+	uint8_t byte = 255;
+	while (byte == 255) {
+		if (*in == end)
+			return false;
+		byte = *(*in)++;
+		*length += byte;
+	}
+	return true;
+}
+
+static bool lz_sequence(
+	uint8_t **out,
+	const uint8_t *out_end,
+	const uint8_t *literals,
+	size_t literal_count,
+	size_t offset,
+	size_t match_length
+)
+{
+	const size_t needed = 1
+		+ literal_count / 255 + 1
+		+ literal_count
+		+ 2 + match_length / 255 + 1;
+	if ((size_t)(out_end - *out) < needed)
+		return false;
+
+	uint8_t *token = (*out)++;
+	*token = (uint8_t)(MIN(literal_count, 15) << 4);
+	if (literal_count >= 15)
+		*out = lz_put_length(*out, literal_count - 15);
+	memcpy(*out, literals, literal_count);
+	*out += literal_count;
+
+	if (!offset)
+		return true;
+
+	*(*out)++ = (uint8_t)offset;
+	*(*out)++ = (uint8_t)(offset >> 8);
+	match_length -= LZ_MIN_MATCH;
+	*token |= (uint8_t)MIN(match_length, 15);
+	if (match_length >= 15)
+		*out = lz_put_length(*out, match_length - 15);
+	return true;
+}
+
+/*
+ * Returns the compressed length, or 0 if it wouldn't fit in capacity.
+ */
+static size_t lz_compress(const uint8_t *in, size_t length, uint8_t *out, size_t capacity)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = { 0 };
+	const uint8_t *const end = in + length;
+	uint8_t *const out_begin = out;
+	const uint8_t *const out_end = out + capacity;
+
+	// Leave the tail as literals, so a match never reads past the end
+	const uint8_t *const match_limit = length > 12 ? end - 12 : in;
+	const uint8_t *at = in;
+	const uint8_t *literals = in;
+	unsigned misses = 0;
+
+	while (at < match_limit) {
+		const uint32_t hash = lz_hash(at);
+		const uint8_t *candidate = in + table[hash];
+		table[hash] = (uint32_t)(at - in);
+
+		if (
+			candidate >= at
+			|| at - candidate > LZ_MAX_OFFSET
+			|| memcmp(candidate, at, LZ_MIN_MATCH) != 0
+		) {
+			// skip faster through data that isn't compressing
+			at += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+
+		const uint8_t *match_end = at + LZ_MIN_MATCH;
+		const uint8_t *from = candidate + LZ_MIN_MATCH;
+		while (match_end < end - 5 && *match_end == *from) {
+			match_end++;
+			from++;
+		}
+
+		if (!lz_sequence(
+			&out,
+			out_end,
+			literals,
+			(size_t)(at - literals),
+			(size_t)(at - candidate),
+			(size_t)(match_end - at)
+		))
+			return 0;
+		at = literals = match_end;
+	}
+
+	if (!lz_sequence(&out, out_end, literals, (size_t)(end - literals), 0, 0))
+		return 0;
+	return (size_t)(out - out_begin);
+}
+
+static bool lz_decompress(const uint8_t *in, size_t length, uint8_t *out, size_t size)
+{
+	const uint8_t *const end = in + length;
+	uint8_t *const out_begin = out;
+	uint8_t *const out_end = out + size;
+
+	while (in < end) {
+		const uint8_t token = *in++;
+		size_t literal_count = token >> 4;
+		if (literal_count == 15 && !lz_get_length(&in, end, &literal_count))
+			return false;
+		if ((size_t)(end - in) < literal_count || (size_t)(out_end - out) < literal_count)
+			return false;
+		memcpy(out, in, literal_count);
+		out += literal_count;
+		in += literal_count;
+
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return false;
+		const size_t offset = in[0] | (size_t)in[1] << 8;
+		in += 2;
+
+		size_t match_length = token & 15;
+		if (match_length == 15 && !lz_get_length(&in, end, &match_length))
+			return false;
+		match_length += LZ_MIN_MATCH;
+
+		if (
+			!offset
+			|| offset > (size_t)(out - out_begin)
+			|| (size_t)(out_end - out) < match_length
+		)
+			return false;
+
+		// the match may overlap what it's copying into
+		const uint8_t *from = out - offset;
+		if (offset >= match_length) {
+			memcpy(out, from, match_length);
+		} else {
+			for (size_t i = 0; i < match_length; i++)
+				out[i] = from[i];
+		}
+		out += match_length;
+	}
+	return out == out_end;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec now = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+static int set_compress(struct conn *conn, enum compress_codec codec, size_t threshold)
+{
+	switch (codec) {
+		case COMPRESS_LZ:
+#ifdef SRVSH_ZLIB
+		case COMPRESS_ZLIB:
+#endif
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	if (!conn->compress && !(conn->compress = calloc(1, sizeof(*conn->compress))))
+		return -1;
+	conn->compress->codec = codec;
+	conn->compress->threshold = threshold;
+	return 0;
+}
+
+/*
+ * Returns the compressed length, or 0 if the payload didn't get
+ * smaller than capacity.
+ */
+static size_t compress_payload(
+	enum compress_codec codec,
+	const void *in,
+	size_t length,
+	void *out,
+	size_t capacity
+)
+{
+	switch (codec) {
+		case COMPRESS_LZ:
+			return lz_compress(in, length, out, capacity);
+#ifdef SRVSH_ZLIB
+		case COMPRESS_ZLIB: {
+			uLongf compressed = capacity;
+			if (compress2(out, &compressed, in, length, 1) != Z_OK)
+				return 0;
+			return compressed;
+		}
+#endif
+		default:
+			return 0;
+	}
+}
+
+static bool decompress_payload(
+	enum compress_codec codec,
+	const void *in,
+	size_t length,
+	void *out,
+	size_t size
+)
+{
+	switch (codec) {
+		case COMPRESS_LZ:
+			return lz_decompress(in, length, out, size);
+#ifdef SRVSH_ZLIB
+		case COMPRESS_ZLIB: {
+			uLongf decompressed = size;
+			return uncompress(out, &decompressed, in, length) == Z_OK
+				&& decompressed == size;
+		}
+#endif
+		default:
+			return false;
+	}
+}
+
+/*
+ * Compresses a payload into an OP_COMPRESSED frame. Returns NULL if
+ * it didn't get smaller, in which case it should be sent as it is.
+ */
+static void *compress_frame(
+	struct compress *compress,
+	int opcode,
+	const struct iovec *iov,
+	int iovcnt,
+	int len,
+	struct srvsh_header *hd
+)
+{
+	const struct compressed_header header = {
+		.opcode = opcode,
+		.codec = compress->codec,
+		.size = len,
+	};
+	const size_t capacity = (size_t)len - sizeof(header);
+	char *frame = malloc((size_t)len);
+	if (!frame)
+		return NULL;
+
+	// the codecs want the payload in one piece
+	char *gathered = NULL;
+	const void *payload = iov[0].iov_base;
+	if (iovcnt > 1) {
+		if (!(gathered = malloc((size_t)len))) {
+			free(frame);
+			return NULL;
+		}
+		iov_copy(gathered, iov, iovcnt);
+		payload = gathered;
+	}
+
+	const unsigned long long start = now_ns();
+	size_t compressed = compress_payload(
+		compress->codec,
+		payload,
+		(size_t)len,
+		frame + sizeof(header),
+		capacity
+	);
+	compress->stats.compress_ns += now_ns() - start;
+	free(gathered);
+
+	if (!compressed) {
+		compress->stats.skipped++;
+		free(frame);
+		return NULL;
+	}
+
+	memcpy(frame, &header, sizeof(header));
+	compress->stats.compressed++;
+	compress->stats.raw_bytes += (unsigned long long)len;
+	compress->stats.compressed_bytes += compressed;
+	*hd = (struct srvsh_header) {
+		.opcode = OP_COMPRESSED,
+		.size = (int)(sizeof(header) + compressed),
+	};
+	return frame;
+}
+
+/*
+ * Passes on a message sent compressed, once it's been decompressed.
+ * Messages that can't be decompressed are dropped. Returns whether
+ * the message has been handled, as pass_on() does.
+ */
+static bool compressed_received(
+	int fd,
+	void *buf,
+	int len,
+	struct msghdr msg,
+	pollop_callback *callback,
+	void *context
+)
+{
+	struct compressed_header header = { 0 };
+	struct conn *conn = get_conn(fd);
+	if (
+		!conn
+		|| len < (int)sizeof(header)
+		|| (!conn->compress && set_compress(conn, COMPRESS_DEFAULT, 0) < 0)
+	) {
+		close_cmsg_fds(msg);
+		return true;
+	}
+	memcpy(&header, buf, sizeof(header));
+
+	void *data = header.size > 0 ? malloc((size_t)header.size) : NULL;
+	if (header.size < 0 || (header.size > 0 && !data)) {
+		close_cmsg_fds(msg);
+		return true;
+	}
+
+	struct compress *compress = conn->compress;
+	const unsigned long long start = now_ns();
+	const bool success = decompress_payload(
+		header.codec,
+		(char *)buf + sizeof(header),
+		(size_t)len - sizeof(header),
+		data,
+		(size_t)header.size
+	);
+	compress->stats.decompress_ns += now_ns() - start;
+
+	if (!success) {
+		compress->stats.failed++;
+		free(data);
+		close_cmsg_fds(msg);
+		return true;
+	}
+	compress->stats.decompressed++;
+
+	const bool handled = pass_on(
+		fd,
+		header.opcode,
+		data,
+		header.size,
+		msg,
+		callback,
+		context
+	);
+	free(data);
+	return handled;
+}
+
+/*
+ * Passes on a message sent with sendbulkop(), mapping the memfd it
+ * came with for the callback. The memfd is left in the control data,
+ * for close_cmsg_fds() to close like any other.
+ */
+static void bulk_received(
+	int fd,
+	void *buf,
+	int len,
+	struct msghdr msg,
+	pollop_callback *callback,
+	void *context
+)
+{
+	static const int required_seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+	int memfd = -1;
+	struct cmsghdr *chdr = msg.msg_control ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (
+		chdr
+		&& chdr->cmsg_level == SOL_SOCKET
+		&& chdr->cmsg_type == SCM_RIGHTS
+		&& chdr->cmsg_len >= CMSG_LEN(sizeof(int))
+	)
+		memcpy(&memfd, CMSG_DATA(chdr), sizeof(memfd));
+
+	int opcode = 0;
+	struct stat info = { 0 };
+	if (
+		len != sizeof(opcode)
+		|| memfd < 0
+		// without the seals, the sender could still change it
+		|| (fcntl(memfd, F_GET_SEALS) & required_seals) != required_seals
+		|| fstat(memfd, &info) < 0
+		|| info.st_size > INT_MAX
+	) {
+		close_cmsg_fds(msg);
+		return;
+	}
+	memcpy(&opcode, buf, sizeof(opcode));
+
+	void *data = NULL;
+	if (info.st_size) {
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, memfd, 0);
+		if (data == MAP_FAILED) {
+			close_cmsg_fds(msg);
+			return;
+		}
+	}
+
+	traffic_in(fd, opcode, (size_t)info.st_size);
+	callback(fd, opcode, data, (int)info.st_size, msg, context);
+
+	if (data)
+		munmap(data, info.st_size);
+}
+
+static int forward_target(int fd, int opcode, const void *buf, int len);
+static bool forward_by_rule(
+	int from,
+	int to,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr msg
+);
+
+/*
+ * How many RPC layers are open. Requests and replies only mean
+ * anything to rpc_callback(), but it may be reached through an
+ * op_dispatcher or a callback wrapping it, so they're passed to
+ * whatever callback was given while any are open, and dropped
+ * otherwise.
+ */
+static atomic_int rpc_layers = 0;
+
+/*
+ * Passes a message on to the callback, unwrapping any that libsrvsh
+ * wrapped on the way, unless a rule forwards it elsewhere. Returns
+ * whether the message has been handled, which a forwarded one
+ * waiting for credit hasn't.
+ */
+static bool pass_on(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr msg,
+	pollop_callback *callback,
+	void *context
+)
+{
+	if (!opcode_is_reserved(opcode))
+		traffic_in(fd, opcode, (size_t)len);
+
+	const int to = forward_target(fd, opcode, buf, len);
+	if (to >= 0)
+		return forward_by_rule(fd, to, opcode, buf, len, msg);
+
+	switch (opcode) {
+		case OP_BULK:
+			bulk_received(fd, buf, len, msg, callback, context);
+			return true;
+		case OP_COMPRESSED:
+			return compressed_received(fd, buf, len, msg, callback, context);
+		case OP_RPC_CALL:
+		case OP_RPC_REPLY:
+			if (!atomic_load_explicit(&rpc_layers, memory_order_relaxed)) {
+				close_cmsg_fds(msg);
+				return true;
+			}
+			break;
+	}
+
+	callback(fd, opcode, buf, len, msg, context);
+	return true;
+}
+
+static void credit_granted(int fd, struct conn *conn, const void *buf, int len);
+
+/*
+ * Every message read from a socket passes through here on its way
+ * to the callback, so libsrvsh's own messages can be picked out.
+ */
+static void deliver(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr msg,
+	pollop_callback *callback,
+	void *context
+)
+{
+	struct conn *conn = find_conn(fd);
+	struct shm *shm = conn ? conn->shm : NULL;
+
+	switch (opcode) {
+		case OP_SHM_OFFER:
+			if ((conn = get_conn(fd)))
+				shm_offered(fd, conn, buf, len, msg);
+			return;
+		case OP_SHM_START:
+			if (shm)
+				shm->receiving = true;
+			// fallthrough
+		case OP_SHM_DOORBELL:
+			if (shm)
+				shm_drain(fd, shm, callback, context);
+			return;
+		case OP_CREDIT:
+			if ((conn = get_conn(fd)))
+				credit_granted(fd, conn, buf, len);
+			return;
+	}
+
+	if (shm && shm->receiving) {
+		// Everything in the ring before this frame's marker was
+		// there before the frame was sent, but the marker itself is
+		// written after, so it may not have turned up yet
+		shm_drain(fd, shm, callback, context);
+		if (shm->at_marker) {
+			shm->at_marker = false;
+			shm_advance(shm, sizeof(struct srvsh_header));
+		} else {
+			shm->markers_owed++;
+		}
+	}
+
+	if (pass_on(fd, opcode, buf, len, msg, callback, context))
+		credit_handled(fd, len);
+
+	if (shm && shm->receiving)
+		shm_drain(fd, shm, callback, context);
+}
+
+static void conn_forget(struct conn *conn);
+
+/*
+ * Called when a socket hangs up, to pass on anything the peer
+ * left in the ring before it went.
+ */
+static void hangup(int fd, pollop_callback *callback, void *context)
+{
+	struct conn *conn = find_conn(fd);
+	if (!conn)
+		return;
+
+	atomic_fetch_add_explicit(&conn->traffic.hangups, 1, memory_order_relaxed);
+
+	if (conn->shm) {
+		shm_drain(fd, conn->shm, callback, context);
+		shm_detach(conn);
+		conn->shm_probed = false;
+	}
+
+	// the descriptor may be reused for a different kind of socket,
+	// which shouldn't inherit the settings of this one
+	conn->type = 0;
+	conn_forget(conn);
+}
+
+bool is_shm(int fd)
+{
+	shm_probe(fd);
+	struct conn *conn = find_conn(fd);
+	return conn && conn->shm && conn->shm->sending;
+}
+
+static ssize_t sendbuf_append(
+	struct sendbuf *sb,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	const bool compact = compact_headers(sb->fd);
+	const size_t header_length = header_size(compact, hd);
+	const size_t length = header_length + (size_t)hd->size;
+
+	// File descriptors arrive with the first byte of the write
+	// they were sent with, so everything queued before them has
+	// to go out first, and the frame carrying them on its own
+	if (cmsg || sb->length + length > sb->size) {
+		if (sb->length && sendbuf_flush(sb) < 0)
+			return -1;
+	}
+
+	if (cmsg || length > sb->size)
+		return sendmsg_framev(sb->fd, hd, iov, iovcnt, cmsg, cmsg_len);
+
+	if (!sb->length && sb->delay >= 0) {
+		sb->deadline = now_ms() + sb->delay;
+		sb->next = pending_sends;
+		if (pending_sends)
+			pending_sends->prev = sb;
+		pending_sends = sb;
+	}
+
+	header_encode(compact, hd, sb->buffer + sb->length);
+	iov_copy(sb->buffer + sb->length + header_length, iov, iovcnt);
+	sb->length += length;
+	return (ssize_t)length;
+}
+
+ssize_t sendmsgop(
+	int fd,
+	int opcode,
+	const void *buf,
+	int len,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	if (len < 0)
+		return -1;
+
+	const struct iovec iov = {
+		.iov_base = (void*)buf,
+		.iov_len = (size_t)len,
+	};
+	return sendmsgopv(fd, opcode, &iov, 1, cmsg, cmsg_len);
+}
+
+ssize_t writeopv(
+	int fd,
+	int opcode,
+	const struct iovec *iov,
+	int iovcnt
+)
+{
+	return sendmsgopv(
+		fd,
+		opcode,
+		iov,
+		iovcnt,
+		NULL,
+		0
+	);
+}
+
+static bool credit_waits(const struct credit *credit);
+static ssize_t credit_hold(
+	int fd,
+	struct credit *credit,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len,
+	int from
+);
+static ssize_t send_frame(
+	int fd,
+	struct conn *conn,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+);
+
+/*
+ * Sends a message, or holds it back until there's credit for it.
+ * A forwarded one gives the connection it came from as from, and
+ * other messages -1.
+ */
+static ssize_t send_message(
+	int fd,
+	int opcode,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len,
+	int from
+)
+{
+	// one segment is kept back for the header
+	if (iovcnt < 0 || iovcnt >= IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const size_t len = iov_length(iov, iovcnt);
+	if (len > INT_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct srvsh_header hd = {
+		.opcode = opcode,
+		.size = (int)len,
+	};
+
+	shm_probe(fd);
+
+	struct conn *conn = find_configured(fd);
+	struct credit *credit = conn ? conn->credit : NULL;
+	ssize_t result = -1;
+	if (credit && credit_waits(credit))
+		result = credit_hold(fd, credit, &hd, iov, iovcnt, cmsg, cmsg_len, from);
+	else
+		result = send_frame(fd, conn, &hd, iov, iovcnt, cmsg, cmsg_len);
+
+	if (result < 0)
+		traffic_error(fd);
+	else if (!opcode_is_reserved(opcode))
+		traffic_out(fd, opcode, len);
+	return result;
+}
+
+ssize_t sendmsgopv(
+	int fd,
+	int opcode,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	return send_message(fd, opcode, iov, iovcnt, cmsg, cmsg_len, -1);
+}
+
+/*
+ * Sends a frame on whichever path the connection has set up. The
+ * header is updated to the frame that went out on the socket.
+ */
+static ssize_t send_path(
+	int fd,
+	struct conn *conn,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	if (conn && conn->shm && conn->shm->sending)
+		return shm_send(fd, conn->shm, hd, iov, iovcnt, cmsg, cmsg_len);
+
+	// The ring doesn't need it, but sockets fill up
+	const size_t len = (size_t)hd->size;
+	void *compressed = NULL;
+	if (
+		conn
+		&& conn->compress
+		&& conn->compress->threshold
+		&& len >= conn->compress->threshold
+		&& len > sizeof(struct compressed_header)
+	)
+		compressed = compress_frame(conn->compress, hd->opcode, iov, iovcnt, (int)len, hd);
+
+	struct iovec frame = {
+		.iov_base = compressed,
+		.iov_len = (size_t)hd->size,
+	};
+	if (compressed) {
+		iov = &frame;
+		iovcnt = 1;
+	}
+
+	ssize_t result = 0;
+	if (conn && conn->send)
+		result = sendbuf_append(conn->send, hd, iov, iovcnt, cmsg, cmsg_len);
+	else
+		result = sendmsg_framev(fd, hd, iov, iovcnt, cmsg, cmsg_len);
+
+	free(compressed);
+	return result;
+}
+
+/*
+ * Sends a frame, taking it out of the credit the peer has granted.
+ */
+static ssize_t send_frame(
+	int fd,
+	struct conn *conn,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	ssize_t result = send_path(fd, conn, hd, iov, iovcnt, cmsg, cmsg_len);
+	if (result >= 0 && conn && conn->credit && conn->credit->limited) {
+		conn->credit->messages--;
+		conn->credit->bytes -= hd->size;
+	}
+	return result;
+}
+
+static struct credit *get_credit(struct conn *conn)
+{
+	if (!conn->credit && (conn->credit = calloc(1, sizeof(*conn->credit))))
+		conn->credit->tail = &conn->credit->head;
+	return conn->credit;
+}
+
+static bool credit_available(const struct credit *credit)
+{
+	return !credit->limited
+		|| (credit->messages > 0 && (!credit->bytes_limited || credit->bytes > 0));
+}
+
+/*
+ * Whether a message sent now has to wait, behind others or for
+ * credit.
+ */
+static bool credit_waits(const struct credit *credit)
+{
+	return credit->limited && (credit->head || !credit_available(credit));
+}
+
+static void heldmsg_free(struct heldmsg *held)
+{
+	if (held->cmsg) {
+		struct msghdr stale = {
+			.msg_control = held->cmsg,
+			.msg_controllen = held->cmsg_len,
+		};
+		close_cmsg_fds(stale);
+		free(held->cmsg);
+	}
+	free(held);
+}
+
+/*
+ * Whether what's held already fills the peer's window, leaving no
+ * room for another message of the size.
+ */
+static bool credit_full(const struct credit *credit, int size)
+{
+	if (!credit->held)
+		return false;
+
+	const long long bytes = (long long)credit->held_bytes + size;
+	return credit->held >= (size_t)credit->peer_window
+		|| (credit->peer_window_bytes && bytes > credit->peer_window_bytes);
+}
+
+/*
+ * Keeps a copy of a message until there's credit to send it, and
+ * returns what sending it would have. The sender's own messages are
+ * held up to the peer's window, and past it fail with EAGAIN, though
+ * one is always taken when nothing's held. Forwarded messages are
+ * bounded by their source's window instead, since it only gets
+ * credit back for them once they've gone.
+ */
+static ssize_t credit_hold(
+	int fd,
+	struct credit *credit,
+	struct srvsh_header *hd,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len,
+	int from
+)
+{
+	if (from < 0 && credit_full(credit, hd->size)) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct heldmsg *held = malloc(sizeof(*held) + (size_t)hd->size);
+	if (!held)
+		return -1;
+
+	*held = (struct heldmsg) {
+		.opcode = hd->opcode,
+		.size = hd->size,
+		.from = from,
+	};
+	iov_copy(held->data, iov, iovcnt);
+	if (cmsg_len) {
+		if (!(held->cmsg = cmsg_dup(cmsg, cmsg_len))) {
+			free(held);
+			return -1;
+		}
+		held->cmsg_len = cmsg_len;
+	}
+
+	*credit->tail = held;
+	credit->tail = &held->next;
+	credit->held++;
+	credit->held_bytes += (size_t)hd->size;
+	credit->stalls++;
+	return (ssize_t)(header_size(compact_headers(fd), hd) + (size_t)hd->size);
+}
+
+/*
+ * Sends held messages for as long as the credit lasts. A message
+ * that fails is dropped, as a failed queued write is.
+ */
+static void credit_flush(int fd, struct conn *conn)
+{
+	struct credit *credit = conn->credit;
+	while (credit->head && credit_available(credit)) {
+		struct heldmsg *held = credit->head;
+		if (!(credit->head = held->next))
+			credit->tail = &credit->head;
+		credit->held--;
+		credit->held_bytes -= (size_t)held->size;
+
+		struct srvsh_header hd = {
+			.opcode = held->opcode,
+			.size = held->size,
+		};
+		const struct iovec iov = {
+			.iov_base = held->data,
+			.iov_len = (size_t)held->size,
+		};
+		send_frame(fd, conn, &hd, &iov, 1, held->cmsg, held->cmsg_len);
+		if (held->from >= 0)
+			credit_handled(held->from, held->size);
+		heldmsg_free(held);
+	}
+}
+
+static void credit_granted(int fd, struct conn *conn, const void *buf, int len)
+{
+	struct credit_grant grant = { 0 };
+	struct credit *credit = get_credit(conn);
+	if (!credit || len != sizeof(grant))
+		return;
+	memcpy(&grant, buf, sizeof(grant));
+
+	if (grant.messages < 0) {
+		credit->limited = false;
+	} else {
+		if (!credit->limited) {
+			credit->limited = true;
+			credit->messages = 0;
+			credit->bytes = 0;
+			credit->bytes_limited = grant.bytes >= 0;
+			credit->peer_window = 0;
+			credit->peer_window_bytes = 0;
+		}
+		credit->messages += grant.messages;
+		if (grant.bytes > 0)
+			credit->bytes += grant.bytes;
+		credit->peer_window = MAX(credit->peer_window, (long)grant.messages);
+		credit->peer_window_bytes = MAX(credit->peer_window_bytes, (long long)grant.bytes);
+	}
+	credit_flush(fd, conn);
+}
+
+static int credit_grant(int fd, int messages, int bytes)
+{
+	const struct credit_grant grant = {
+		.messages = messages,
+		.bytes = bytes,
+	};
+	struct srvsh_header hd = {
+		.opcode = OP_CREDIT,
+		.size = sizeof(grant),
+	};
+	return sendmsg_frame(fd, &hd, &grant, NULL, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Counts a message as handled, and gives the credit for what's been
+ * handled back to the peer once it's half the window, so it can keep
+ * sending while this end catches up.
+ */
+static void credit_handled(int fd, int len)
+{
+	struct conn *conn = find_configured(fd);
+	struct credit *credit = conn ? conn->credit : NULL;
+	if (!credit || !credit->window)
+		return;
+
+	credit->handled++;
+	credit->handled_bytes += len;
+	if (
+		credit->handled * 2 < credit->window
+		&& (!credit->window_bytes || credit->handled_bytes * 2 < credit->window_bytes)
+	)
+		return;
+
+	const int bytes = credit->window_bytes
+		? (int)MIN(credit->handled_bytes, (long long)INT_MAX)
+		: -1;
+	if (credit_grant(fd, credit->handled, bytes) == 0) {
+		credit->handled = 0;
+		credit->handled_bytes -= bytes > 0 ? bytes : credit->handled_bytes;
+	}
+}
+
+int creditop(int fd, int messages, int bytes)
+{
+	if (messages < 0 || bytes < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct conn *conn = get_conn(fd);
+	struct credit *credit = conn ? get_credit(conn) : NULL;
+	if (!credit)
+		return -1;
+
+	if (!messages) {
+		credit->window = credit->window_bytes = 0;
+		credit->handled = 0;
+		credit->handled_bytes = 0;
+		return credit_grant(fd, -1, -1);
+	}
+
+	if (credit->window) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	credit->window = messages;
+	credit->window_bytes = bytes;
+	return credit_grant(fd, messages, bytes ? bytes : -1);
+}
+
+int get_credit_state(int fd, struct credit_state *state)
+{
+	struct conn *conn = find_configured(fd);
+	const struct credit *credit = conn ? conn->credit : NULL;
+	*state = (struct credit_state) { .bytes = -1 };
+	if (!credit)
+		return 0;
+
+	*state = (struct credit_state) {
+		.limited = credit->limited,
+		.messages = credit->limited ? credit->messages : -1,
+		.bytes = credit->limited && credit->bytes_limited ? credit->bytes : -1,
+		.held = credit->held,
+		.held_bytes = credit->held_bytes,
+		.stalls = credit->stalls,
+		.window = credit->window,
+		.window_bytes = credit->window_bytes,
+	};
+	return 0;
+}
+
+/*
+ * Copies a payload into a sealed memfd, for sending with OP_BULK.
+ */
+static int bulk_memfd(const void *buf, size_t len)
+{
+	int memfd = memfd_create("srvsh-bulk", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		return -1;
+
+	for (size_t written = 0; written < len;) {
+		ssize_t result = write(memfd, (const char *)buf + written, len - written);
+		if (result < 0) {
+			close(memfd);
+			return -1;
+		}
+		written += result;
+	}
+
+	const int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+	if (fcntl(memfd, F_ADD_SEALS, seals) < 0) {
+		close(memfd);
+		return -1;
+	}
+	return memfd;
+}
+
+union fd_cmsg {
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+};
+
+static void fd_cmsg_init(union fd_cmsg *cmsg, int fd)
+{
+	*cmsg = (union fd_cmsg) { 0 };
+	cmsg->align.cmsg_level = SOL_SOCKET;
+	cmsg->align.cmsg_type = SCM_RIGHTS;
+	cmsg->align.cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(&cmsg->align), &fd, sizeof(fd));
+}
+
+ssize_t sendbulkop(int fd, int opcode, const void *buf, size_t len)
+{
+	if (len > INT_MAX)
+		return -1;
+
+	int memfd = bulk_memfd(buf, len);
+	if (memfd < 0)
+		return -1;
+
+	union fd_cmsg cmsg;
+	fd_cmsg_init(&cmsg, memfd);
+
+	ssize_t result = sendmsgop(
+		fd,
+		OP_BULK,
+		&opcode,
+		sizeof(opcode),
+		&cmsg,
+		sizeof(cmsg)
+	);
+	close(memfd);
+	if (result >= 0)
+		traffic_out(fd, opcode, len);
+	return result;
+}
+
+/*
+ * One encoding of the frame broadcastop() sends, with its header
+ * either compact or not.
+ */
+struct broadcast_frame {
+	char header[HEADER_MAX];
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t length;
+};
+
+static void broadcast_frame_init(
+	struct broadcast_frame *frame,
+	bool compact,
+	struct srvsh_header *hd,
+	const struct iovec *payload,
+	void *cmsg,
+	size_t cmsg_len
+)
+{
+	const size_t header_length = header_encode(compact, hd, frame->header);
+	frame->iov[0] = (struct iovec) {
+		.iov_base = frame->header,
+		.iov_len = header_length,
+	};
+	frame->iov[1] = *payload;
+	frame->length = header_length + payload->iov_len;
+	frame->msg = (struct msghdr) {
+		.msg_iov = frame->iov,
+		.msg_iovlen = 2,
+		.msg_control = cmsg,
+		.msg_controllen = cmsg_len,
+	};
+}
+
+/*
+ * A client that wouldn't take all of a broadcast without blocking.
+ */
+struct straggler {
+	int fd;
+	const struct broadcast_frame *frame;
+	size_t sent;
+};
+
+/*
+ * Sends what the socket will take of the rest of a frame without
+ * blocking. Returns false if the client has failed.
+ */
+static bool broadcast_send(struct straggler *client)
+{
+	const struct broadcast_frame *frame = client->frame;
+	struct iovec iov[2];
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = iov_slice(
+			frame->iov,
+			2,
+			client->sent,
+			frame->length - client->sent,
+			iov
+		),
+		// the file descriptors go with the first byte
+		.msg_control = client->sent ? NULL : frame->msg.msg_control,
+		.msg_controllen = client->sent ? 0 : frame->msg.msg_controllen,
+	};
+
+	// One dead client shouldn't take the sender down with SIGPIPE
+	ssize_t sent = 0;
+	do {
+		sent = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (sent < 0 && errno == EINTR);
+
+	if (sent < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	client->sent += (size_t)sent;
+	return true;
+}
+
+/*
+ * Whether a frame can be written straight to the socket, without any
+ * of the paths a connection can have set up for it.
+ */
+static bool plain_socket(int fd)
+{
+	shm_probe(fd);
+	struct conn *conn = find_configured(fd);
+	return !(
+		conn
+		&& (
+			(conn->shm && conn->shm->sending)
+			|| conn->send
+			|| (conn->out && !conn->out->blocking)
+			|| (conn->compress && conn->compress->threshold)
+			|| (conn->credit && conn->credit->limited)
+		)
+	);
+}
+
+/*
+ * Whether a client needs more than a plain write, because of how its
+ * connection was set up.
+ */
+static bool broadcast_special(int fd, size_t length)
+{
+	return !plain_socket(fd)
+		|| (length > SEQPACKET_RECORD && socket_type(fd) == SOCK_SEQPACKET);
+}
+
+static void flush_at_exit_register(void);
+
+/*
+ * Queues the rest of a frame for a client that couldn't take it all
+ * at once, to be sent as its socket drains, so a client that has
+ * stopped reading doesn't hold up the broadcast.
+ */
+static bool broadcast_leave(const struct straggler *client)
+{
+	struct conn *conn = get_conn(client->fd);
+	if (!conn)
+		return false;
+
+	struct outq *q = conn->out;
+	if (!q) {
+		if (!(q = calloc(1, sizeof(*q))))
+			return false;
+		q->fd = client->fd;
+		q->blocking = true;
+		q->tail = &q->head;
+		conn->out = q;
+		flush_at_exit_register();
+	}
+	return outq_push(q, &client->frame->msg, client->sent);
+}
+
+/*
+ * Whether a client is still owed the rest of an earlier broadcast,
+ * which anything new has to wait behind.
+ */
+static bool broadcast_behind(int fd)
+{
+	struct conn *conn = find_conn(fd);
+	if (!conn || !conn->out || !conn->out->blocking)
+		return false;
+
+	outq_flush(conn->out);
+	if (conn->out->head)
+		return true;
+	outq_finish(conn);
+	return false;
+}
+
+int broadcastop(const int *fds, int count, int opcode, const void *buf, int len)
+{
+	if (!fds)
+		count = cli_count();
+	if (count < 0 || len < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Large payloads are written once, to a memfd every client maps
+	int memfd = -1;
+	union fd_cmsg cmsg;
+	struct srvsh_header hd = {
+		.opcode = opcode,
+		.size = len,
+	};
+	struct iovec payload = {
+		.iov_base = (void*)buf,
+		.iov_len = (size_t)len,
+	};
+	void *control = NULL;
+	size_t control_len = 0;
+	if (len >= BROADCAST_BULK_MIN) {
+		if ((memfd = bulk_memfd(buf, (size_t)len)) < 0)
+			return -1;
+		fd_cmsg_init(&cmsg, memfd);
+		control = &cmsg;
+		control_len = sizeof(cmsg);
+		hd = (struct srvsh_header) {
+			.opcode = OP_BULK,
+			.size = sizeof(opcode),
+		};
+		payload = (struct iovec) {
+			.iov_base = &opcode,
+			.iov_len = sizeof(opcode),
+		};
+	}
+
+	struct broadcast_frame frames[2];
+	broadcast_frame_init(&frames[0], false, &hd, &payload, control, control_len);
+	broadcast_frame_init(&frames[1], true, &hd, &payload, control, control_len);
+
+	// Nobody is waited on; what a client won't take now is queued
+	int failed = 0;
+	int saved_errno = 0;
+	for (int i = 0; i < count; i++) {
+		const int fd = fds ? fds[i] : CLI_BEGIN + i;
+
+		if (broadcast_special(fd, frames[0].length)) {
+			if (sendmsgopv(fd, hd.opcode, &payload, 1, control, control_len) < 0) {
+				saved_errno = errno;
+				failed++;
+			} else if (memfd >= 0)
+				traffic_out(fd, opcode, (size_t)len);
+			continue;
+		}
+
+		struct straggler client = {
+			.fd = fd,
+			.frame = &frames[compact_headers(fd)],
+		};
+		const bool sent = broadcast_behind(fd) ?
+			broadcast_leave(&client) :
+			broadcast_send(&client)
+				&& (
+					client.sent == client.frame->length
+					|| broadcast_leave(&client)
+				);
+		if (!sent) {
+			saved_errno = errno;
+			traffic_error(fd);
+			failed++;
+			continue;
+		}
+		traffic_out(fd, opcode, (size_t)len);
+	}
+
+	if (memfd >= 0)
+		close(memfd);
+	if (failed)
+		errno = saved_errno;
+	return count - failed;
+}
+
+/*
+ * Forwards a message by a rule. One that has to wait for credit is
+ * only counted as handled once it's gone, so a source that's faster
+ * than the destination is held back by its own window, rather than
+ * piling up here. Returns whether it can be counted as handled now.
+ */
+static bool forward_by_rule(
+	int from,
+	int to,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr msg
+)
+{
+	struct conn *conn = find_configured(to);
+	const bool waits = conn && conn->credit && credit_waits(conn->credit);
+	const struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = (size_t)len,
+	};
+	const ssize_t result = send_message(
+		to,
+		opcode,
+		&iov,
+		1,
+		msg.msg_controllen ? msg.msg_control : NULL,
+		msg.msg_controllen,
+		waits ? from : -1
+	);
+	close_cmsg_fds(msg);
+	return !waits || result < 0;
+}
+
+ssize_t forwardop(int to, int opcode, const void *buf, int len, struct msghdr header)
+{
+	// the peer gets copies of the file descriptors, so these are done
+	ssize_t result = sendmsgop(
+		to,
+		opcode,
+		buf,
+		len,
+		header.msg_controllen ? header.msg_control : NULL,
+		header.msg_controllen
+	);
+	close_cmsg_fds(header);
+	return result;
+}
+
+int set_forward(int from, int opcode, int to)
+{
+	if (from < 0 || (opcode_is_reserved(opcode) && opcode != FORWARD_ALL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct conn *conn = get_conn(from);
+	if (!conn)
+		return -1;
+	if (!conn->forward && !(conn->forward = calloc(1, sizeof(*conn->forward))))
+		return -1;
+	struct forward *forward = conn->forward;
+
+	if (opcode == FORWARD_ALL) {
+		forward->all = to >= 0;
+		forward->all_to = to;
+		return 0;
+	}
+
+	for (int i = 0; i < forward->count; i++) {
+		if (forward->rules[i].opcode != opcode)
+			continue;
+		if (to >= 0)
+			forward->rules[i].to = to;
+		else
+			forward->rules[i] = forward->rules[--forward->count];
+		return 0;
+	}
+
+	if (to < 0)
+		return 0;
+
+	struct forward_rule *attempt = realloc(
+		forward->rules,
+		(size_t)(forward->count + 1) * sizeof(*attempt)
+	);
+	if (!attempt)
+		return -1;
+	forward->rules = attempt;
+	forward->rules[forward->count++] = (struct forward_rule) { opcode, to };
+	return 0;
+}
+
+/*
+ * Returns where a frame from fd is forwarded to by the rules set for
+ * it, or -1 if it isn't. A bulk frame is forwarded whole, memfd and
+ * all, by the rule for the opcode it carries, and RPC requests and
+ * replies by FORWARD_ALL.
+ */
+static int forward_target(int fd, int opcode, const void *buf, int len)
+{
+	struct conn *conn = find_conn(fd);
+	const struct forward *forward = conn ? conn->forward : NULL;
+	if (!forward)
+		return -1;
+
+	// requests and replies have no rules of their own, but are
+	// meant for whoever everything else goes to
+	if (opcode == OP_BULK && len == sizeof(opcode))
+		memcpy(&opcode, buf, sizeof(opcode));
+	else if (opcode == OP_RPC_CALL || opcode == OP_RPC_REPLY)
+		return forward->all ? forward->all_to : -1;
+	else if (opcode_is_reserved(opcode))
+		return -1;
+
+	for (int i = 0; i < forward->count; i++)
+		if (forward->rules[i].opcode == opcode)
+			return forward->rules[i].to;
+	return forward->all ? forward->all_to : -1;
+}
+
+static pthread_key_t splice_key;
+static pthread_once_t splice_once = PTHREAD_ONCE_INIT;
+
+static void splice_pipe_close(void *pipe_fds)
+{
+	close(((int *)pipe_fds)[0]);
+	close(((int *)pipe_fds)[1]);
+	free(pipe_fds);
+}
+
+static void splice_key_create(void)
+{
+	if (pthread_key_create(&splice_key, splice_pipe_close) != 0)
+		splice_key = (pthread_key_t)-1;
+}
+
+/*
+ * A pipe for each thread, to splice frame bodies through, followed by
+ * how many bytes it can hold.
+ */
+static int *splice_pipe(void)
+{
+	pthread_once(&splice_once, splice_key_create);
+	if (splice_key == (pthread_key_t)-1)
+		return NULL;
+
+	int *pipe_fds = pthread_getspecific(splice_key);
+	if (pipe_fds)
+		return pipe_fds;
+
+	if (!(pipe_fds = malloc(3 * sizeof(*pipe_fds))))
+		return NULL;
+	if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+		free(pipe_fds);
+		return NULL;
+	}
+	fcntl(pipe_fds[1], F_SETPIPE_SZ, FORWARD_PIPE_SIZE);
+	pipe_fds[2] = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+	if (pthread_setspecific(splice_key, pipe_fds) != 0) {
+		splice_pipe_close(pipe_fds);
+		return NULL;
+	}
+	return pipe_fds;
+}
+
+/*
+ * Whether a frame's body can be spliced from one socket to another,
+ * rather than read in and written out again.
+ */
+static bool forward_splices(int from, int to, size_t length)
+{
+	struct conn *conn = find_conn(from);
+	const int *pipe_fds = NULL;
+	return length >= FORWARD_SPLICE_MIN
+		&& !(conn && conn->shm && conn->shm->receiving)
+		&& socket_type(from) == SOCK_STREAM
+		&& socket_type(to) == SOCK_STREAM
+		&& plain_socket(to)
+		&& (pipe_fds = splice_pipe())
+		&& length <= (size_t)pipe_fds[2];
+}
+
+/*
+ * Splices up to length bytes, waiting on the socket end if it was
+ * made non-blocking and isn't ready.
+ */
+static ssize_t splice_some(int in, int out, size_t length, int socket, short events)
+{
+	for (;;) {
+		ssize_t moved = splice(in, NULL, out, NULL, length, SPLICE_F_MOVE);
+		if (moved >= 0)
+			return moved;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+
+		struct pollfd pfd = { .fd = socket, .events = events };
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+/*
+ * Splices up to length bytes from a socket into the pipe, waiting for
+ * the socket if it has nothing yet. Fails with ENOBUFS if the pipe has
+ * no room left, which a body that arrived in many small pieces can
+ * cause before the pipe holds its capacity in bytes.
+ */
+static ssize_t splice_in(int from, const int *pipe_fds, size_t length)
+{
+	for (;;) {
+		ssize_t moved = splice(
+			from,
+			NULL,
+			pipe_fds[1],
+			NULL,
+			length,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+		);
+		if (moved >= 0)
+			return moved;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+
+		struct pollfd room = { .fd = pipe_fds[1], .events = POLLOUT };
+		if (poll(&room, 1, 0) == 0) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		struct pollfd readable = { .fd = from, .events = POLLIN };
+		if (poll(&readable, 1, -1) < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+/*
+ * Reads and discards what's left in the pipe.
+ */
+static void splice_discard(const int *pipe_fds, size_t length)
+{
+	char discard[4096];
+	while (length) {
+		ssize_t result = read(pipe_fds[0], discard, MIN(sizeof(discard), length));
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return;
+		length -= (size_t)result;
+	}
+}
+
+/*
+ * Relays a frame whose header has been read from one socket to
+ * another, moving its body through a pipe so it never passes through
+ * user memory. The whole body is in the pipe before the header is
+ * sent, so a source that fails partway leaves nothing behind it at
+ * the destination; if the pipe fills up first, the body is read in
+ * after what it holds instead. If the destination fails, the body is
+ * still read, to keep the source in step. Returns false if the source
+ * failed.
+ */
+static bool forward_splice(int from, int to, struct srvsh_header *hd, struct msghdr msg)
+{
+	const int *pipe_fds = splice_pipe();
+	const size_t length = (size_t)hd->size;
+	size_t queued = 0;
+	bool full = false;
+	while (queued < length) {
+		ssize_t in = splice_in(from, pipe_fds, length - queued);
+		if (in <= 0) {
+			full = in < 0 && errno == ENOBUFS;
+			break;
+		}
+		queued += (size_t)in;
+	}
+
+	char *body = NULL;
+	if (queued < length) {
+		if (!full || !(body = malloc(length))) {
+			splice_discard(pipe_fds, queued);
+			return false;
+		}
+
+		bool copied = true;
+		for (size_t at = 0; copied && at < queued;) {
+			ssize_t result = read(pipe_fds[0], body + at, queued - at);
+			if (result < 0 && errno == EINTR)
+				continue;
+			copied = result > 0;
+			at += copied ? (size_t)result : 0;
+		}
+		copied = copied
+			&& recv(from, body + queued, length - queued, MSG_WAITALL)
+				== (ssize_t)(length - queued);
+		if (!copied) {
+			free(body);
+			return false;
+		}
+	}
+
+	char header[HEADER_MAX];
+	struct iovec iov[2] = {
+		{
+			.iov_base = header,
+			.iov_len = header_encode(compact_headers(to), hd, header),
+		},
+		{
+			.iov_base = body,
+			.iov_len = body ? length : 0,
+		},
+	};
+	struct msghdr out = {
+		.msg_iov = iov,
+		.msg_iovlen = body ? 2 : 1,
+		.msg_control = msg.msg_controllen ? msg.msg_control : NULL,
+		.msg_controllen = msg.msg_controllen,
+	};
+	const bool writing = send_out(to, &out, true) >= 0;
+	if (body) {
+		free(body);
+		return true;
+	}
+
+	for (size_t moved = 0; writing && moved < length;) {
+		ssize_t result = splice_some(pipe_fds[0], to, length - moved, to, POLLOUT);
+		if (result <= 0) {
+			splice_discard(pipe_fds, length - moved);
+			break;
+		}
+		moved += (size_t)result;
+	}
+	if (!writing)
+		splice_discard(pipe_fds, length);
+	return true;
+}
+
+int compressop(int fd, enum compress_codec codec, size_t threshold)
+{
+	struct conn *conn = get_conn(fd);
+	if (!conn)
+		return -1;
+	return set_compress(conn, codec, threshold);
+}
+
+int get_compress_stats(int fd, struct compress_stats *stats)
+{
+	struct conn *conn = find_configured(fd);
+	if (!conn || !conn->compress) {
+		*stats = (struct compress_stats) { 0 };
+		return 0;
+	}
+	*stats = conn->compress->stats;
+	return 0;
+}
+
+ssize_t flushop(int fd)
+{
+	struct conn *conn = find_conn(fd);
+	if (!conn || !conn->send)
+		return 0;
+	return sendbuf_flush(conn->send);
+}
+
+int flushops(void)
+{
+	int result = 0;
+	for (int fd = 0; fd < conns_size; fd++)
+		if (flushop(fd) < 0)
+			result = -1;
+	return result;
+}
+
+static void flush_at_exit(void)
+{
+	flushops();
+
+	// what broadcastop() left for slow clients is still owed to them
+	for (int fd = 0; fd < conns_size; fd++) {
+		struct conn *conn = find_conn(fd);
+		if (conn && conn->out && conn->out->blocking)
+			outq_finish(conn);
+	}
+}
+
+static void flush_at_exit_register(void)
+{
+	static bool registered = false;
+	if (!registered)
+		registered = !atexit(flush_at_exit);
+}
+
+int corkop(int fd, size_t size, int delay)
+{
+	struct conn *conn = size ? get_conn(fd) : find_conn(fd);
+	if (!conn)
+		return size ? -1 : 0;
+
+	struct sendbuf *sb = conn->send;
+	if (sb && sendbuf_flush(sb) < 0)
+		return -1;
+
+	if (!size) {
+		if (sb) {
+			free(sb->buffer);
+			free(sb->spare);
+		}
+		free(sb);
+		conn->send = NULL;
+		return 0;
+	}
+
+	if (!sb) {
+		sb = calloc(1, sizeof(*sb));
+		if (!sb)
+			return -1;
+		sb->fd = fd;
+		conn->send = sb;
+	}
+
+	// each flush is sent as a single record
+	if (socket_type(fd) == SOCK_SEQPACKET)
+		size = MIN(size, SEQPACKET_RECORD);
+
+	char *attempt = realloc(sb->buffer, size);
+	if (!attempt)
+		return -1;
+	sb->buffer = attempt;
+
+	if (sb->spare) {
+		attempt = realloc(sb->spare, size);
+		if (!attempt)
+			return -1;
+		sb->spare = attempt;
+	}
+
+	flush_at_exit_register();
+
+	sb->size = size;
+	sb->delay = delay;
+	return 0;
+}
+
+int nonblockop(int fd, size_t limit)
+{
+	struct conn *conn = limit ? get_conn(fd) : find_conn(fd);
+	if (!conn)
+		return limit ? -1 : 0;
+
+	struct outq *q = conn->out;
+	if (!limit) {
+		// finish sending what's queued, waiting as a blocking
+		// write would have
+		return q ? outq_finish(conn) : 0;
+	}
+
+	if (!q) {
+		// anything io_uring is still sending has to go first
+		if (conn->send)
+			sendbuf_settle(conn->send);
+
+		q = calloc(1, sizeof(*q));
+		if (!q)
+			return -1;
+		q->fd = fd;
+		q->tail = &q->head;
+		conn->out = q;
+	}
+
+	q->blocking = false;
+	q->limit = limit;
+	return 0;
+}
+
+size_t queuedop(int fd)
+{
+	struct conn *conn = find_conn(fd);
+	return conn && conn->out ? conn->out->queued : 0;
+}
+
+/*
+ * Flushes corked buffers whose deadline has passed, returning how long
+ * poll() may block for before the next one is due, capped at timeout.
+ */
+static int flush_pending(int timeout)
+{
+	if (!pending_sends)
+		return timeout;
+
+	const long long now = now_ms();
+	struct sendbuf *sb = pending_sends;
+	while (sb) {
+		struct sendbuf *next = sb->next;
+		if (sb->deadline <= now) {
+			if (!sendbuf_flush_async(sb))
+				sendbuf_flush(sb);
+		} else {
+			long long wait = sb->deadline - now;
+			if (timeout < 0 || wait < timeout)
+				timeout = (int)wait;
+		}
+		sb = next;
+	}
+	return timeout;
+}
+
+void close_opcode_db(opcode_db *db)
+{
+	/*
+	 * TODO: check if the file is null-terminated
+	 * plaintext in open_opcode_db()
+	 */
+	char **files = (char**)db;
+	if (files)
+		for (; *files; files++) {
+			munmap(*files, strlen(*files));
+		}
+	free(db);
+}
+
+int srvcli_polls(struct pollfd *fds, int buflen)
+{
+	int count = cli_count() + 1;
+	if (buflen < count)
+		return -1;
+
+	*fds = (struct pollfd) {
+		.fd = SRV_FILENO,
+		.events = POLLIN,
+	};
+
+	return cli_polls(fds + 1, buflen - 1) + 1;
+}
+
+int cli_polls(struct pollfd *fds, int buflen)
+{
+	int count = cli_count();
+	if (count < 0)
+		return -1;
+
+	if (buflen < count)
+		return -1;
+
+	struct pollfd *current = fds;
+	int end = cli_end();
+	for (int cli = CLI_BEGIN; cli < end; cli++) {
+		*current = (struct pollfd) {
+			.fd = cli,
+			.events = POLLIN,
+		};
+		current++;
+	}
+	return count;
+}
+
+static void recvbuf_compact(struct recvbuf *rb)
+{
+	if (!rb->start)
+		return;
+
+	memmove(rb->buffer, rb->buffer + rb->start, rb->end - rb->start);
+	if (rb->has_cmsg)
+		rb->cmsg_at -= rb->start;
+	rb->end -= rb->start;
+	rb->start = 0;
+}
+
+static bool recvbuf_resize(struct recvbuf *rb, size_t size)
+{
+	recvbuf_compact(rb);
+	size = MAX(size, rb->end);
+	if (size == rb->size)
+		return true;
+
+	char *attempt = realloc(rb->buffer, size);
+	if (!attempt)
+		return false;
+
+	rb->buffer = attempt;
+	rb->size = size;
+	return true;
+}
+
+/*
+ * Returns the number of bytes the frame starting at the given offset
+ * occupies, or just the header size if the header isn't complete yet.
+ * Returns 0 if the header is invalid.
+ */
+static size_t recvbuf_frame_length(const struct recvbuf *rb, size_t at)
+{
+	struct srvsh_header header = { 0 };
+	const size_t available = rb->end - at;
+	ssize_t length = header_decode(rb->compact, rb->buffer + at, available, &header);
+	if (length < 0)
+		return 0;
+
+	// A compact header's length isn't known until it's all here,
+	// so ask for one more byte at a time
+	if (length == 0)
+		return rb->compact ? available + 1 : sizeof(header);
+	return (size_t)length + (size_t)header.size;
+}
+
+/*
+ * Ancillary data is attached by the kernel to the first byte written
+ * by a sendmsg() call, and a read never continues past the data the
+ * file descriptors came with. Since sendmsgop() writes whole frames,
+ * that makes the owner the last frame starting in the bytes just read.
+ */
+static size_t recvbuf_cmsg_owner(const struct recvbuf *rb, size_t read_from)
+{
+	size_t owner = read_from;
+	for (size_t at = rb->start; at < rb->end;) {
+		if (at >= read_from)
+			owner = at;
+
+		size_t length = recvbuf_frame_length(rb, at);
+		if (!length || rb->end - at < length)
+			break;
+		at += length;
+	}
+	return owner;
+}
+
+static void recvbuf_drop(struct recvbuf *rb)
+{
+	if (rb->has_cmsg) {
+		struct msghdr stale = {
+			.msg_control = rb->cmsg,
+			.msg_controllen = rb->cmsg_len,
+		};
+		close_cmsg_fds(stale);
+	}
+	rb->has_cmsg = false;
+	rb->start = rb->end = 0;
+}
+
+/*
+ * Makes room for the next read and describes it in hdr and iov.
+ */
+static bool recvbuf_prepare(
+	struct recvbuf *rb,
+	struct msghdr *hdr,
+	struct iovec *iov
+)
+{
+	size_t needed = recvbuf_frame_length(rb, rb->start);
+	if (!needed)
+		return false;
+
+	if (rb->start && rb->size - rb->end < rb->size / 2)
+		recvbuf_compact(rb);
+
+	if (rb->size - rb->start < needed) {
+		recvbuf_compact(rb);
+		if (rb->size < needed && !recvbuf_resize(rb, needed))
+			return false;
+	}
+
+	if (rb->records && rb->size - rb->end < SEQPACKET_RECORD) {
+		recvbuf_compact(rb);
+		if (
+			rb->size - rb->end < SEQPACKET_RECORD
+			&& !recvbuf_resize(rb, rb->end + SEQPACKET_RECORD)
+		)
+			return false;
+	}
+
+	*iov = (struct iovec) {
+		.iov_base = rb->buffer + rb->end,
+		.iov_len = rb->size - rb->end,
+	};
+	*hdr = (struct msghdr) {
+		.msg_iov = iov,
+		.msg_iovlen = 1,
+	};
+
+	// The frame at the front already owns the ancillary data we're
+	// holding, so don't read past it and risk picking up another
+	// set of file descriptors we'd have nowhere to put
+	if (rb->has_cmsg) {
+		iov->iov_len = MIN(iov->iov_len, rb->start + needed - rb->end);
+	} else {
+		hdr->msg_control = rb->cmsg;
+		hdr->msg_controllen = sizeof(rb->cmsg);
+	}
+	return true;
+}
+
+/*
+ * Accounts for a read described by recvbuf_prepare(), then passes
+ * every complete frame to the callback.
+ */
+static pollfd_read_t recvbuf_complete(
+	int fd,
+	struct recvbuf *rb,
+	size_t received,
+	size_t controllen,
+	pollop_callback *callback,
+	void *context
+)
+{
+	if (received == 0) {
+		recvbuf_drop(rb);
+		return HANGUP;
+	}
+
+	size_t read_from = rb->end;
+	rb->end += received;
+
+	if (!rb->has_cmsg && controllen > 0) {
+		rb->has_cmsg = true;
+		rb->cmsg_len = controllen;
+		rb->cmsg_at = recvbuf_cmsg_owner(rb, read_from);
+	}
+
+	while (rb->start < rb->end) {
+		struct srvsh_header header = { 0 };
+		ssize_t header_length = header_decode(
+			rb->compact,
+			rb->buffer + rb->start,
+			rb->end - rb->start,
+			&header
+		);
+		if (header_length < 0)
+			return ERROR;
+
+		const size_t length = (size_t)header_length + (size_t)header.size;
+		if (!header_length || rb->end - rb->start < length)
+			break;
+
+		struct msghdr msg = { 0 };
+		if (rb->has_cmsg && rb->cmsg_at == rb->start) {
+			msg.msg_control = rb->cmsg;
+			msg.msg_controllen = rb->cmsg_len;
+			rb->has_cmsg = false;
+		}
+
+		void *data = header.size ?
+			rb->buffer + rb->start + header_length :
+			NULL;
+		rb->start += length;
+
+		rb->delivering = true;
+		deliver(
+			fd,
+			header.opcode,
+			data,
+			header.size,
+			msg,
+			callback,
+			context
+		);
+		rb->delivering = false;
+	}
+
+	if (rb->start == rb->end)
+		rb->start = rb->end = 0;
+
+	return SUCCESSFUL_READ;
+}
+
+static pollfd_read_t process_recvbuf(
+	int fd,
+	struct recvbuf *rb,
+	pollop_callback *callback,
+	void *context
+)
+{
+	struct iovec iov = { 0 };
+	struct msghdr hdr = { 0 };
+	if (!recvbuf_prepare(rb, &hdr, &iov))
+		return ERROR;
+
+	// With MSG_TRUNC, a record is reported at its full length even
+	// if it didn't fit, so a short read can't go unnoticed
+	const int flags = MSG_DONTWAIT | (rb->records ? MSG_TRUNC : 0);
+	ssize_t received = recvmsg(fd, &hdr, flags);
+	if (received < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return NO_WORK;
+		return ERROR;
+	}
+
+	if ((size_t)received > iov.iov_len) {
+		errno = EMSGSIZE;
+		return ERROR;
+	}
+
+	return recvbuf_complete(
+		fd,
+		rb,
+		(size_t)received,
+		hdr.msg_controllen,
+		callback,
+		context
+	);
+}
+
+int recvbufop(int fd, size_t size)
+{
+	struct conn *conn = size ? get_conn(fd) : find_conn(fd);
+	if (!conn)
+		return size ? -1 : 0;
+
+	struct recvbuf *rb = conn->recv;
+	if (!size) {
+		if (!rb)
+			return 0;
+
+		if (rb->delivering || rb->armed || rb->start != rb->end) {
+			errno = EBUSY;
+			return -1;
+		}
+
+		free(rb->buffer);
+		free(rb);
+		conn->recv = NULL;
+		return 0;
+	}
+
+	if (rb && (rb->delivering || rb->armed)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (rb)
+		rb->transient = false;
+	if (!rb) {
+		rb = calloc(1, sizeof(*rb));
+		if (!rb)
+			return -1;
+		rb->records = socket_type(fd) == SOCK_SEQPACKET;
+		rb->compact = compact_headers(fd);
+		conn->recv = rb;
+	}
+
+	size = MAX(size, sizeof(struct srvsh_header));
+	return recvbuf_resize(rb, size) ? 0 : -1;
+}
+
+/*
+ * Common poll code between different pollop functions
+ *
+ * I really don't like this function but the recvmsg interface
+ * kinda forces my hand here
+ */
+/*
+ * Hands the start of a frame that hasn't all arrived on an unbuffered
+ * connection to a buffer of size bytes, with the ancillary data it came
+ * with, so the rest is read the way buffered connections read theirs
+ * rather than waited for. The buffer is dropped once it's emptied.
+ */
+static pollfd_read_t recvbuf_resume(
+	int fd,
+	const void *data,
+	size_t length,
+	size_t size,
+	struct msghdr msg,
+	pollop_callback *callback,
+	void *context
+)
+{
+	if (recvbufop(fd, size) < 0) {
+		close_cmsg_fds(msg);
+		return ERROR;
+	}
+
+	struct recvbuf *rb = find_conn(fd)->recv;
+	rb->transient = true;
+	memcpy(rb->buffer, data, length);
+
+	const size_t controllen = MIN(msg.msg_controllen, sizeof(rb->cmsg));
+	memcpy(rb->cmsg, msg.msg_control, controllen);
+	return recvbuf_complete(fd, rb, length, controllen, callback, context);
+}
+
+static pollfd_read_t read_pollfd(struct pollfd *fd, pollop_callback *callback, void *context)
+{
+	struct conn *conn = find_conn(fd->fd);
+
+	// Records are read whole, header and body together, which is
+	// what the buffered path does anyway; the same goes for compact
+	// headers, whose length isn't known until they've been read
+	if (
+		fd->revents & POLLIN
+		&& !(conn && conn->recv)
+		&& (socket_type(fd->fd) == SOCK_SEQPACKET || compact_headers(fd->fd))
+	) {
+		if (recvbufop(fd->fd, SEQPACKET_RECORD) < 0)
+			return ERROR;
+		conn = find_conn(fd->fd);
+	}
+	if (fd->revents & POLLIN && conn && conn->recv) {
+		const pollfd_read_t result = process_recvbuf(fd->fd, conn->recv, callback, context);
+		// recvbufop() keeps the buffer while part of a frame is in it
+		if (result != ERROR && conn->recv && conn->recv->transient)
+			recvbufop(fd->fd, 0);
+		return result;
+	} else if (fd->revents & POLLIN) {
+		// TODO: don't like pretty much any of this
+		struct srvsh_header header = { 0 };
+		char cmsg_buf[1024] = { 0 };
+
+		struct iovec buf = {
+			.iov_base = &header,
+			.iov_len = sizeof(header),
+		};
+		struct msghdr hdr = {
+			.msg_iov = &buf,
+			.msg_iovlen = 1,
+			.msg_control = cmsg_buf,
+			.msg_controllen = sizeof(cmsg_buf),
+		};
+
+		ssize_t received = recvmsg(fd->fd, &hdr, MSG_DONTWAIT);
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return NO_WORK;
+		if (received < 0) {
+			return ERROR;
+		}
+
+		if (received == 0) {
+			return HANGUP;
+		}
+
+		if ((size_t)received < sizeof(header))
+			return recvbuf_resume(
+				fd->fd,
+				&header,
+				(size_t)received,
+				sizeof(header),
+				hdr,
+				callback,
+				context
+			);
+
+		// A forwarded body can go straight from one socket to the
+		// other, as long as nothing else needs to see it
+		const int to = forward_target(fd->fd, header.opcode, NULL, 0);
+		if (to >= 0 && forward_splices(fd->fd, to, (size_t)header.size)) {
+			const bool spliced = forward_splice(fd->fd, to, &header, hdr);
+			close_cmsg_fds(hdr);
+			credit_handled(fd->fd, header.size);
+			if (!opcode_is_reserved(header.opcode)) {
+				traffic_in(fd->fd, header.opcode, (size_t)header.size);
+				traffic_out(to, header.opcode, (size_t)header.size);
+			}
+			return spliced ? SUCCESSFUL_READ : ERROR;
+		}
+
+		if (header.size == 0) {
+			deliver(
+				fd->fd,
+				header.opcode,
+				NULL,
+				0,
+				hdr,
+				callback,
+				context
+			);
+			return SUCCESSFUL_READ;
+		}
+
+		// room for the header in front, in case the body has to be
+		// handed to a buffer
+		char *frame = malloc(sizeof(header) + header.size);
+		if (!frame) {
+			return ERROR;
+		}
+		void *attempt = frame + sizeof(header);
+
+		struct iovec newbuf = {
+			.iov_base = attempt,
+			.iov_len = header.size,
+		};
+
+		struct msghdr bighdr = {
+			.msg_iov = &newbuf,
+			.msg_iovlen = 1,
+		};
+
+		received = recvmsg(fd->fd, &bighdr, MSG_WAITALL | MSG_DONTWAIT);
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			received = 0;
+		if (received < 0) {
+			free(frame);
+			return ERROR;
+		}
+
+		if (received < header.size) {
+			memcpy(frame, &header, sizeof(header));
+			const pollfd_read_t result = recvbuf_resume(
+				fd->fd,
+				frame,
+				sizeof(header) + (size_t)received,
+				sizeof(header) + (size_t)header.size,
+				hdr,
+				callback,
+				context
+			);
+			free(frame);
+			return result;
+		}
+
+		deliver(
+			fd->fd,
+			header.opcode,
+			attempt,
+			header.size,
+			hdr,
+			callback,
+			context
+		);
+
+		free(frame);
+
+		return SUCCESSFUL_READ;
+	} else if (fd->revents & POLLHUP) {
+		return HANGUP;
+	} else if (
+		fd->revents & POLLNVAL
+		|| fd->revents & POLLERR
+	) {
+		return ERROR;
+	}
+	return NO_WORK;
+}
+
+static pollfd_read_t process_pollfd(struct pollfd *fd, pollop_callback *callback, void *context)
+{
+	pollfd_read_t result = read_pollfd(fd, callback, context);
+	if (result == HANGUP)
+		hangup(fd->fd, callback, context);
+	else if (result == ERROR)
+		traffic_error(fd->fd);
+	return result;
+}
+
+/*
+ * A file descriptor of libsrvsh's own that the pollop* functions
+ * wait on alongside the caller's, calling ready when it's readable.
+ */
+struct source {
+	int fd;
+	void (*ready)(int fd, void *context);
+	void *context;
+};
+
+static struct source *sources = NULL;
+static int sources_count = 0;
+static int sources_size = 0;
+
+static bool source_add(int fd, void (*ready)(int fd, void *context), void *context)
+{
+	if (sources_count == sources_size) {
+		const int size = sources_size ? 2 * sources_size : 4;
+		struct source *attempt = realloc(sources, (size_t)size * sizeof(*attempt));
+		if (!attempt)
+			return false;
+		sources = attempt;
+		sources_size = size;
+	}
+
+	sources[sources_count++] = (struct source) { fd, ready, context };
+	return true;
+}
+
+static void source_remove(int fd)
+{
+	for (int i = 0; i < sources_count; i++) {
+		if (sources[i].fd != fd)
+			continue;
+		sources[i] = sources[--sources_count];
+		return;
+	}
+}
+
+static const struct source *source_find(int fd)
+{
+	for (int i = 0; i < sources_count; i++)
+		if (sources[i].fd == fd)
+			return &sources[i];
+	return NULL;
+}
+
+struct op_timer {
+	// in nanoseconds on CLOCK_MONOTONIC, and 0 for one-shot timers
+	long long deadline;
+	long long interval;
+
+	// where the timer is in the heap, or -1 while it's disarmed
+	int index;
+
+	timer_callback *callback;
+	void *context;
+};
+
+/*
+ * Armed timers, in a binary heap ordered by deadline, and the one
+ * timerfd set for the earliest of them.
+ */
+static struct {
+	op_timer **heap;
+	int count;
+	int size;
+	int fd;
+} timers = { .fd = -1 };
+
+static void timer_place(op_timer *timer, int index)
+{
+	timers.heap[index] = timer;
+	timer->index = index;
+}
+
+static void timer_sift_up(int index)
+{
+	op_timer *timer = timers.heap[index];
+	while (index > 0) {
+		const int parent = (index - 1) / 2;
+		if (timers.heap[parent]->deadline <= timer->deadline)
+			break;
+		timer_place(timers.heap[parent], index);
+		index = parent;
+	}
+	timer_place(timer, index);
+}
+
+static void timer_sift_down(int index)
+{
+	op_timer *timer = timers.heap[index];
+	for (;;) {
+		int child = 2 * index + 1;
+		if (child >= timers.count)
+			break;
+		if (
+			child + 1 < timers.count
+			&& timers.heap[child + 1]->deadline < timers.heap[child]->deadline
+		)
+			child++;
+		if (timer->deadline <= timers.heap[child]->deadline)
+			break;
+		timer_place(timers.heap[child], index);
+		index = child;
+	}
+	timer_place(timer, index);
+}
+
+static void timer_unqueue(op_timer *timer)
+{
+	const int index = timer->index;
+	if (index < 0)
+		return;
+	timer->index = -1;
+
+	op_timer *last = timers.heap[--timers.count];
+	if (last == timer)
+		return;
+	timer_place(last, index);
+	timer_sift_up(index);
+	timer_sift_down(last->index);
+}
+
+/*
+ * Sets the timerfd for whichever timer is due first, or disarms it
+ * if none are.
+ */
+static int timers_rearm(void)
+{
+	struct itimerspec spec = { 0 };
+	if (timers.count) {
+		const long long deadline = timers.heap[0]->deadline;
+		spec.it_value.tv_sec = deadline / 1000000000;
+		spec.it_value.tv_nsec = deadline % 1000000000;
+
+		// zero would disarm it
+		if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+			spec.it_value.tv_nsec = 1;
+	}
+	return timerfd_settime(timers.fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void timers_ready(int fd, void *context)
+{
+	(void)context;
+
+	uint64_t expirations = 0;
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return;
+
+	// Timers due by now each fire once, so one re-armed from its
+	// own callback to fire straight away waits for the next wakeup
+	const long long now = (long long)now_ns();
+	for (int fired = timers.count; fired > 0 && timers.count; fired--) {
+		op_timer *timer = timers.heap[0];
+		if (timer->deadline > now)
+			break;
+
+		if (timer->interval) {
+			// Periods that were missed are skipped, without
+			// drifting off the timer's schedule
+			const long long behind = now - timer->deadline;
+			timer->deadline += (behind / timer->interval + 1) * timer->interval;
+			timer_sift_down(0);
+		} else
+			timer_unqueue(timer);
+
+		// the callback is free to close the timer
+		timer->callback(timer, timer->context);
+	}
+	timers_rearm();
+}
+
+static bool timers_init(void)
+{
+	if (timers.fd >= 0)
+		return true;
+
+	timers.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timers.fd < 0)
+		return false;
+	if (!source_add(timers.fd, timers_ready, NULL)) {
+		close(timers.fd);
+		timers.fd = -1;
+		return false;
+	}
+	return true;
+}
+
+op_timer *open_timer(timer_callback *callback, void *context)
+{
+	if (!callback) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!timers_init())
+		return NULL;
+
+	op_timer *timer = malloc(sizeof(*timer));
+	if (!timer)
+		return NULL;
+	*timer = (op_timer) {
+		.index = -1,
+		.callback = callback,
+		.context = context,
+	};
+	return timer;
+}
+
+int set_timer(op_timer *timer, int delay, int interval)
+{
+	if (interval < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const int index = timer->index;
+	if (delay < 0) {
+		timer_unqueue(timer);
+		return index == 0 ? timers_rearm() : 0;
+	}
+
+	timer->deadline = (long long)now_ns() + (long long)delay * 1000000;
+	timer->interval = (long long)interval * 1000000;
+	if (index < 0) {
+		if (timers.count == timers.size) {
+			const int size = timers.size ? 2 * timers.size : 16;
+			op_timer **attempt = realloc(timers.heap, (size_t)size * sizeof(*attempt));
+			if (!attempt)
+				return -1;
+			timers.heap = attempt;
+			timers.size = size;
+		}
+		timer_place(timer, timers.count++);
+		timer_sift_up(timer->index);
+	} else {
+		timer_sift_up(index);
+		timer_sift_down(timer->index);
+	}
+
+	// Only a change at the top of the heap moves the timerfd
+	if (timer->index == 0 || index == 0)
+		return timers_rearm();
+	return 0;
+}
+
+void close_timer(op_timer *timer)
+{
+	if (!timer)
+		return;
+	const bool first = timer->index == 0;
+	timer_unqueue(timer);
+	if (first)
+		timers_rearm();
+	free(timer);
+}
+
+/*
+ * Signals being watched, all read from one signalfd.
+ */
+static struct {
+	int fd;
+	sigset_t mask;
+	sigset_t blocked;
+	struct {
+		signal_callback *callback;
+		void *context;
+	} watches[_NSIG];
+} signals = { .fd = -1 };
+
+static void signals_ready(int fd, void *context)
+{
+	(void)context;
+
+	struct signalfd_siginfo info = { 0 };
+	while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+		const int signo = (int)info.ssi_signo;
+		if (signo > 0 && signo < _NSIG && signals.watches[signo].callback)
+			signals.watches[signo].callback(
+				signo,
+				&info,
+				signals.watches[signo].context
+			);
+	}
+}
+
+int watch_signal(int signo, signal_callback *callback, void *context)
+{
+	if (
+		signo <= 0
+		|| signo >= _NSIG
+		|| signo == SIGKILL
+		|| signo == SIGSTOP
+		|| !callback
+	) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (signals.fd < 0) {
+		sigemptyset(&signals.mask);
+		sigemptyset(&signals.blocked);
+	}
+
+	sigset_t mask = signals.mask;
+	sigaddset(&mask, signo);
+	const int fd = signalfd(signals.fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (signals.fd < 0 && !source_add(fd, signals_ready, NULL)) {
+		close(fd);
+		return -1;
+	}
+	signals.fd = fd;
+	signals.mask = mask;
+
+	// The signal has to be blocked to be read from the signalfd;
+	// only the ones that weren't already are unblocked later
+	if (!sigismember(&signals.blocked, signo)) {
+		sigset_t single, old;
+		sigemptyset(&single);
+		sigaddset(&single, signo);
+		pthread_sigmask(SIG_BLOCK, &single, &old);
+		if (!sigismember(&old, signo))
+			sigaddset(&signals.blocked, signo);
+	}
+
+	signals.watches[signo].callback = callback;
+	signals.watches[signo].context = context;
+	return 0;
+}
+
+int unwatch_signal(int signo)
+{
+	if (signo <= 0 || signo >= _NSIG) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (signals.fd < 0 || !sigismember(&signals.mask, signo))
+		return 0;
+
+	sigdelset(&signals.mask, signo);
+	signals.watches[signo].callback = NULL;
+	signals.watches[signo].context = NULL;
+
+	if (sigisemptyset(&signals.mask)) {
+		source_remove(signals.fd);
+		close(signals.fd);
+		signals.fd = -1;
+	} else if (signalfd(signals.fd, &signals.mask, 0) < 0)
+		return -1;
+
+	if (sigismember(&signals.blocked, signo)) {
+		sigset_t single;
+		sigemptyset(&single);
+		sigaddset(&single, signo);
+		sigdelset(&signals.blocked, signo);
+		pthread_sigmask(SIG_UNBLOCK, &single, NULL);
+	}
+	return 0;
+}
+
+/*
+ * Unblocks what watch_signal() blocked, in a child about to exec a
+ * program that would otherwise start with those signals blocked and
+ * nothing reading them.
+ */
+static void signals_unblock(void)
+{
+	if (signals.fd >= 0)
+		pthread_sigmask(SIG_UNBLOCK, &signals.blocked, NULL);
+}
+
+struct child_watch {
+	pid_t pid;
+	child_callback *callback;
+	void *context;
+};
+
+static void child_ready(int fd, void *context)
+{
+	struct child_watch *watch = context;
+
+	// A pidfd becomes readable once the child exits, so this
+	// doesn't block
+	int status = 0;
+	const pid_t reaped = waitpid(watch->pid, &status, WNOHANG);
+	if (reaped == 0)
+		return;
+	if (reaped < 0)
+		status = -1;
+
+	source_remove(fd);
+	close(fd);
+	watch->callback(watch->pid, status, watch->context);
+	free(watch);
+}
+
+int watch_child(pid_t pid, child_callback *callback, void *context)
+{
+	if (pid <= 0 || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct child_watch *watch = malloc(sizeof(*watch));
+	if (!watch)
+		return -1;
+	*watch = (struct child_watch) { pid, callback, context };
+
+	const int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+	if (fd < 0) {
+		free(watch);
+		return -1;
+	}
+
+	if (!source_add(fd, child_ready, watch)) {
+		close(fd);
+		free(watch);
+		return -1;
+	}
+	return 0;
+}
+
+int unwatch_child(pid_t pid)
+{
+	for (int i = 0; i < sources_count; i++) {
+		struct child_watch *watch = sources[i].context;
+		if (sources[i].ready != child_ready || watch->pid != pid)
+			continue;
+
+		const int fd = sources[i].fd;
+		source_remove(fd);
+		close(fd);
+		free(watch);
+		return 0;
+	}
+	return 0;
+}
+
+/*
+ * Calls wait() with the caller's timeout, shortened so that corked
+ * buffers are flushed when they come due, and carries on waiting for
+ * whatever time is left afterwards.
+ */
+static int wait_flushing(
+	int (*wait)(void *state, int timeout),
+	void *state,
+	int timeout
+)
+{
+	const long long until = now_ms() + timeout;
+	for (;;) {
+		int wait_for = flush_pending(timeout);
+		int changed = wait(state, wait_for);
+		if (changed != 0 || wait_for == timeout)
+			return changed;
+		if (timeout > 0)
+			timeout = (int)MAX(until - now_ms(), 0);
+	}
+}
+
+struct poll_state {
+	struct pollfd *fds;
+	int count;
+};
+
+/*
+ * Polls fds while also waiting for sockets with queued writes to
+ * drain, flushing them as they do, and for libsrvsh's own sources.
+ * Only returns once something in fds is ready or the timeout passes.
+ */
+static int poll_writable(struct pollfd *fds, int count, int timeout)
+{
+	static struct pollfd *set = NULL;
+	static int set_size = 0;
+	const long long until = now_ms() + timeout;
+
+	for (;;) {
+		int writers = 0;
+		for (struct outq *q = pending_writes; q; q = q->next)
+			writers++;
+		const int extra = writers + sources_count;
+		if (!extra)
+			return poll(fds, count, timeout);
+
+		if (count + extra > set_size) {
+			struct pollfd *attempt = realloc(
+				set,
+				(size_t)(count + extra) * sizeof(*set)
+			);
+			if (!attempt)
+				return -1;
+			set = attempt;
+			set_size = count + extra;
+		}
+
+		memcpy(set, fds, (size_t)count * sizeof(*set));
+		struct pollfd *writer = set + count;
+		for (struct outq *q = pending_writes; q; q = q->next, writer++)
+			*writer = (struct pollfd) { .fd = q->fd, .events = POLLOUT };
+		for (int i = 0; i < sources_count; i++, writer++)
+			*writer = (struct pollfd) { .fd = sources[i].fd, .events = POLLIN };
+
+		int changed = poll(set, count + extra, timeout);
+		if (changed <= 0)
+			return changed;
+
+		changed = 0;
+		for (int i = 0; i < count; i++) {
+			fds[i].revents = set[i].revents;
+			if (fds[i].revents)
+				changed++;
+		}
+
+		for (int i = count; i < count + writers; i++) {
+			struct conn *conn = find_conn(set[i].fd);
+			if (!set[i].revents || !conn || !conn->out)
+				continue;
+			if (set[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+				outq_clear(conn->out);
+			else
+				outq_flush(conn->out);
+		}
+
+		// A source's callback may remove others, or itself
+		for (int i = count + writers; i < count + extra; i++) {
+			const struct source *source = source_find(set[i].fd);
+			if (set[i].revents && source)
+				source->ready(source->fd, source->context);
+		}
+
+		if (changed || timeout == 0)
+			return changed;
+		if (timeout > 0)
+			timeout = (int)MAX(until - now_ms(), 0);
+	}
+}
+
+static int wait_poll(void *state, int timeout)
+{
+	struct poll_state *fds = state;
+	return poll_writable(fds->fds, fds->count, timeout);
+}
+
+// Messages read from each ready fd per wakeup, or 0 for the
+// original one-message, first-fd-first behaviour
+static int pollop_budget = 0;
+
+static pollfd_read_t process_budget(
+	struct pollfd *fd,
+	pollop_callback *callback,
+	void *context
+)
+{
+	pollfd_read_t result = NO_WORK;
+	int reads = 0;
+	do {
+		result = process_pollfd(fd, callback, context);
+	} while (result == SUCCESSFUL_READ && ++reads < pollop_budget);
+
+	// Anything read before the fd ran dry still counts
+	if (result == NO_WORK && reads > 0)
+		return SUCCESSFUL_READ;
+	return result;
+}
+
+static struct pollfd pollopfds_fair(
+	struct pollfd *fds,
+	int count,
+	pollop_callback *callback,
+	void *context
+)
+{
+	static const struct pollfd err = {.fd = -1};
+	static unsigned int rotation = 0;
+
+	// Start from a different fd each wakeup, so a busy fd early in
+	// the array can't keep the ones after it waiting
+	int start = (int)(rotation++ % (unsigned int)count);
+
+	struct pollfd last = { 0 };
+	bool hung_up = false;
+	for (int i = 0; i < count; i++) {
+		struct pollfd *fd = &fds[(start + i) % count];
+		if (fd->fd < 0 || !fd->revents)
+			continue;
+
+		pollfd_read_t result = process_budget(fd, callback, context);
+		if (result == ERROR)
+			return err;
+		else if (result == HANGUP) {
+			fd->revents &= ~POLLIN;
+			fd->revents |= POLLHUP;
+			fd->fd = ~fd->fd;
+			last = (struct pollfd) {
+				.fd = ~fd->fd,
+				.events = fd->events,
+				.revents = fd->revents,
+			};
+			hung_up = true;
+		} else if (!hung_up)
+			last = *fd;
+	}
+
+	return last;
+}
+
+struct pollfd pollopfds(
+	struct pollfd *fds,
+	int count,
+	pollop_callback *callback,
+	void *context,
+	int timeout
+)
+{
+	static const struct pollfd err = {.fd = -1};
+
+	fds->events = POLLIN;
+
+	if (count < 0)
+		return err;
+
+	struct poll_state state = { fds, count };
+	int changed = wait_flushing(wait_poll, &state, timeout);
+
+	if (changed < 0)
+		return err;
+
+	if (changed == 0)
+		return (struct pollfd) { 0 };
+
+	if (pollop_budget > 0)
+		return pollopfds_fair(fds, count, callback, context);
+
+	struct pollfd *fd = fds;
+	for (; changed > 0 && fd < &fds[count]; fd++) {
+		pollfd_read_t result = process_pollfd(fd, callback, context);
+		if (result == ERROR)
+			return err;
+		else if (result == HANGUP) {
+			fd->revents &= ~POLLIN;
+			fd->revents |= POLLHUP;
+			fd->fd = ~fd->fd;
+			return (struct pollfd) {
+				.fd = ~fd->fd,
+				.events = fd->events,
+				.revents = fd->revents,
+			};
+		}
+		else if (result == SUCCESSFUL_READ)
+			changed--;
+	}
+
+	return *(fd - 1);
+}
+
+struct pollfd pollopfd(
+	struct pollfd fd,
+	pollop_callback *callback,
+	void *context,
+	int timeout
+)
+{
+	return pollopfds(&fd, 1, callback, context, timeout);
+}
+
+struct pollfd pollopsrv(
+	pollop_callback *callback,
+	void *context,
+	int timeout
+)
+{
+	struct pollfd fd = {.fd = SRV_FILENO};
+	return pollopfd(fd, callback, context, timeout);
+}
+
+#define EPOLL_EVENTS 64
+
+/*
+ * Events from the last epoll_wait() are kept until they've all been
+ * processed, since pollop() returns early on a hang-up and, in
+ * edge-triggered mode, the kernel won't report them again.
+ */
+static struct {
+	int fd;
+	bool edge;
+	int ready;
+	int next;
+	struct epoll_event events[EPOLL_EVENTS];
+} epoll_set = { .fd = -1 };
+
+static int wait_epoll(void *state, int timeout)
+{
+	(void)state;
+
+	// the epoll set can itself be polled, alongside the sockets
+	// waiting to be written to and libsrvsh's own sources
+	if (pending_writes || sources_count) {
+		struct pollfd set = { .fd = epoll_set.fd, .events = POLLIN };
+		int ready = poll_writable(&set, 1, timeout);
+		if (ready <= 0)
+			return ready;
+		timeout = 0;
+	}
+
+	return epoll_wait(epoll_set.fd, epoll_set.events, EPOLL_EVENTS, timeout);
+}
+
+static bool epoll_add(int fd)
+{
+	struct epoll_event event = {
+		.events = EPOLLIN | (epoll_set.edge ? EPOLLET : 0),
+		.data.fd = fd,
+	};
+	return !epoll_ctl(epoll_set.fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static bool epoll_init(void)
+{
+	epoll_set.fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_set.fd < 0)
+		return false;
+
+	bool success = epoll_add(SRV_FILENO);
+	const int end = cli_end();
+	for (int cli = CLI_BEGIN; success && cli < end; cli++)
+		success = epoll_add(cli);
+
+	if (!success) {
+		close(epoll_set.fd);
+		epoll_set.fd = -1;
+	}
+	return success;
+}
+
+static struct pollfd pollop_epoll(
+	pollop_callback *callback,
+	void *context,
+	int timeout
+)
+{
+	static const struct pollfd err = {.fd = -1};
+
+	if (epoll_set.fd < 0 && !epoll_init())
+		return err;
+
+	if (epoll_set.next >= epoll_set.ready) {
+		int changed = wait_flushing(wait_epoll, NULL, timeout);
+		if (changed < 0)
+			return err;
+
+		if (changed == 0)
+			return (struct pollfd) { 0 };
+
+		epoll_set.ready = changed;
+		epoll_set.next = 0;
+	}
+
+	struct pollfd last = { 0 };
+	while (epoll_set.next < epoll_set.ready) {
+		struct epoll_event *event = &epoll_set.events[epoll_set.next++];
+		struct pollfd fd = {
+			.fd = event->data.fd,
+			.events = POLLIN,
+			.revents = (short)event->events,
+		};
+
+		// Edge-triggered sets only hear about new data, so
+		// everything already waiting has to be read now
+		pollfd_read_t result = NO_WORK;
+		if (epoll_set.edge) {
+			do {
+				result = process_pollfd(&fd, callback, context);
+			} while (result == SUCCESSFUL_READ);
+		} else
+			result = process_budget(&fd, callback, context);
+
+		if (result == ERROR)
+			return err;
+		else if (result == HANGUP) {
+			epoll_ctl(epoll_set.fd, EPOLL_CTL_DEL, fd.fd, NULL);
+			fd.revents &= ~POLLIN;
+			fd.revents |= POLLHUP;
+			return fd;
+		}
+		last = fd;
+	}
+
+	return last;
+}
+
+#ifdef SRVSH_IO_URING
+
+// the buffer size given to connections that don't already have one,
+// since io_uring reads straight into it
+#define URING_RECVBUF 65536
+
+static bool uring_init(void)
+{
+	const int end = cli_end();
+	const int count = end - CLI_BEGIN + 1;
+
+	// one read and one send in flight per connection, at most
+	unsigned entries = 64;
+	while (entries < 2 * (unsigned)count + 8 && entries < URING_MAX_ENTRIES)
+		entries *= 2;
+	if (entries < 2 * (unsigned)count + 8)
+		return false;
+
+	if (!uring_setup(entries))
+		return false;
+
+	uring.fds = calloc(count, sizeof(*uring.fds));
+	if (!uring.fds) {
+		uring_exit();
+		return false;
+	}
+
+	uring.fds[0] = SRV_FILENO;
+	for (int cli = CLI_BEGIN; cli < end; cli++)
+		uring.fds[cli - CLI_BEGIN + 1] = cli;
+	uring.fds_count = count;
+
+	for (int i = 0; i < count; i++) {
+		struct conn *conn = get_conn(uring.fds[i]);
+		if (!conn || (!conn->recv && recvbufop(uring.fds[i], URING_RECVBUF) < 0)) {
+			uring_exit();
+			return false;
+		}
+		// io_uring keeps reading into it from now on
+		conn->recv->transient = false;
+	}
+	return true;
+}
+
+static bool uring_arm(int fd)
+{
+	struct recvbuf *rb = find_conn(fd)->recv;
+	if (rb->armed)
+		return true;
+
+	if (!recvbuf_prepare(rb, &rb->pending_msg, &rb->pending_iov))
+		return false;
+
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)&rb->pending_msg;
+	sqe->len = 1;
+	sqe->msg_flags = rb->records ? MSG_TRUNC : 0;
+	sqe->user_data = URING_USER_DATA(URING_RECV, fd);
+	rb->armed = true;
+	return true;
+}
+
+/*
+ * Submits reads for every connection that doesn't have one in flight,
+ * along with any queued sends, and waits for a read to complete.
+ * A completed send wakes the ring too, so this keeps waiting until the
+ * timeout for a read.
+ */
+static int wait_uring(void *state, int timeout)
+{
+	(void)state;
+	const long long until = now_ms() + timeout;
+
+	for (int i = 0; i < uring.fds_count; i++)
+		if (uring.fds[i] >= 0 && !uring_arm(uring.fds[i]))
+			return -1;
+
+	while (uring.completed_count == 0) {
+		int wait_for = timeout;
+
+		// Submit the reads, then wait for the ring to have
+		// completions alongside the sockets waiting to be written to
+		// and libsrvsh's own sources
+		if (pending_writes || sources_count) {
+			if (uring_enter(0, 0) < 0)
+				return -1;
+
+			struct pollfd ring = { .fd = uring.fd, .events = POLLIN };
+			if (poll_writable(&ring, 1, timeout) < 0)
+				return -1;
+			wait_for = 0;
+		}
+
+		if (uring_enter(1, wait_for) < 0)
+			return -1;
+		uring_reap();
+
+		if (timeout == 0)
+			break;
+		if (timeout > 0 && (timeout = (int)(until - now_ms())) <= 0)
+			timeout = 0;
+	}
+	return (int)uring.completed_count;
+}
+
+static struct pollfd pollop_uring(
+	pollop_callback *callback,
+	void *context,
+	int timeout
+)
+{
+	static const struct pollfd err = {.fd = -1};
+
+	if (uring.completed_next >= uring.completed_count) {
+		uring.completed_count = uring.completed_next = 0;
+
+		int changed = wait_flushing(wait_uring, NULL, timeout);
+		if (changed < 0)
+			return err;
+
+		if (changed == 0)
+			return (struct pollfd) { 0 };
+	}
+
+	struct pollfd last = { 0 };
+	while (uring.completed_next < uring.completed_count) {
+		struct io_uring_cqe *cqe = &uring.completed[uring.completed_next++];
+		struct pollfd fd = {
+			.fd = (int)(uint32_t)cqe->user_data,
+			.events = POLLIN,
+			.revents = POLLIN,
+		};
+
+		struct recvbuf *rb = find_conn(fd.fd)->recv;
+		rb->armed = false;
+
+		pollfd_read_t result = NO_WORK;
+		if (cqe->res == -EAGAIN || cqe->res == -EINTR)
+			result = NO_WORK;
+		else if (cqe->res < 0 || (size_t)cqe->res > rb->pending_iov.iov_len)
+			result = ERROR;
+		else
+			result = recvbuf_complete(
+				fd.fd,
+				rb,
+				(size_t)cqe->res,
+				rb->pending_msg.msg_controllen,
+				callback,
+				context
+			);
+
+		if (result == ERROR) {
+			traffic_error(fd.fd);
+			return err;
+		} else if (result == HANGUP) {
+			hangup(fd.fd, callback, context);
+			for (int i = 0; i < uring.fds_count; i++)
+				if (uring.fds[i] == fd.fd)
+					uring.fds[i] = -1;
+			fd.revents = POLLHUP;
+			return fd;
+		}
+		last = fd;
+	}
+
+	return last;
+}
+
+#endif
+
+static int current_backend = -1;
+
+static enum pollop_backend default_pollop_backend(void)
+{
+	const char *envvar = getenv("SRVSH_POLLOP");
+	if (envvar && !strcmp(envvar, "poll"))
+		return POLLOP_POLL;
+	if (envvar && !strcmp(envvar, "epoll"))
+		return POLLOP_EPOLL;
+	if (envvar && !strcmp(envvar, "epoll-edge"))
+		return POLLOP_EPOLL_EDGE;
+	if (envvar && !strcmp(envvar, "io_uring"))
+		return POLLOP_IO_URING;
+#ifdef SRVSH_EPOLL
+	return POLLOP_EPOLL;
+#else
+	return POLLOP_POLL;
+#endif
+}
+
+int set_pollop_backend(enum pollop_backend backend)
+{
+	switch (backend) {
+		case POLLOP_POLL:
+		case POLLOP_EPOLL:
+		case POLLOP_EPOLL_EDGE:
+		case POLLOP_IO_URING:
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+#ifdef SRVSH_IO_URING
+	uring_exit();
+#else
+	if (backend == POLLOP_IO_URING)
+		backend = POLLOP_POLL;
+#endif
+
+	if (epoll_set.fd >= 0) {
+		close(epoll_set.fd);
+		epoll_set.fd = -1;
+	}
+	epoll_set.ready = epoll_set.next = 0;
+	epoll_set.edge = backend == POLLOP_EPOLL_EDGE;
+	current_backend = backend;
+	return 0;
+}
+
+enum pollop_backend get_pollop_backend(void)
+{
+	if (current_backend < 0)
+		set_pollop_backend(default_pollop_backend());
+
+#ifdef SRVSH_IO_URING
+	if (current_backend == POLLOP_IO_URING && uring.fd < 0 && !uring_init())
+		current_backend = POLLOP_POLL;
+#endif
+
+	return current_backend;
+}
+
+int set_pollop_budget(int budget)
+{
+	if (budget < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pollop_budget = budget;
+	return 0;
+}
+
+/*
+ * One of dispatchop()'s threads. Each worker has its own epoll set
+ * holding its share of the clients, registered EPOLLONESHOT, so a
+ * client that's been reported sits in exactly one ready queue until
+ * it's been read and re-armed, whichever worker ends up reading it.
+ * That's what keeps each client's messages in order.
+ */
+struct worker {
+	pthread_t thread;
+	struct dispatch *dispatch;
+	int epoll;
+	int wake;
+	atomic_bool idle;
+
+	pthread_mutex_t lock;
+	int *ready;
+	int head;
+	int queued;
+};
+
+struct dispatch {
+	struct worker *workers;
+	int count;
+	// the worker whose epoll set each client is registered with
+	int *owners;
+	int clients;
+	atomic_int remaining;
+	atomic_bool stopping;
+	int error;
+	pollop_callback *callback;
+	void *context;
+};
+
+static void worker_push(struct worker *worker, int fd)
+{
+	pthread_mutex_lock(&worker->lock);
+	int tail = (worker->head + worker->queued) % worker->dispatch->clients;
+	worker->ready[tail] = fd;
+	worker->queued++;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+// The owner works newest first, while the thieves take the
+// oldest, which have waited longest
+static bool worker_take(struct worker *worker, bool steal, int *fd)
+{
+	pthread_mutex_lock(&worker->lock);
+	bool found = worker->queued > 0;
+	if (found && steal) {
+		*fd = worker->ready[worker->head];
+		worker->head = (worker->head + 1) % worker->dispatch->clients;
+		worker->queued--;
+	} else if (found) {
+		worker->queued--;
+		*fd = worker->ready[(worker->head + worker->queued) % worker->dispatch->clients];
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return found;
+}
+
+static bool worker_steal(struct worker *self, int *fd)
+{
+	struct dispatch *dispatch = self->dispatch;
+	const int index = (int)(self - dispatch->workers);
+	for (int i = 1; i < dispatch->count; i++) {
+		struct worker *victim = &dispatch->workers[(index + i) % dispatch->count];
+		if (worker_take(victim, true, fd))
+			return true;
+	}
+	return false;
+}
+
+static void worker_wake(struct worker *worker)
+{
+	uint64_t one = 1;
+	ssize_t written = write(worker->wake, &one, sizeof(one));
+	(void)written;
+}
+
+static void dispatch_stop(struct dispatch *dispatch, int error)
+{
+	if (error && !atomic_exchange(&dispatch->stopping, true))
+		dispatch->error = error;
+	atomic_store(&dispatch->stopping, true);
+	for (int i = 0; i < dispatch->count; i++)
+		worker_wake(&dispatch->workers[i]);
+}
+
+static void dispatch_handle(struct dispatch *dispatch, int fd)
+{
+	struct pollfd pollfd = {
+		.fd = fd,
+		.events = POLLIN,
+		.revents = POLLIN,
+	};
+	pollfd_read_t result = process_budget(
+		&pollfd,
+		dispatch->callback,
+		dispatch->context
+	);
+
+	int epoll = dispatch->workers[dispatch->owners[fd]].epoll;
+	if (result == ERROR) {
+		dispatch_stop(dispatch, errno ? errno : EIO);
+	} else if (result == HANGUP) {
+		epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+		if (atomic_fetch_sub(&dispatch->remaining, 1) == 1)
+			dispatch_stop(dispatch, 0);
+	} else {
+		struct epoll_event event = {
+			.events = EPOLLIN | EPOLLONESHOT,
+			.data.fd = fd,
+		};
+		if (epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &event) < 0)
+			dispatch_stop(dispatch, errno);
+	}
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *self = arg;
+	struct dispatch *dispatch = self->dispatch;
+	struct epoll_event events[64];
+
+	while (!atomic_load(&dispatch->stopping)) {
+		int fd = -1;
+		if (worker_take(self, false, &fd) || worker_steal(self, &fd)) {
+			dispatch_handle(dispatch, fd);
+			continue;
+		}
+
+		// Look again after saying we're idle, so a worker that
+		// queued something in between either sees the flag or
+		// has its work seen here
+		atomic_store(&self->idle, true);
+		if (worker_steal(self, &fd)) {
+			atomic_store(&self->idle, false);
+			dispatch_handle(dispatch, fd);
+			continue;
+		}
+
+		int changed = epoll_wait(self->epoll, events, 64, -1);
+		atomic_store(&self->idle, false);
+		if (changed < 0 && errno != EINTR) {
+			dispatch_stop(dispatch, errno);
+			break;
+		}
+
+		int queued = 0;
+		for (int i = 0; i < changed; i++) {
+			if (events[i].data.fd == self->wake) {
+				uint64_t count = 0;
+				ssize_t got = read(self->wake, &count, sizeof(count));
+				(void)got;
+				continue;
+			}
+			worker_push(self, events[i].data.fd);
+			queued++;
+		}
+
+		// Keep one for ourselves, and offer the rest to
+		// anyone with nothing to do
+		for (int i = 0; queued > 1 && i < dispatch->count; i++) {
+			struct worker *other = &dispatch->workers[i];
+			if (other != self && atomic_load(&other->idle)) {
+				worker_wake(other);
+				queued--;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void dispatch_free(struct dispatch *dispatch, int started)
+{
+	for (int i = 0; i < started; i++)
+		pthread_join(dispatch->workers[i].thread, NULL);
+	for (int i = 0; i < dispatch->count; i++) {
+		struct worker *worker = &dispatch->workers[i];
+		if (worker->epoll >= 0)
+			close(worker->epoll);
+		if (worker->wake >= 0)
+			close(worker->wake);
+		pthread_mutex_destroy(&worker->lock);
+		free(worker->ready);
+	}
+	free(dispatch->workers);
+	free(dispatch->owners);
+}
+
+static bool worker_init(struct worker *worker, struct dispatch *dispatch)
+{
+	worker->dispatch = dispatch;
+	worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+	worker->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	atomic_init(&worker->idle, false);
+	worker->ready = calloc((size_t)dispatch->clients, sizeof(*worker->ready));
+	if (worker->epoll < 0 || worker->wake < 0 || !worker->ready)
+		return false;
+
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.fd = worker->wake,
+	};
+	return epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->wake, &event) == 0;
+}
+
+int dispatchop(int threads, pollop_callback *callback, void *context)
+{
+	const int end = cli_end();
+	const int clients = cli_count();
+	if (clients <= 0)
+		return 0;
+
+	if (threads <= 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	threads = MAX(1, MIN(threads, clients));
+
+	// Every connection's state has to exist up front, and be
+	// configured from the environment, since growing the table
+	// under the workers would move it
+	if (!find_configured(SRV_FILENO))
+		return -1;
+	for (int cli = CLI_BEGIN; cli < end; cli++)
+		if (!get_conn(cli))
+			return -1;
+
+	struct dispatch dispatch = {
+		.workers = calloc((size_t)threads, sizeof(struct worker)),
+		.count = threads,
+		.owners = calloc((size_t)end, sizeof(int)),
+		.clients = clients,
+		.callback = callback,
+		.context = context,
+	};
+	atomic_init(&dispatch.remaining, clients);
+	atomic_init(&dispatch.stopping, false);
+	if (!dispatch.workers || !dispatch.owners) {
+		dispatch.count = 0;
+		dispatch_free(&dispatch, 0);
+		return -1;
+	}
+
+	for (int i = 0; i < threads; i++) {
+		dispatch.workers[i].epoll = dispatch.workers[i].wake = -1;
+		pthread_mutex_init(&dispatch.workers[i].lock, NULL);
+	}
+
+	bool success = true;
+	for (int i = 0; success && i < threads; i++)
+		success = worker_init(&dispatch.workers[i], &dispatch);
+
+	for (int cli = CLI_BEGIN, i = 0; success && cli < end; cli++, i++) {
+		dispatch.owners[cli] = i % threads;
+		struct epoll_event event = {
+			.events = EPOLLIN | EPOLLONESHOT,
+			.data.fd = cli,
+		};
+		int epoll = dispatch.workers[i % threads].epoll;
+		success = epoll_ctl(epoll, EPOLL_CTL_ADD, cli, &event) == 0;
+	}
+
+	int started = 0;
+	for (; success && started < threads; started++) {
+		int error = pthread_create(
+			&dispatch.workers[started].thread,
+			NULL,
+			worker_run,
+			&dispatch.workers[started]
+		);
+		if (error) {
+			errno = error;
+			success = false;
+			break;
+		}
+	}
+
+	if (!success) {
+		int error = errno;
+		dispatch_stop(&dispatch, 0);
+		dispatch_free(&dispatch, started);
+		errno = error;
+		return -1;
+	}
+
+	dispatch_free(&dispatch, started);
+	if (dispatch.error) {
+		errno = dispatch.error;
+		return -1;
+	}
+	return 0;
+}
+
+struct op_handler {
+	pollop_callback *callback;
+	void *context;
+};
 
-	result = calloc(
-		globs.gl_pathc + 1,
-		sizeof(glob_t)
+// Handlers indexed directly by opcode
+struct op_table {
+	struct op_handler *handlers;
+	int size;
+	// the connection generation a per-connection table was set for
+	unsigned generation;
+};
+
+struct op_dispatcher {
+	struct op_handler fallback;
+	struct op_table ops;
+	// per-connection overrides, indexed by fd
+	struct op_table *fds;
+	int fds_size;
+	// one per opcode in ops
+	atomic_ulong *counts;
+	atomic_ulong fallbacks;
+};
+
+static bool op_table_grow(struct op_table *table, int size)
+{
+	if (size <= table->size)
+		return true;
+
+	struct op_handler *attempt = realloc(
+		table->handlers,
+		(size_t)size * sizeof(*attempt)
 	);
+	if (!attempt)
+		return false;
 
-	for (
-		char
-			**path = globs.gl_pathv,
-			**c = result;
-		*path;
-		path++, c++
-	) {
-		*c = map_path(*path);
-	}
-	globfree(&globs);
-	return result;
+	memset(
+		attempt + table->size,
+		0,
+		(size_t)(size - table->size) * sizeof(*attempt)
+	);
+	table->handlers = attempt;
+	table->size = size;
+	return true;
 }
 
-opcode_db *open_opcode_db(void)
+static unsigned conn_generation(int fd)
 {
-	return open_opcode_db_at(getenv("OPCODE_DATABASE"));
+	struct conn *conn = find_conn(fd);
+	return conn ?
+		atomic_load_explicit(&conn->generation, memory_order_relaxed) :
+		0;
 }
 
-ssize_t writesrv(int opcode, const void *buf, size_t len)
+static const struct op_handler *op_table_find(const struct op_table *table, int opcode)
 {
-	return writeop(SRV_FILENO, opcode, buf, len);
+	if (opcode < 0 || opcode >= table->size)
+		return NULL;
+	if (!table->handlers[opcode].callback)
+		return NULL;
+	return &table->handlers[opcode];
 }
 
-ssize_t writeop(
+op_dispatcher *open_op_dispatcher(pollop_callback *fallback, void *context)
+{
+	op_dispatcher *dispatcher = calloc(1, sizeof(*dispatcher));
+	if (!dispatcher)
+		return NULL;
+
+	dispatcher->fallback = (struct op_handler) { fallback, context };
+	return dispatcher;
+}
+
+void close_op_dispatcher(op_dispatcher *dispatcher)
+{
+	if (!dispatcher)
+		return;
+
+	for (int fd = 0; fd < dispatcher->fds_size; fd++)
+		free(dispatcher->fds[fd].handlers);
+	free(dispatcher->fds);
+	free(dispatcher->ops.handlers);
+	free(dispatcher->counts);
+	free(dispatcher);
+}
+
+// Keeps a counter for every opcode in the shared table, which
+// is at least as large as any per-connection one
+static bool op_dispatcher_reserve(op_dispatcher *dispatcher, int opcode)
+{
+	const int old_size = dispatcher->ops.size;
+	if (opcode < old_size)
+		return true;
+
+	atomic_ulong *counts = realloc(
+		dispatcher->counts,
+		(size_t)(opcode + 1) * sizeof(*counts)
+	);
+	if (!counts)
+		return false;
+	dispatcher->counts = counts;
+	for (int i = old_size; i <= opcode; i++)
+		atomic_init(&counts[i], 0);
+
+	return op_table_grow(&dispatcher->ops, opcode + 1);
+}
+
+int set_op_handler(
+	op_dispatcher *dispatcher,
+	int opcode,
+	pollop_callback *handler,
+	void *context
+)
+{
+	if (opcode < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!op_dispatcher_reserve(dispatcher, opcode))
+		return -1;
+
+	dispatcher->ops.handlers[opcode] = (struct op_handler) { handler, context };
+	return 0;
+}
+
+int set_fd_op_handler(
+	op_dispatcher *dispatcher,
 	int fd,
 	int opcode,
-	const void *buf,
-	int len
+	pollop_callback *handler,
+	void *context
 )
 {
-	return sendmsgop(
-		fd,
-		opcode,
-		buf,
-		len,
-		NULL,
-		0
-	);
+	if (fd < 0 || opcode < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!op_dispatcher_reserve(dispatcher, opcode))
+		return -1;
+
+	if (fd >= dispatcher->fds_size) {
+		int new_size = MAX(fd + 1, dispatcher->fds_size * 2);
+		struct op_table *attempt = realloc(
+			dispatcher->fds,
+			(size_t)new_size * sizeof(*attempt)
+		);
+		if (!attempt)
+			return -1;
+
+		memset(
+			attempt + dispatcher->fds_size,
+			0,
+			(size_t)(new_size - dispatcher->fds_size) * sizeof(*attempt)
+		);
+		dispatcher->fds = attempt;
+		dispatcher->fds_size = new_size;
+	}
+
+	if (!get_conn(fd))
+		return -1;
+
+	// overrides set before the connection hung up or was closed
+	// belonged to whatever had the number then
+	struct op_table *table = &dispatcher->fds[fd];
+	const unsigned generation = conn_generation(fd);
+	if (table->generation != generation) {
+		memset(table->handlers, 0, (size_t)table->size * sizeof(*table->handlers));
+		table->generation = generation;
+	}
+	if (!op_table_grow(table, opcode + 1))
+		return -1;
+
+	table->handlers[opcode] = (struct op_handler) { handler, context };
+	return 0;
 }
 
-ssize_t sendmsgop(
+void op_dispatcher_callback(
 	int fd,
 	int opcode,
-	const void *buf,
+	void *buf,
 	int len,
-	void *cmsg,
-	size_t cmsg_len
+	struct msghdr header,
+	void *context
 )
 {
-	if (len < 0)
+	op_dispatcher *dispatcher = context;
+
+	const struct op_handler *handler = NULL;
+	if (
+		fd >= 0 && fd < dispatcher->fds_size
+		&& dispatcher->fds[fd].generation == conn_generation(fd)
+	)
+		handler = op_table_find(&dispatcher->fds[fd], opcode);
+	if (!handler)
+		handler = op_table_find(&dispatcher->ops, opcode);
+	if (!handler) {
+		handler = &dispatcher->fallback;
+		atomic_fetch_add_explicit(&dispatcher->fallbacks, 1, memory_order_relaxed);
+	}
+
+	if (opcode >= 0 && opcode < dispatcher->ops.size)
+		atomic_fetch_add_explicit(&dispatcher->counts[opcode], 1, memory_order_relaxed);
+
+	if (handler->callback)
+		handler->callback(fd, opcode, buf, len, header, handler->context);
+	else
+		close_cmsg_fds(header);
+}
+
+unsigned long op_dispatch_count(const op_dispatcher *dispatcher, int opcode)
+{
+	if (opcode < 0 || opcode >= dispatcher->ops.size)
+		return 0;
+	return atomic_load_explicit(&dispatcher->counts[opcode], memory_order_relaxed);
+}
+
+unsigned long op_fallback_count(const op_dispatcher *dispatcher)
+{
+	return atomic_load_explicit(&dispatcher->fallbacks, memory_order_relaxed);
+}
+
+/*
+ * What precedes the payload of OP_RPC_CALL and OP_RPC_REPLY frames.
+ */
+struct rpc_header {
+	unsigned id;
+	int opcode;
+};
+
+struct rpc_call {
+	unsigned id;
+	int fd;
+	pollop_callback *done;
+	void *context;
+};
+
+/*
+ * Outstanding calls are kept in an open-addressed hash table with
+ * linear probing, grown once it's half full. Removing a call moves
+ * the ones probed past it back, so no tombstones build up however
+ * long the table is used. ID 0 marks an empty slot.
+ */
+struct rpc {
+	pthread_mutex_t lock;
+	unsigned next_id;
+	struct rpc_call *calls;
+	size_t size;
+	size_t count;
+
+	rpc_request_callback *handler;
+	pollop_callback *fallback;
+	void *context;
+};
+
+rpc *open_rpc(rpc_request_callback *handler, pollop_callback *fallback, void *context)
+{
+	rpc *calls = calloc(1, sizeof(*calls));
+	if (!calls)
+		return NULL;
+
+	if (pthread_mutex_init(&calls->lock, NULL) != 0) {
+		free(calls);
+		return NULL;
+	}
+	calls->next_id = 1;
+	calls->handler = handler;
+	calls->fallback = fallback;
+	calls->context = context;
+	atomic_fetch_add_explicit(&rpc_layers, 1, memory_order_relaxed);
+	return calls;
+}
+
+void close_rpc(rpc *calls)
+{
+	if (!calls)
+		return;
+
+	atomic_fetch_sub_explicit(&rpc_layers, 1, memory_order_relaxed);
+	pthread_mutex_destroy(&calls->lock);
+	free(calls->calls);
+	free(calls);
+}
+
+/*
+ * The slot an ID's probe starts at. IDs are handed out in order, so
+ * they're scattered with Fibonacci hashing, rather than filling runs
+ * of neighbouring slots.
+ */
+static size_t rpc_home(const rpc *calls, unsigned id)
+{
+	return (size_t)(id * 2654435769u) & (calls->size - 1);
+}
+
+/*
+ * The slot holding the given ID, or the empty one its probe ends at.
+ */
+static struct rpc_call *rpc_slot(rpc *calls, unsigned id)
+{
+	size_t i = rpc_home(calls, id);
+	while (calls->calls[i].id && calls->calls[i].id != id)
+		i = (i + 1) & (calls->size - 1);
+	return &calls->calls[i];
+}
+
+static bool rpc_grow(rpc *calls)
+{
+	const size_t size = MAX(calls->size * 2, (size_t)64);
+	struct rpc_call *table = calloc(size, sizeof(*table));
+	if (!table)
+		return false;
+
+	struct rpc_call *old = calls->calls;
+	const size_t old_size = calls->size;
+	calls->calls = table;
+	calls->size = size;
+	for (size_t i = 0; i < old_size; i++)
+		if (old[i].id)
+			*rpc_slot(calls, old[i].id) = old[i];
+	free(old);
+	return true;
+}
+
+/*
+ * Empties a slot, moving back any call after it that could no longer
+ * be found once there's a gap in its probe.
+ */
+static void rpc_remove(rpc *calls, struct rpc_call *slot)
+{
+	const size_t mask = calls->size - 1;
+	size_t gap = (size_t)(slot - calls->calls);
+	for (size_t i = (gap + 1) & mask; calls->calls[i].id; i = (i + 1) & mask) {
+		// a call whose home is cyclically after the gap stays put
+		const size_t home = rpc_home(calls, calls->calls[i].id);
+		if (((i - home) & mask) < ((i - gap) & mask))
+			continue;
+		calls->calls[gap] = calls->calls[i];
+		gap = i;
+	}
+	calls->calls[gap] = (struct rpc_call) { 0 };
+	calls->count--;
+}
+
+static unsigned rpc_add(rpc *calls, int fd, pollop_callback *done, void *context)
+{
+	pthread_mutex_lock(&calls->lock);
+
+	if ((calls->count + 1) * 2 > calls->size && !rpc_grow(calls)) {
+		pthread_mutex_unlock(&calls->lock);
+		return 0;
+	}
+
+	// an ID wrapped around to one still outstanding is skipped
+	unsigned id = 0;
+	struct rpc_call *slot = NULL;
+	do {
+		id = calls->next_id++;
+		if (!calls->next_id)
+			calls->next_id = 1;
+		slot = rpc_slot(calls, id);
+	} while (slot->id);
+
+	*slot = (struct rpc_call) {
+		.id = id,
+		.fd = fd,
+		.done = done,
+		.context = context,
+	};
+	calls->count++;
+
+	pthread_mutex_unlock(&calls->lock);
+	return id;
+}
+
+/*
+ * Takes the call with the given ID out of the table, if it's
+ * outstanding on fd.
+ */
+static bool rpc_take(rpc *calls, int fd, unsigned id, struct rpc_call *call)
+{
+	bool found = false;
+	pthread_mutex_lock(&calls->lock);
+	if (id && calls->size) {
+		struct rpc_call *slot = rpc_slot(calls, id);
+		found = slot->id == id && slot->fd == fd;
+		if (found) {
+			*call = *slot;
+			rpc_remove(calls, slot);
+		}
+	}
+	pthread_mutex_unlock(&calls->lock);
+	return found;
+}
+
+static ssize_t rpc_send(int fd, int kind, unsigned id, int opcode, const void *buf, int len)
+{
+	if (len < 0) {
+		errno = EINVAL;
 		return -1;
+	}
 
-	struct srvsh_header hd = {
+	struct rpc_header header = {
+		.id = id,
 		.opcode = opcode,
-		.size = len,
 	};
-
-	struct iovec inputs[] = {
+	const struct iovec iov[] = {
 		{
-			.iov_base = &hd,
-			.iov_len = sizeof(hd),
+			.iov_base = &header,
+			.iov_len = sizeof(header),
 		},
 		{
 			.iov_base = (void*)buf,
-			.iov_len = len,
+			.iov_len = (size_t)len,
 		},
 	};
-	struct msghdr msg = {
-		.msg_iov = inputs,
-		.msg_iovlen = 2,
-		.msg_control = cmsg,
-		.msg_controllen = cmsg_len,
-	};
-	return sendmsg(fd, &msg, 0);
+	return writeopv(fd, kind, iov, 2);
 }
 
-void close_opcode_db(opcode_db *db)
+int callop(
+	rpc *calls,
+	int fd,
+	int opcode,
+	const void *buf,
+	int len,
+	pollop_callback *done,
+	void *context
+)
 {
-	/*
-	 * TODO: check if the file is null-terminated
-	 * plaintext in open_opcode_db()
-	 */
-	char **files = (char**)db;
-	if (files)
-		for (; *files; files++) {
-			munmap(*files, strlen(*files));
+	const unsigned id = rpc_add(calls, fd, done, context);
+	if (!id)
+		return -1;
+
+	if (rpc_send(fd, OP_RPC_CALL, id, opcode, buf, len) < 0) {
+		struct rpc_call call;
+		const int saved_errno = errno;
+		rpc_take(calls, fd, id, &call);
+		errno = saved_errno;
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t replyop(int fd, unsigned id, int opcode, const void *buf, int len)
+{
+	return rpc_send(fd, OP_RPC_REPLY, id, opcode, buf, len);
+}
+
+int cancel_calls(rpc *calls, int fd)
+{
+	int cancelled = 0;
+	for (;;) {
+		// the callbacks may make calls of their own, so each is
+		// taken out before it's called, and the table looked at
+		// again afterwards
+		struct rpc_call call = { 0 };
+		pthread_mutex_lock(&calls->lock);
+		for (size_t i = 0; i < calls->size && !call.id; i++) {
+			struct rpc_call *slot = &calls->calls[i];
+			if (slot->id && slot->fd == fd) {
+				call = *slot;
+				rpc_remove(calls, slot);
+			}
 		}
-	free(db);
+		pthread_mutex_unlock(&calls->lock);
+
+		if (!call.id)
+			return cancelled;
+
+		if (call.done)
+			call.done(fd, RPC_CANCELLED, NULL, 0, (struct msghdr) { 0 }, call.context);
+		cancelled++;
+	}
 }
 
-int srvcli_polls(struct pollfd *fds, int buflen)
+void rpc_callback(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr header,
+	void *context
+)
 {
-	int count = cli_count() + 1;
-	if (buflen < count)
-		return -1;
+	rpc *calls = context;
+
+	if (opcode != OP_RPC_CALL && opcode != OP_RPC_REPLY) {
+		if (calls->fallback)
+			calls->fallback(fd, opcode, buf, len, header, calls->context);
+		else
+			close_cmsg_fds(header);
+		return;
+	}
+
+	struct rpc_header rpc_header = { 0 };
+	if (len < (int)sizeof(rpc_header)) {
+		close_cmsg_fds(header);
+		return;
+	}
+	memcpy(&rpc_header, buf, sizeof(rpc_header));
+	void *payload = (char *)buf + sizeof(rpc_header);
+	const int payload_len = len - (int)sizeof(rpc_header);
+
+	if (opcode == OP_RPC_CALL) {
+		if (calls->handler)
+			calls->handler(
+				fd,
+				rpc_header.opcode,
+				payload,
+				payload_len,
+				header,
+				rpc_header.id,
+				calls->context
+			);
+		else
+			close_cmsg_fds(header);
+		return;
+	}
+
+	// a reply to a call that was cancelled has nowhere to go
+	struct rpc_call call = { 0 };
+	if (!rpc_take(calls, fd, rpc_header.id, &call) || !call.done) {
+		close_cmsg_fds(header);
+		return;
+	}
+	call.done(fd, rpc_header.opcode, payload, payload_len, header, call.context);
+}
+
+struct pollfd pollop(
+	pollop_callback *callback,
+	void *context,
+	int timeout
+)
+{
+	static const struct pollfd err = {.fd = -1};
+	static struct pollfd *fds = NULL;
+
+	const enum pollop_backend backend = get_pollop_backend();
+
+#ifdef SRVSH_IO_URING
+	if (backend == POLLOP_IO_URING)
+		return pollop_uring(callback, context, timeout);
+#endif
+
+	if (backend != POLLOP_POLL)
+		return pollop_epoll(callback, context, timeout);
+
+	int total = cli_count() + 1;
+	if (!fds) {
+		fds = calloc(total, sizeof(*fds));
+		if (!fds)
+			return err;
+
+		srvcli_polls(fds, total);
+	}
+
+	return pollopfds(fds, total, callback, context, timeout);
+}
+
+// the default size of a coroutine's stack, which is only touched as
+// it's used
+#define COROUTINE_STACK (256 * 1024)
+
+/*
+ * A message read while no coroutine was waiting for it, copied so it
+ * outlives the callback. The body comes first, then the control data.
+ */
+struct backlog {
+	struct backlog *next;
+	int fd;
+	struct op_message message;
+	max_align_t data[];
+};
 
-	*fds = (struct pollfd) {
-		.fd = SRV_FILENO,
-		.events = POLLIN,
-	};
+struct coroutine {
+	ucontext_t context;
+	char *stack;
+	size_t stack_size;
 
-	return cli_polls(fds + 1, buflen - 1) + 1;
-}
+	int fd;
+	coroutine_fn *fn;
+	void *arg;
+	bool done;
 
-int cli_polls(struct pollfd *fds, int buflen)
-{
-	int count = cli_count();
-	if (count < 0)
-		return -1;
+	// what the scheduler resumed the coroutine with: 1 for a
+	// message, 0 for a hang-up
+	int status;
+	struct op_message message;
 
-	if (buflen < count)
-		return -1;
+	// the backlogged message it was last given, freed once it asks
+	// for another
+	struct backlog *held;
 
-	struct pollfd *current = fds;
-	int end = cli_end();
-	for (int cli = CLI_BEGIN; cli < end; cli++) {
-		*current = (struct pollfd) {
-			.fd = cli,
-			.events = POLLIN,
-		};
-		current++;
-	}
-	return count;
-}
+	struct coroutine *next;
+};
 
 /*
- * Common poll code between different pollop functions
+ * The scheduler's state. Every live coroutine is either runnable,
+ * because it hasn't started yet, or waiting in recvop() on one fd.
  *
- * I really don't like this function but the recvmsg interface
- * kinda forces my hand here
+ * The fds waited on are kept in one epoll set, each registered
+ * one-shot and re-armed when a coroutine waits on it again, so a
+ * wakeup costs what's ready rather than what's waiting.
  */
-static pollfd_read_t process_pollfd(struct pollfd *fd, pollop_callback *callback, void *context)
+static struct {
+	ucontext_t main;
+	struct coroutine *current;
+	struct coroutine *runnable;
+	struct coroutine *runnable_tail;
+	struct coroutine **waiting;
+	int waiting_size;
+	int waiters;
+	int live;
+	int epoll;
+	unsigned long resumes;
+	struct backlog *backlog;
+	struct backlog *backlog_tail;
+} coroutines = { .epoll = -1 };
+
+static size_t coroutine_stack_size(void)
 {
-	if (fd->revents & POLLIN) {
-		// TODO: don't like pretty much any of this
-		struct srvsh_header header = { 0 };
-		char cmsg_buf[1024] = { 0 };
+	static size_t size = 0;
+	if (!size) {
+		const char *value = getenv("SRVSH_COROUTINE_STACK");
+		size = value ? size_setting(value, NULL) : 0;
+		if (size < 16384)
+			size = COROUTINE_STACK;
+	}
+	return size;
+}
 
-		struct iovec buf = {
-			.iov_base = &header,
-			.iov_len = sizeof(header),
-		};
-		struct msghdr hdr = {
-			.msg_iov = &buf,
-			.msg_iovlen = 1,
-			.msg_control = cmsg_buf,
-			.msg_controllen = sizeof(cmsg_buf),
-		};
+static void coroutine_entry(void)
+{
+	struct coroutine *co = coroutines.current;
+	co->fn(co->fd, co->arg);
+	co->done = true;
 
-		ssize_t received = recvmsg(fd->fd, &hdr, 0);
-		if (received < 0) {
-			return ERROR;
-		}
+	// returning switches to uc_link, which is the scheduler
+}
 
-		if (received == 0) {
-			return HANGUP;
-		}
+static void coroutine_free(struct coroutine *co)
+{
+	free(co->held);
+	munmap(co->stack, co->stack_size);
+	free(co);
+	coroutines.live--;
+}
 
-		if (header.size == 0) {
-			callback(
-				fd->fd,
-				header.opcode,
-				NULL,
-				0,
-				hdr,
-				context
-			);
-			return SUCCESSFUL_READ;
-		}
+/*
+ * Runs a coroutine until it next waits or returns. Only the scheduler
+ * resumes coroutines, so this always switches back to it.
+ */
+static void coroutine_resume(struct coroutine *co)
+{
+	coroutines.current = co;
+	coroutines.resumes++;
+	swapcontext(&coroutines.main, &co->context);
+	coroutines.current = NULL;
+	if (co->done)
+		coroutine_free(co);
+}
 
-		void *attempt = malloc(header.size);
-		if (!attempt) {
-			return ERROR;
-		}
+static bool coroutine_waiting_reserve(int fd)
+{
+	if (fd < coroutines.waiting_size)
+		return true;
 
-		struct iovec newbuf = {
-			.iov_base = attempt,
-			.iov_len = header.size,
-		};
+	int size = coroutines.waiting_size ? coroutines.waiting_size : 64;
+	while (size <= fd)
+		size *= 2;
+	struct coroutine **attempt = realloc(coroutines.waiting, (size_t)size * sizeof(*attempt));
+	if (!attempt)
+		return false;
+	memset(
+		attempt + coroutines.waiting_size,
+		0,
+		(size_t)(size - coroutines.waiting_size) * sizeof(*attempt)
+	);
+	coroutines.waiting = attempt;
+	coroutines.waiting_size = size;
+	return true;
+}
 
-		struct msghdr bighdr = {
-			.msg_iov = &newbuf,
-			.msg_iovlen = 1,
-		};
+/*
+ * Arms the epoll set to report fd once it's readable.
+ */
+static bool coroutine_arm(int fd)
+{
+	if (coroutines.epoll < 0) {
+		coroutines.epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (coroutines.epoll < 0)
+			return false;
+	}
 
-		received = recvmsg(fd->fd, &bighdr, 0);
-		if (received < 0) {
-			free(attempt);
-			return ERROR;
-		}
+	// A descriptor closed since it was last armed has left the set
+	// by itself, as has one whose number now names another socket
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.fd = fd,
+	};
+	return !epoll_ctl(coroutines.epoll, EPOLL_CTL_MOD, fd, &event)
+		|| (errno == ENOENT && !epoll_ctl(coroutines.epoll, EPOLL_CTL_ADD, fd, &event));
+}
 
-		callback(
-			fd->fd,
-			header.opcode,
-			attempt,
-			header.size,
-			hdr,
-			context
-		);
+static void backlog_push(int fd, int opcode, void *buf, int len, struct msghdr header)
+{
+	const size_t body = ((size_t)len + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+	struct backlog *entry = malloc(sizeof(*entry) + body + header.msg_controllen);
+	if (!entry) {
+		close_cmsg_fds(header);
+		return;
+	}
 
-		free(attempt);
+	char *data = (char *)entry->data;
+	memcpy(data, buf, (size_t)len);
+	memcpy(data + body, header.msg_control, header.msg_controllen);
+	*entry = (struct backlog) {
+		.fd = fd,
+		.message = {
+			.opcode = opcode,
+			.buf = data,
+			.len = len,
+			.header = {
+				.msg_control = header.msg_controllen ? data + body : NULL,
+				.msg_controllen = header.msg_controllen,
+			},
+		},
+	};
 
-		return SUCCESSFUL_READ;
-	} else if (fd->revents & POLLHUP) {
-		return HANGUP;
-	} else if (
-		fd->revents & POLLNVAL
-		|| fd->revents & POLLERR
-	) {
-		return ERROR;
+	if (coroutines.backlog_tail)
+		coroutines.backlog_tail->next = entry;
+	else
+		coroutines.backlog = entry;
+	coroutines.backlog_tail = entry;
+}
+
+static struct backlog *backlog_take(int fd)
+{
+	struct backlog *prev = NULL;
+	for (struct backlog *entry = coroutines.backlog; entry; prev = entry, entry = entry->next) {
+		if (entry->fd != fd)
+			continue;
+		if (prev)
+			prev->next = entry->next;
+		else
+			coroutines.backlog = entry->next;
+		if (coroutines.backlog_tail == entry)
+			coroutines.backlog_tail = prev;
+		return entry;
 	}
-	return NO_WORK;
+	return NULL;
 }
 
-struct pollfd pollopfds(
-	struct pollfd *fds,
-	int count,
-	pollop_callback *callback,
-	void *context,
-	int timeout
+/*
+ * Hands a message to the coroutine waiting for it. With a budget,
+ * pollopfds() may read more from an fd than its coroutine asked for,
+ * so those are kept for its next recvop().
+ */
+static void coroutine_callback(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr header,
+	void *context
 )
 {
-	static const struct pollfd err = {.fd = -1};
-
-	fds->events = POLLIN;
+	(void)context;
 
-	if (count < 0)
-		return err;
+	struct coroutine *co = fd < coroutines.waiting_size ? coroutines.waiting[fd] : NULL;
+	if (!co) {
+		backlog_push(fd, opcode, buf, len, header);
+		return;
+	}
 
-	int changed = poll(fds, count, timeout);
+	coroutines.waiting[fd] = NULL;
+	coroutines.waiters--;
+	co->status = 1;
+	co->message = (struct op_message) { opcode, buf, len, header };
+	coroutine_resume(co);
+}
 
-	if (changed < 0)
-		return err;
+int spawn_coroutine(int fd, coroutine_fn *fn, void *context)
+{
+	if (fd < 0 || !fn) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (changed == 0)
-		return (struct pollfd) { 0 };
+	struct coroutine *co = calloc(1, sizeof(*co));
+	if (!co)
+		return -1;
 
-	struct pollfd *fd = fds;
-	for (; changed > 0 && fd < &fds[count]; fd++) {
-		pollfd_read_t result = process_pollfd(fd, callback, context);
-		if (result == ERROR)
-			return err;
-		else if (result == HANGUP) {
-			fd->revents &= ~POLLIN;
-			fd->revents |= POLLHUP;
-			fd->fd = ~fd->fd;
-			return (struct pollfd) {
-				.fd = ~fd->fd,
-				.events = fd->events,
-				.revents = fd->revents,
-			};
-		}
-		else if (result == SUCCESSFUL_READ)
-			changed--;
+	// The lowest page is left unmapped, so overflowing the stack
+	// faults rather than running into whatever is below it
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	co->stack_size = coroutine_stack_size() + page;
+	co->stack = mmap(
+		NULL,
+		co->stack_size,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+		-1,
+		0
+	);
+	if (co->stack == MAP_FAILED) {
+		free(co);
+		return -1;
+	}
+	if (mprotect(co->stack, page, PROT_NONE) < 0 || getcontext(&co->context) < 0) {
+		munmap(co->stack, co->stack_size);
+		free(co);
+		return -1;
 	}
 
-	return *(fd - 1);
-}
+	co->context.uc_stack.ss_sp = co->stack;
+	co->context.uc_stack.ss_size = co->stack_size;
+	co->context.uc_link = &coroutines.main;
+	makecontext(&co->context, coroutine_entry, 0);
 
-struct pollfd pollopfd(
-	struct pollfd fd,
-	pollop_callback *callback,
-	void *context,
-	int timeout
-)
-{
-	return pollopfds(&fd, 1, callback, context, timeout);
+	co->fd = fd;
+	co->fn = fn;
+	co->arg = context;
+	if (coroutines.runnable_tail)
+		coroutines.runnable_tail->next = co;
+	else
+		coroutines.runnable = co;
+	coroutines.runnable_tail = co;
+	coroutines.live++;
+	return 0;
 }
 
-struct pollfd pollopsrv(
-	pollop_callback *callback,
-	void *context,
-	int timeout
-)
+int recvop(int fd, struct op_message *message)
 {
-	struct pollfd fd = {.fd = SRV_FILENO};
-	return pollopfd(fd, callback, context, timeout);
+	struct coroutine *co = coroutines.current;
+	if (!co || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	free(co->held);
+	co->held = backlog_take(fd);
+	if (co->held) {
+		*message = co->held->message;
+		return 1;
+	}
+
+	if (!coroutine_waiting_reserve(fd))
+		return -1;
+	if (coroutines.waiting[fd]) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (!coroutine_arm(fd))
+		return -1;
+
+	coroutines.waiting[fd] = co;
+	coroutines.waiters++;
+	swapcontext(&co->context, &coroutines.main);
+	if (co->status > 0)
+		*message = co->message;
+	return co->status;
 }
 
-struct pollfd pollop(
-	pollop_callback *callback,
-	void *context,
-	int timeout
-)
+int run_coroutines(void)
 {
-	static const struct pollfd err = {.fd = -1};
-	static struct pollfd *fds = NULL;
+	if (coroutines.current) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	int total = cli_count() + 1;
-	if (!fds) {
-		fds = calloc(total, sizeof(*fds));
-		if (!fds)
-			return err;
+	struct epoll_event events[EPOLL_EVENTS];
+	for (;;) {
+		// Coroutines spawned since the last wait start first
+		while (coroutines.runnable) {
+			struct coroutine *co = coroutines.runnable;
+			coroutines.runnable = co->next;
+			if (!coroutines.runnable)
+				coroutines.runnable_tail = NULL;
+			co->next = NULL;
+			coroutine_resume(co);
+		}
+		if (!coroutines.waiters)
+			return 0;
 
-		srvcli_polls(fds, total);
-	}
+		// The set is waited on like any other fd, so queued
+		// writes, corked buffers and timers are still seen to
+		struct pollfd set = { .fd = coroutines.epoll, .events = POLLIN };
+		struct poll_state state = { &set, 1 };
+		if (wait_flushing(wait_poll, &state, -1) < 0)
+			return -1;
+		const int ready = epoll_wait(coroutines.epoll, events, EPOLL_EVENTS, 0);
+		if (ready < 0 && errno != EINTR)
+			return -1;
 
-	return pollopfds(fds, total, callback, context, timeout);
+		for (int i = 0; i < ready; i++) {
+			struct pollfd fd = {
+				.fd = events[i].data.fd,
+				.events = POLLIN,
+				.revents = (short)events[i].events,
+			};
+			const unsigned long resumes = coroutines.resumes;
+			pollfd_read_t result = process_budget(&fd, coroutine_callback, NULL);
+			if (result == ERROR)
+				return -1;
+
+			struct coroutine *co = fd.fd < coroutines.waiting_size ?
+				coroutines.waiting[fd.fd] :
+				NULL;
+			if (!co)
+				continue;
+
+			// Whoever was waiting on a connection that hung up is
+			// told so. One that was given a message armed the fd
+			// again as it went back to waiting, but one that
+			// wasn't, because only libsrvsh's own messages came,
+			// needs it armed here
+			if (result == HANGUP) {
+				coroutines.waiting[fd.fd] = NULL;
+				coroutines.waiters--;
+				co->status = 0;
+				coroutine_resume(co);
+			} else if (coroutines.resumes == resumes && !coroutine_arm(fd.fd))
+				return -1;
+		}
+	}
 }
 
 void close_cmsg_fds(struct msghdr header)
@@ -562,13 +7319,15 @@ void close_cmsg_fds(struct msghdr header)
 		)
 			continue;
 
-		int *fds = malloc(chdr->cmsg_len);
+		// cmsg_len counts the header too
+		const size_t datalength = chdr->cmsg_len - CMSG_LEN(0);
+		int *fds = malloc(datalength);
 		if (!fds)
 			return;
 
-		memcpy(fds, CMSG_DATA(chdr), chdr->cmsg_len);
+		memcpy(fds, CMSG_DATA(chdr), datalength);
 
-		const size_t arrlength = chdr->cmsg_len / sizeof(int);
+		const size_t arrlength = datalength / sizeof(int);
 		for (size_t i = 0; i < arrlength; i++) {
 			close(fds[i]);
 		}
@@ -588,6 +7347,95 @@ static int get_clients_end()
 	return fd;
 }
 
+/*
+ * Drops the settings and unsent messages of a connection whose peer
+ * has gone, leaving only what it received and its counters.
+ */
+static void conn_forget(struct conn *conn)
+{
+	struct sendbuf *sb = conn->send;
+	if (sb) {
+		sendbuf_settle(sb);
+		sendbuf_unlink(sb);
+		free(sb->buffer);
+		free(sb->spare);
+		free(sb);
+		conn->send = NULL;
+	}
+
+	if (conn->out) {
+		outq_clear(conn->out);
+		free(conn->out);
+		conn->out = NULL;
+	}
+	free(conn->compress);
+	conn->compress = NULL;
+
+	if (conn->credit) {
+		while (conn->credit->head) {
+			struct heldmsg *next = conn->credit->head->next;
+			heldmsg_free(conn->credit->head);
+			conn->credit->head = next;
+		}
+		free(conn->credit);
+		conn->credit = NULL;
+	}
+
+	if (conn->forward) {
+		free(conn->forward->rules);
+		free(conn->forward);
+		conn->forward = NULL;
+	}
+
+	conn->configured = false;
+	conn->compact = false;
+	conn->shm_ring = 0;
+	if (conn->recv)
+		conn->recv->compact = false;
+	atomic_fetch_add_explicit(&conn->generation, 1, memory_order_relaxed);
+}
+
+/*
+ * Forgets what was known about a descriptor number that now refers
+ * to a new connection.
+ */
+static void conn_reset(int fd)
+{
+	struct conn *conn = find_conn(fd);
+	if (!conn)
+		return;
+
+	shm_detach(conn);
+
+	// io_uring may still be writing into a buffer with a read
+	// armed, so that one has to be left for the completion
+	struct recvbuf *rb = conn->recv;
+	if (rb && !rb->armed) {
+		recvbuf_drop(rb);
+		free(rb->buffer);
+		free(rb);
+		rb = NULL;
+	}
+
+	conn_forget(conn);
+	const unsigned generation = atomic_load_explicit(
+		&conn->generation,
+		memory_order_relaxed
+	);
+	*conn = (struct conn) { .recv = rb };
+	atomic_init(&conn->generation, generation);
+}
+
+int closeop(int fd)
+{
+	flushop(fd);
+	struct conn *conn = find_conn(fd);
+	if (conn && conn->out && conn->out->blocking)
+		outq_finish(conn);
+	conn_reset(fd);
+	return close(fd);
+}
+
 static struct clistate exec_impl(
 	bool does_lookup,
 	const char *path,
@@ -602,28 +7450,58 @@ static struct clistate exec_impl(
 	int (*const exec)(const char*, char *const[])
 		= does_lookup ? execvp : execv;
 
+	const char *socket_name = env_value(envp, "SRVSH_SOCKET_TYPE");
+	const int type = socket_name && strcmp(socket_name, "seqpacket") == 0 ?
+		SOCK_SEQPACKET :
+		SOCK_STREAM;
+
 	int sockets[2] = { -1, -1 };
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+	if (socketpair(AF_UNIX, type, 0, sockets) < 0)
+		return error;
+	conn_reset(sockets[0]);
+
+	// The new process picks the same up from its environment
+	struct conn *conn = get_conn(sockets[0]);
+	if (!conn) {
+		close(sockets[0]);
+		close(sockets[1]);
 		return error;
+	}
+	conn_configure(conn, envp);
+
+	if (spawning_clients)
+		conn->shm_ring = shm_ring_size(env_value(envp, "SRVSH_SHM_RING"));
+	else
+		shm_offer(sockets[0], env_value(envp, "SRVSH_SHM_RING"));
 
 	result.pid = fork();
 	switch (result.pid) {
 		case -1:
 			return error;
 		case 0: {
-			for (int sock = sockets[0]; sock > SRV_FILENO; sock--)
+			// leave with _exit(), so the atexit() handlers don't
+			// act on what we copied from the parent, such as the
+			// frames it has corked
+			for (int sock = sockets[0]; sock > SRV_FILENO; sock--) {
+				conn_reset(sock);
 				close(sock);
+			}
 			if (dup2(sockets[1], SRV_FILENO) < 0)
-				exit(1);
+				_exit(1);
 			close(sockets[1]);
+			conn_reset(SRV_FILENO);
+
+			// the parent's clients aren't ours
+			clients_configured = true;
+			spawning_clients = true;
 
 			if (cli_spawner)
 				if (!cli_spawner(context))
-					exit(1);
+					_exit(1);
 
 			int clients_end = get_clients_end();
 			if (clients_end < 0)
-				exit(1);
+				_exit(1);
 
 			// 22 characters should be enough for a
 			// 64bit int + sign + null byte
@@ -639,13 +7517,24 @@ static struct clistate exec_impl(
 					clients_end
 				) < 0
 			) {
-				exit(1);
+				_exit(1);
 			}
 
+			// envp is usually environ itself, and if that was
+			// built by setenv(), the first putenv() below frees
+			// it, so work from a copy
+			size_t env_count = 0;
+			while (envp[env_count])
+				env_count++;
+			char **env_copy = calloc(env_count + 1, sizeof(*env_copy));
+			if (!env_copy)
+				_exit(1);
+			memcpy(env_copy, envp, env_count * sizeof(*env_copy));
+
 			environ = NULL;
-			for (char * const* env = envp; *env; env++) {
+			for (char * const* env = env_copy; *env; env++) {
 				if (putenv(*env))
-					exit(1);
+					_exit(1);
 			}
 
 			const bool overwrite = true;
@@ -655,18 +7544,20 @@ static struct clistate exec_impl(
 					clients_end_str,
 					overwrite
 				) < 0
+				|| !clients_describe(clients_end)
 			) {
-				exit(1);
+				_exit(1);
 			}
 
+			signals_unblock();
 			if (cli_spawner) {
-				fork_waiter(exec, path, argv);
-				// the fork_waiter already calls exit() but this
+				fork_waiter(exec, path, argv, clients_end);
+				// the fork_waiter already calls _exit() but this
 				// shuts the compiler up
-				exit(1);
+				_exit(1);
 			} else {
 				exec(path, argv);
-				exit(1);
+				_exit(1);
 			}
 		}
 		default:
@@ -698,7 +7589,7 @@ static struct clistate execl_impl(
 	// +1 for the null terminator
 	char **argv = calloc(arglength + 1, sizeof(char**));
 	memcpy(argv, &arg0, sizeof(*argv));
-	for (char **cur = argv; arglength; cur++, arglength--)
+	for (char **cur = argv + 1; --arglength; cur++)
 		*cur = va_arg(args, char*);
 
 	// skip the null arg
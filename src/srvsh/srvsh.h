@@ -22,8 +22,11 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
 #include <poll.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,6 +53,17 @@ extern "C" {
  */
 #define CLI_BEGIN 4
 
+/**
+ * \brief The lowest of the opcodes reserved for libsrvsh.
+ *
+ * Opcodes from SRVSH_OPCODE_RESERVED to SRVSH_OPCODE_RESERVED + 255
+ * are used by the library for its own messages, and are never passed
+ * to a callback, except for RPC requests and replies while an RPC
+ * layer is open, as described for rpc_callback(). Applications should
+ * not send them.
+ */
+#define SRVSH_OPCODE_RESERVED INT_MIN
+
 typedef void opcode_db;
 
 /**
@@ -80,8 +94,22 @@ int cli_count(void);
  */
 bool is_cli(int fd);
 
+/**
+ * \returns True if messages sent to the given file descriptor
+ * 	go through shared memory, false otherwise.
+ *
+ * Shared memory is only set up for connections created while
+ * SRVSH_SHM_RING is set in the environment.
+ */
+bool is_shm(int fd);
+
 /**
  * \brief A header prefix for IPC between servers/clients.
+ *
+ * This is how the header is sent unless the connection was started with
+ * SRVSH_HEADER=compact in the new program's environment, in which case
+ * the opcode and size are each sent as a varint, the opcode
+ * zigzag-encoded, so most headers take two bytes.
  */
 struct srvsh_header {
 	int opcode;
@@ -125,6 +153,427 @@ ssize_t sendmsgop(
 	size_t cmsg_len
 );
 
+/**
+ * \brief Writes a message to the file descriptor given in fd,
+ * 	in the same manner as writeop(), except the payload is
+ * 	gathered from the iovcnt segments in iov.
+ *
+ * The segments are sent one after another, as a single message with
+ * their combined length, without first being copied together.
+ *
+ * \returns The number of bytes written, including the header, or
+ * 	-1 on failure, with errno set to EINVAL if iovcnt is negative,
+ * 	isn't less than IOV_MAX, or the segments add up to more than
+ * 	INT_MAX bytes.
+ *
+ * \sa sendmsgopv()
+ */
+ssize_t writeopv(
+	int fd,
+	int opcode,
+	const struct iovec *iov,
+	int iovcnt
+);
+
+/**
+ * \brief Writes a message gathered from the segments in iov, in the
+ * 	same manner as writeopv(), except it also supports
+ * 	ancillary data.
+ *
+ * \sa sendmsgop()
+ */
+ssize_t sendmsgopv(
+	int fd,
+	int opcode,
+	const struct iovec *iov,
+	int iovcnt,
+	void *cmsg,
+	size_t cmsg_len
+);
+
+/**
+ * \brief Sends a large payload to the file descriptor given in fd
+ * 	without copying it through the socket.
+ *
+ * The payload is written to a sealed memfd, which is passed to the
+ * receiver with SCM_RIGHTS. The receiver's callback is given the
+ * original opcode and a read-only mapping of the payload, which is
+ * unmapped when the callback returns. The memfd stays in the control
+ * data of the header passed to the callback, so it can be kept, or
+ * closed with close_cmsg_fds() like any other file descriptor.
+ *
+ * \returns The number of bytes written to the socket, or -1
+ * 	on failure.
+ *
+ * \sa close_cmsg_fds()
+ */
+ssize_t sendbulkop(
+	int fd,
+	int opcode,
+	const void *buf,
+	size_t len
+);
+
+/**
+ * \brief Sends the same message to each of the count file
+ * 	descriptors in fds, or to every client if fds is NULL.
+ *
+ * Every client is written to without blocking, so a slow client
+ * doesn't hold up the rest, or the caller. What a client couldn't
+ * take is queued, as with nonblockop(), and sent as its socket
+ * drains while a pollop* function waits; the next write to it, or
+ * closeop(), waits for the rest first, as a blocking write would
+ * have. A client that fails is skipped, without raising SIGPIPE.
+ *
+ * Payloads of 64KiB or more are written once, to a sealed memfd that
+ * is passed to each client, as with sendbulkop(), so their callbacks
+ * find the memfd in the control data.
+ *
+ * \returns The number of file descriptors the message was sent to,
+ * 	or -1 if it failed before any were written to. If it's fewer
+ * 	than count, errno is set by the last one that failed.
+ *
+ * \sa sendbulkop()
+ */
+int broadcastop(const int *fds, int count, int opcode, const void *buf, int len);
+
+/**
+ * \brief Passed to set_forward() in place of an opcode, to forward
+ * 	every message that no other rule matches.
+ *
+ * This includes RPC requests and replies, which can't have rules of
+ * their own, so a process can relay calls between two others.
+ */
+#define FORWARD_ALL (SRVSH_OPCODE_RESERVED + 254)
+
+/**
+ * \brief Relays a message received by a pollop_callback to the
+ * 	file descriptor to, along with any file descriptors passed
+ * 	with it.
+ *
+ * The file descriptors in header are closed once they have been
+ * sent, so the callback shouldn't close them too.
+ *
+ * \returns The number of bytes written, or -1 on failure.
+ *
+ * \sa set_forward()
+ */
+ssize_t forwardop(int to, int opcode, const void *buf, int len, struct msghdr header);
+
+/**
+ * \brief Forwards every message received on from with the given
+ * 	opcode to the file descriptor to, without passing it to the
+ * 	callback. A negative to removes the rule.
+ *
+ * Forwarded messages keep their opcode and any file descriptors
+ * passed with them. Bulk messages are matched by the opcode they
+ * carry and passed on as the same memfd. When both ends are plain
+ * stream sockets, bodies from 16KiB up to 1MiB are spliced from one
+ * to the other without being copied into the process, taking the
+ * whole body before sending any of the frame; others are relayed as
+ * with forwardop().
+ *
+ * \returns 0 on success, or -1 on failure. Opcodes reserved by
+ * 	srvsh, other than FORWARD_ALL, fail with EINVAL.
+ *
+ * \sa forwardop(), FORWARD_ALL
+ */
+int set_forward(int from, int opcode, int to);
+
+/**
+ * \brief The codecs compressop() can compress messages with.
+ *
+ * COMPRESS_ZLIB is only available when srvsh is built with
+ * SRVSH_ZLIB.
+ */
+enum compress_codec {
+	COMPRESS_LZ = 1,
+	COMPRESS_ZLIB,
+};
+
+/**
+ * \brief Counters for the compression of one connection, as
+ * 	returned by get_compress_stats().
+ */
+struct compress_stats {
+	/** Messages sent compressed. */
+	unsigned long compressed;
+	/** Messages over the threshold that didn't get smaller. */
+	unsigned long skipped;
+	/** Messages received compressed and decompressed. */
+	unsigned long decompressed;
+	/** Messages received compressed that couldn't be decompressed. */
+	unsigned long failed;
+	/** Payload bytes of the messages sent compressed. */
+	unsigned long long raw_bytes;
+	/** What those payloads were compressed to. */
+	unsigned long long compressed_bytes;
+	/** Time spent compressing, in nanoseconds. */
+	unsigned long long compress_ns;
+	/** Time spent decompressing, in nanoseconds. */
+	unsigned long long decompress_ns;
+};
+
+/**
+ * \brief Compresses messages of at least threshold bytes sent to
+ * 	the file descriptor given in fd.
+ *
+ * Compressed messages are decompressed by the receiver before its
+ * callback is called, so the callback sees the original opcode and
+ * payload. Messages that don't get smaller are sent as they are, and
+ * messages that go through a shared-memory ring are never
+ * compressed. A threshold of 0 turns compression off.
+ *
+ * Compression can also be turned on for a child's connection to its
+ * server with the SRVSH_COMPRESS environment variable.
+ *
+ * \returns 0 on success, or -1 on failure, with errno set to
+ * 	EINVAL if the codec isn't available.
+ *
+ * \sa get_compress_stats()
+ */
+int compressop(int fd, enum compress_codec codec, size_t threshold);
+
+/**
+ * \brief Gets the compression counters of the file descriptor
+ * 	given in fd.
+ *
+ * The counters are all zero for a connection that has neither sent
+ * nor received a compressed message.
+ *
+ * \returns 0 on success, or -1 on failure.
+ */
+int get_compress_stats(int fd, struct compress_stats *stats);
+
+/**
+ * \brief The credit state of one connection, as returned by
+ * 	get_credit_state().
+ */
+struct credit_state {
+	/** Whether sending to the connection is limited by credit. */
+	bool limited;
+	/** Messages that may be sent before more credit is needed, or -1. */
+	long messages;
+	/** Payload bytes that may be sent, or -1 if bytes aren't limited. */
+	long long bytes;
+	/** Messages held back until more credit arrives. */
+	size_t held;
+	/** The payload bytes of the messages held back. */
+	size_t held_bytes;
+	/** The number of messages that have had to be held back. */
+	unsigned long stalls;
+	/** The messages the other end may have outstanding, or 0. */
+	int window;
+	/** The payload bytes the other end may have outstanding, or 0. */
+	int window_bytes;
+};
+
+/**
+ * \brief Limits how much the other end of the connection given in fd
+ * 	may send before this end has handled it.
+ *
+ * The other end is granted credit for a window of messages, and
+ * optionally of payload bytes. Each message it sends uses up credit,
+ * which is given back once this end's callback has returned for the
+ * message. When it runs out, its writeop() and sendmsgop() calls
+ * hold messages back in a local queue, and report them as sent;
+ * they go out as credit arrives. Since credit arrives as messages,
+ * a sender only sees it by reading the connection with the pollop*
+ * functions. The queue holds up to a window's worth, and past that
+ * sending fails with EAGAIN until the sender has read more credit.
+ *
+ * Messages passed on by a set_forward() rule are held without that
+ * limit, but the connection they came from only gets their credit
+ * back once they've gone on, so a limited source can't fill the
+ * forwarding process's memory either.
+ *
+ * A message is always let through while any credit is left, so one
+ * larger than the byte window can still be sent. Messages already on
+ * their way when the window is set are given back as well, so the
+ * window can be exceeded by that many early on.
+ *
+ * Setting SRVSH_CREDIT=messages[:bytes] in a new program's
+ * environment limits both directions of its connection to its server
+ * from the start.
+ *
+ * \param fd The file descriptor to limit.
+ * \param messages The window of messages, or 0 to lift the limit.
+ * \param bytes The window of payload bytes, or 0 not to limit them.
+ *
+ * \returns 0 on success, or -1 on failure, with errno set to EBUSY
+ * 	if a window has already been set.
+ *
+ * \sa get_credit_state()
+ */
+int creditop(int fd, int messages, int bytes);
+
+/**
+ * \brief Gets the credit state of the file descriptor given in fd.
+ *
+ * \returns 0 on success, or -1 on failure.
+ */
+int get_credit_state(int fd, struct credit_state *state);
+
+/**
+ * \brief Traffic counters, as returned by get_traffic_stats() for a
+ * 	connection or get_opcode_stats() for an opcode.
+ *
+ * Messages are counted as the application sends and receives them,
+ * so a compressed message or one sent with sendbulkop() counts once,
+ * with its original opcode and size. Messages libsrvsh sends for
+ * itself, such as credit grants and RPC requests and replies, aren't
+ * counted.
+ */
+struct traffic_stats {
+	unsigned long messages_in;
+	/** The payload bytes received, not counting headers. */
+	unsigned long bytes_in;
+	unsigned long messages_out;
+	/** The payload bytes sent, not counting headers. */
+	unsigned long bytes_out;
+	/** Failed sends and reads. Only counted per connection. */
+	unsigned long errors;
+	/** Times the connection hung up. Only counted per connection. */
+	unsigned long hangups;
+	/** Bytes waiting in the socket to be read, from SIOCINQ. */
+	int queued_in;
+	/** Bytes in the socket the peer hasn't read yet, from SIOCOUTQ. */
+	int queued_out;
+};
+
+/**
+ * \brief Gets the traffic counters of the file descriptor given in fd,
+ * 	along with how much is queued in its socket right now.
+ *
+ * The counters are reset when a cliexec* or srvexec* function reuses
+ * the descriptor number for a new connection.
+ *
+ * Setting SRVSH_STATS in the environment dumps every connection's and
+ * opcode's counters to stderr with dump_traffic_stats(). It's a
+ * comma-separated list of "exit", to dump them as the program exits,
+ * and signals, by number or as "USR1" or "USR2", to dump them from
+ * the pollop* functions whenever the signal arrives, as if it were
+ * watched with watch_signal().
+ *
+ * \returns 0 on success, or -1 if fd isn't open.
+ */
+int get_traffic_stats(int fd, struct traffic_stats *stats);
+
+/**
+ * \brief Gets the traffic counters of the opcode given in opcode,
+ * 	across every connection.
+ *
+ * Only the first 1024 opcodes used are counted separately. The
+ * queued, error and hang-up counts are always zero.
+ *
+ * \returns 0.
+ */
+int get_opcode_stats(int opcode, struct traffic_stats *stats);
+
+/**
+ * \brief Writes a table of every connection's and opcode's traffic
+ * 	counters to the file descriptor out.
+ *
+ * \returns 0 on success, or -1 if nothing could be written.
+ */
+int dump_traffic_stats(int out);
+
+/**
+ * \brief Closes the given file descriptor, and forgets everything
+ * 	libsrvsh knew about it.
+ *
+ * Settings such as corkop(), nonblockop(), creditop(), compressop(),
+ * set_forward() and those taken from the SRVSH_* environment variables
+ * belong to the descriptor number. They're dropped when a pollop* function
+ * sees the peer hang up, but a connection closed with close() before
+ * that leaves them behind for the next socket given the same number.
+ * Messages still corked are sent first; anything nonblockop() queued
+ * that the socket hasn't taken is dropped.
+ *
+ * \returns The result of close().
+ */
+int closeop(int fd);
+
+/**
+ * \brief Batches messages written to the given file descriptor.
+ *
+ * Once corked, writeop(), writesrv() and sendmsgop() append messages
+ * to a buffer instead of sending them immediately, and return the
+ * number of bytes buffered. The buffer is sent with a single call
+ * when:
+ * 	- flushop() or flushops() is called
+ * 	- the next message would not fit in the buffer
+ * 	- the delay has passed since the oldest buffered message, and
+ * 	  a pollop* function is called or is already blocking
+ * 	- the process exits normally
+ *
+ * A message larger than the buffer is sent on its own, after the
+ * buffer is flushed. Messages with ancillary data are sent the same
+ * way, so file descriptors arrive with the message they were sent with.
+ *
+ * \param fd The file descriptor to cork.
+ * \param size The size of the buffer in bytes, or 0 to flush and
+ * 	return to sending each message immediately.
+ * \param delay The maximum time, in milliseconds, to hold a message
+ * 	before the pollop* functions flush it. With a delay of 0, the
+ * 	buffer is flushed the next time a pollop* function is called,
+ * 	so replies written while handling one wakeup are sent together.
+ * 	A negative delay only flushes when the buffer fills or flushop()
+ * 	is called.
+ *
+ * \returns 0 on success, or -1 on failure.
+ */
+int corkop(int fd, size_t size, int delay);
+
+/**
+ * \brief Sends any messages buffered for the given file descriptor
+ * 	by corkop().
+ *
+ * If sending fails, the buffered messages are discarded, unless it
+ * failed with EAGAIN because nonblockop()'s queue is full. Then they
+ * stay buffered for a later flush.
+ *
+ * \returns The number of bytes sent, or -1 on failure.
+ */
+ssize_t flushop(int fd);
+
+/**
+ * \brief Sends the messages buffered for every corked file descriptor.
+ *
+ * \returns 0 on success, or -1 if any flush failed.
+ */
+int flushops(void);
+
+/**
+ * \brief Makes writes to the given file descriptor non-blocking.
+ *
+ * Once set, whatever part of a message the socket won't take straight
+ * away is queued, and the write returns as if it had all been sent.
+ * The pollop* functions send queued data as the socket drains, so a
+ * slow reader doesn't hold up writes to anyone else. File descriptors
+ * passed with sendmsgop() are duplicated while they wait in the queue.
+ *
+ * Messages through shared memory (see is_shm()) still wait for room
+ * in the ring.
+ *
+ * \param fd The file descriptor to make non-blocking.
+ * \param limit Once more than this many bytes are queued, further
+ * 	writes fail with errno set to EAGAIN, and nothing is sent. A limit
+ * 	of 0 sends everything queued, waiting if necessary, and returns to
+ * 	blocking writes.
+ *
+ * \returns 0 on success, or -1 on failure.
+ *
+ * \sa queuedop()
+ */
+int nonblockop(int fd, size_t limit);
+
+/**
+ * \returns The number of bytes queued to be written to the given file
+ * 	descriptor by nonblockop() or broadcastop().
+ */
+size_t queuedop(int fd);
+
 /**
  * \brief A type defining the callback type
  * 	used by pollop* functions.
@@ -280,6 +729,613 @@ struct pollfd pollop(
 	int timeout
 );
 
+/**
+ * \brief The event notification mechanisms pollop() can use.
+ */
+enum pollop_backend {
+	/**
+	 * \brief poll(2) over the server and every client on each call.
+	 */
+	POLLOP_POLL,
+	/**
+	 * \brief A level-triggered epoll(7) set, registered once, so each
+	 * 	call only costs as much as the number of ready file descriptors.
+	 * 	One message is read from each ready file descriptor per call,
+	 * 	the same as POLLOP_POLL, unless set_pollop_budget() says
+	 * 	otherwise.
+	 */
+	POLLOP_EPOLL,
+	/**
+	 * \brief An edge-triggered epoll(7) set. Every message waiting on a
+	 * 	ready file descriptor is read before moving on to the next.
+	 */
+	POLLOP_EPOLL_EDGE,
+	/**
+	 * \brief An io_uring(7) instance that keeps a read in flight on
+	 * 	every connection, and submits the reads and any corked sends
+	 * 	that are due together, each time pollop() waits.
+	 *
+	 * Only corked sends go through io_uring; see corkop(). Anything
+	 * sent on a connection that isn't corked is still written with
+	 * sendmsg(2) when it's sent.
+	 *
+	 * Every connection is put in buffered mode, with a 64KiB buffer
+	 * unless recvbufop() already gave it one; see recvbufop() for how
+	 * this changes the callback's arguments. Connections waited on this
+	 * way must not be passed to the other pollop* functions.
+	 *
+	 * If libsrvsh was built without the SRVSH_IO_URING option, or the
+	 * running kernel doesn't support io_uring, POLLOP_POLL is used
+	 * instead.
+	 */
+	POLLOP_IO_URING,
+};
+
+/**
+ * \brief Selects the mechanism pollop() uses to wait for events.
+ *
+ * The default is taken from the SRVSH_POLLOP environment variable,
+ * which may be "poll", "epoll", "epoll-edge" or "io_uring". If it isn't set,
+ * POLLOP_POLL is used, unless libsrvsh was built with the SRVSH_EPOLL
+ * option, in which case POLLOP_EPOLL is used.
+ *
+ * This only affects pollop(). The pollopfd(), pollopfds() and pollopsrv()
+ * functions always use poll(2), since they report on every pollfd passed
+ * to them.
+ *
+ * Changing the backend forgets any hang-ups pollop() has already
+ * reported, so this should be called before the first call to pollop().
+ *
+ * \param backend The backend to use.
+ *
+ * \returns 0 on success, or -1 if the backend is not recognized.
+ */
+int set_pollop_backend(enum pollop_backend backend);
+
+/**
+ * \brief Returns the mechanism pollop() is using to wait for events.
+ *
+ * This is the backend set_pollop_backend() or SRVSH_POLLOP asked for,
+ * unless it isn't available: if POLLOP_IO_URING was asked for but
+ * libsrvsh was built without it, or the running kernel doesn't support
+ * it, POLLOP_POLL is returned. If pollop() hasn't been called since the
+ * backend was chosen, it's set up first, as pollop() would.
+ *
+ * \returns The backend pollop() uses.
+ */
+enum pollop_backend get_pollop_backend(void);
+
+/**
+ * \brief Sets how many messages the pollop* functions read from each
+ * 	ready file descriptor per wakeup.
+ *
+ * By default, the budget is 0: one message is read from each ready file
+ * descriptor, pollopfds() visits them in array order, and it returns as
+ * soon as one of them hangs up, leaving the rest for the next call.
+ *
+ * With a budget above 0, up to that many messages are read from each
+ * ready file descriptor before moving on to the next, stopping early
+ * once it has nothing more waiting. pollopfds() (and so pollop() with
+ * POLLOP_POLL, pollopfd() and pollopsrv()) also starts from a different
+ * file descriptor on each call, so none are favoured for their place in
+ * the array, and keeps processing the others when one hangs up. Every
+ * file descriptor that hung up is marked in the array as usual, and the
+ * returned pollfd is the last one to hang up, if any did, or otherwise
+ * the last one processed.
+ *
+ * The budget also applies to POLLOP_EPOLL. POLLOP_EPOLL_EDGE always
+ * reads every message waiting, and POLLOP_IO_URING reads whatever each
+ * completed read contains.
+ *
+ * \param budget The number of messages to read per file descriptor,
+ * 	or 0 for the default behaviour.
+ *
+ * \returns 0 on success, or -1 if the budget is negative.
+ */
+int set_pollop_budget(int budget);
+
+/**
+ * \brief A timer that calls its callback from the pollop* functions.
+ *
+ * Timers fire while any of the pollop* functions is waiting, from the
+ * same thread, so their callbacks can send and close connections like
+ * any pollop_callback. They don't change what the pollop* functions
+ * return: a call still returns once a message is read or its own
+ * timeout passes. Timers don't fire under dispatchop().
+ *
+ * All armed timers share one timerfd, kept set for whichever is due
+ * first, so they cost nothing while waiting, and arming or disarming
+ * one takes O(log n) in the number armed.
+ *
+ * Example usage:
+ *
+ * \code
+ * op_timer *heartbeat = open_timer(send_heartbeat, &state);
+ * set_timer(heartbeat, 1000, 1000);
+ * while (pollop(on_message, &state, -1).fd >= 0);
+ * \endcode
+ */
+typedef struct op_timer op_timer;
+
+/**
+ * \brief A type defining the callback type used by timers, which is
+ * 	passed the timer that fired and its context pointer.
+ */
+typedef void timer_callback(op_timer *timer, void *context);
+
+/**
+ * \brief Creates a timer, which doesn't fire until set_timer() arms it.
+ *
+ * \returns The new timer, or NULL on failure.
+ */
+op_timer *open_timer(timer_callback *callback, void *context);
+
+/**
+ * \brief Arms a timer to fire after delay milliseconds, and then every
+ * 	interval milliseconds, or disarms it if delay is negative.
+ *
+ * An interval of 0 fires the timer once. A timer that's already armed
+ * is rescheduled. Periods missed while nothing was waiting are
+ * skipped, rather than fired all at once, and the ones after that keep
+ * to the original schedule instead of drifting.
+ *
+ * \returns 0 on success, or -1 on failure. A negative interval fails
+ * 	with EINVAL.
+ */
+int set_timer(op_timer *timer, int delay, int interval);
+
+/**
+ * \brief Disarms and frees a timer created with open_timer(). A timer
+ * 	may be closed from its own callback.
+ */
+void close_timer(op_timer *timer);
+
+/**
+ * \brief A type defining the callback type used by watch_signal(),
+ * 	which is passed the signal number, what signalfd(2) reported
+ * 	about it, and the context pointer.
+ */
+typedef void signal_callback(
+	int signo,
+	const struct signalfd_siginfo *info,
+	void *context
+);
+
+/**
+ * \brief Calls the callback from the pollop* functions whenever the
+ * 	signal signo arrives, instead of interrupting them.
+ *
+ * The signal is blocked in the calling thread and read from a
+ * signalfd(2) that the pollop* functions wait on, alongside timers
+ * and the file descriptors passed to them, so it doesn't make them
+ * fail with EINTR. Like a timer, it doesn't change what they return,
+ * so a loop that should stop on a signal needs a timeout to notice
+ * what the callback changed. Other threads should block the signal
+ * too, which they do if they're started after this is called.
+ * Watching a signal again replaces its callback. As with timers,
+ * signals aren't read under dispatchop().
+ *
+ * \returns 0 on success, or -1 on failure. SIGKILL, SIGSTOP and
+ * 	numbers that aren't signals fail with EINVAL.
+ */
+int watch_signal(int signo, signal_callback *callback, void *context);
+
+/**
+ * \brief Stops watching the signal signo, unblocking it unless it was
+ * 	already blocked when watch_signal() was called.
+ *
+ * \returns 0 on success, or -1 on failure.
+ */
+int unwatch_signal(int signo);
+
+/**
+ * \brief A type defining the callback type used by watch_child(),
+ * 	which is passed the child's process ID, its status as
+ * 	waitpid(2) reports it, and the context pointer.
+ *
+ * The status is -1 if the child had already been reaped by the time
+ * it was waited for.
+ */
+typedef void child_callback(pid_t pid, int status, void *context);
+
+/**
+ * \brief Calls the callback from the pollop* functions once the child
+ * 	process pid exits, reaping it.
+ *
+ * The child is watched through a pidfd, so no SIGCHLD handler is
+ * needed, and a child that has exited before this is called is
+ * reported on the next wait. The callback is called once, after which
+ * the child is no longer watched. pid would usually come from the
+ * clistate returned by one of the cliexec* or srvexec* functions.
+ *
+ * \returns 0 on success, or -1 on failure, with errno set by
+ * 	pidfd_open(2), e.g. ESRCH if pid was already reaped.
+ */
+int watch_child(pid_t pid, child_callback *callback, void *context);
+
+/**
+ * \brief Stops watching the child process pid, without reaping it.
+ *
+ * \returns 0 on success, or -1 on failure.
+ */
+int unwatch_child(pid_t pid);
+
+/**
+ * \brief A message returned by recvop(), with the same fields a
+ * 	pollop_callback is passed.
+ */
+struct op_message {
+	int opcode;
+	void *buf;
+	int len;
+	struct msghdr header;
+};
+
+/**
+ * \brief A type defining the function a coroutine runs, which is
+ * 	passed the file descriptor and context pointer it was spawned
+ * 	with.
+ */
+typedef void coroutine_fn(int fd, void *context);
+
+/**
+ * \brief Creates a coroutine that runs fn on its own stack, once
+ * 	run_coroutines() starts it.
+ *
+ * A coroutine reads its messages with recvop(), which looks like a
+ * blocking read but switches to other coroutines until a message
+ * arrives, so each connection can be handled by straight-line code
+ * without holding up the rest. Coroutines can be spawned from other
+ * coroutines, and finish when fn returns.
+ *
+ * Writes from a coroutine don't switch away, so connections written to
+ * by coroutines should be made non-blocking with nonblockop(), to let
+ * a slow reader's messages queue instead of stalling every coroutine.
+ * Coroutines must not call the pollop* functions themselves.
+ *
+ * Each stack is 256KiB, which is only backed by memory as it's used,
+ * unless SRVSH_COROUTINE_STACK gives another size, such as "64k".
+ *
+ * Example usage:
+ *
+ * \code
+ * for (int cli = CLI_BEGIN; cli < cli_end(); cli++)
+ * 	spawn_coroutine(cli, serve_client, &state);
+ * run_coroutines();
+ * \endcode
+ *
+ * \returns 0 on success, or -1 on failure.
+ */
+int spawn_coroutine(int fd, coroutine_fn *fn, void *context);
+
+/**
+ * \brief Waits in a coroutine for the next message on fd, running
+ * 	other coroutines meanwhile.
+ *
+ * The message's buffer, and any memfd mapping that comes with it, stay
+ * valid until the coroutine next calls recvop() or returns. As with a
+ * pollop_callback, file descriptors in the message's header belong to
+ * the coroutine. Only one coroutine may wait on a file descriptor at a
+ * time.
+ *
+ * \returns 1 if a message was read, 0 if fd hung up, or -1 on failure.
+ * 	Calling this outside a coroutine fails with EINVAL, and waiting
+ * 	on a file descriptor another coroutine is waiting on fails with
+ * 	EBUSY.
+ */
+int recvop(int fd, struct op_message *message);
+
+/**
+ * \brief Runs every coroutine spawned with spawn_coroutine() until
+ * 	they have all returned.
+ *
+ * The coroutines are scheduled from pollopfds(), over the file
+ * descriptors they're waiting on, so set_pollop_budget(), timers and
+ * watched signals and children all apply as they do to any other
+ * caller of pollopfds().
+ *
+ * \returns 0 once every coroutine has returned, or -1 if polling
+ * 	failed, leaving the rest waiting for a later call.
+ */
+int run_coroutines(void);
+
+/**
+ * \brief Reads from every client on a pool of threads until they have
+ * 	all hung up.
+ *
+ * The clients are shared out between the threads, each of which waits
+ * for its own share with epoll(7). A thread that runs out of ready
+ * clients takes ready clients from the others, so a few busy clients
+ * don't leave the other threads idle. Each client is only ever read by
+ * one thread at a time, and its messages are passed to the callback in
+ * the order they were sent, but the callback may be called for
+ * different clients at the same time, from different threads.
+ *
+ * The number of messages read from a client each time it's taken is
+ * set by set_pollop_budget(), and is one by default.
+ *
+ * The callback may write to the file descriptor it was called for, but
+ * writing to any other file descriptor must be synchronized by the
+ * caller. corkop() and nonblockop() rely on a pollop* function being
+ * called to flush them, so must not be used on the clients while this
+ * runs. Nor may the clients be passed to the other pollop* functions
+ * at the same time.
+ *
+ * \param threads The number of threads to use, or 0 for one per
+ * 	online CPU. No more threads than clients are started.
+ * \param callback The callback to call for each message.
+ * \param context A context pointer to pass to the callback.
+ *
+ * \returns 0 once every client has hung up, or -1 if the threads
+ * 	couldn't be started or a read failed, in which case errno is
+ * 	set and reading stops.
+ */
+int dispatchop(int threads, pollop_callback *callback, void *context);
+
+/**
+ * \brief A table of callbacks indexed by opcode, for use as the
+ * 	callback of the pollop* functions.
+ *
+ * Example usage:
+ *
+ * \code
+ * op_dispatcher *dispatcher = open_op_dispatcher(on_unknown, NULL);
+ * set_op_handler(dispatcher, OP_HELLO, on_hello, &state);
+ * set_op_handler(dispatcher, OP_DATA, on_data, &state);
+ * pollop(op_dispatcher_callback, dispatcher, -1);
+ * \endcode
+ */
+typedef struct op_dispatcher op_dispatcher;
+
+/**
+ * \brief Creates a dispatcher with no handlers.
+ *
+ * \param fallback The callback for messages with no handler, or
+ * 	NULL to drop them, closing any file descriptors they carry.
+ * \param context The context pointer to pass to the fallback.
+ *
+ * \returns The new dispatcher, or NULL on allocation failure.
+ */
+op_dispatcher *open_op_dispatcher(pollop_callback *fallback, void *context);
+
+/**
+ * \brief Releases a dispatcher created with open_op_dispatcher().
+ */
+void close_op_dispatcher(op_dispatcher *dispatcher);
+
+/**
+ * \brief Sets the callback for messages with the given opcode.
+ *
+ * Handlers are kept in an array indexed by opcode, so it is as large
+ * as the largest opcode given a handler.
+ *
+ * \param dispatcher The dispatcher to add the handler to.
+ * \param opcode The opcode to handle. Must not be negative.
+ * \param handler The callback, or NULL to use the fallback again.
+ * \param context The context pointer to pass to the callback.
+ *
+ * \returns 0 on success, or -1 if the opcode is negative or the
+ * 	table couldn't be grown.
+ */
+int set_op_handler(
+	op_dispatcher *dispatcher,
+	int opcode,
+	pollop_callback *handler,
+	void *context
+);
+
+/**
+ * \brief Sets the callback for messages with the given opcode from
+ * 	one file descriptor only, overriding set_op_handler().
+ *
+ * Overrides are dropped once the connection hangs up or is closed with
+ * closeop(), so a new connection given the same number starts with none.
+ *
+ * \param dispatcher The dispatcher to add the handler to.
+ * \param fd The file descriptor the override applies to.
+ * \param opcode The opcode to handle. Must not be negative.
+ * \param handler The callback, or NULL to remove the override.
+ * \param context The context pointer to pass to the callback.
+ *
+ * \returns 0 on success, or -1 if fd or the opcode is negative or
+ * 	the table couldn't be grown.
+ */
+int set_fd_op_handler(
+	op_dispatcher *dispatcher,
+	int fd,
+	int opcode,
+	pollop_callback *handler,
+	void *context
+);
+
+/**
+ * \brief A pollop_callback that passes each message to the handler
+ * 	for its file descriptor and opcode in the op_dispatcher given
+ * 	as its context.
+ *
+ * It may be used with dispatchop(), as long as no handlers are set
+ * while dispatchop() is running.
+ */
+void op_dispatcher_callback(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr header,
+	void *context
+);
+
+/**
+ * \brief Returns the number of messages with the given opcode that
+ * 	the dispatcher has been called for.
+ *
+ * Messages are only counted for opcodes up to the largest one given
+ * a handler, whether they were handled or passed to the fallback. Use
+ * op_fallback_count() for the messages no handler was set for.
+ */
+unsigned long op_dispatch_count(const op_dispatcher *dispatcher, int opcode);
+
+/**
+ * \brief Returns the number of messages the dispatcher has passed to
+ * 	its fallback, whatever their opcode.
+ *
+ * Messages are counted even if the fallback is NULL and they were
+ * dropped.
+ */
+unsigned long op_fallback_count(const op_dispatcher *dispatcher);
+
+/**
+ * \brief The opcode a call's reply callback is given when the call
+ * 	is cancelled with cancel_calls().
+ */
+#define RPC_CANCELLED (SRVSH_OPCODE_RESERVED + 255)
+
+/**
+ * \brief Called for each request made with callop() on the other
+ * 	end of a connection.
+ *
+ * The request is answered by passing id to replyop(), either before
+ * the callback returns or at any later time, so requests may be
+ * answered in a different order to the one they arrived in.
+ */
+typedef void rpc_request_callback(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr header,
+	unsigned id,
+	void *context
+);
+
+/**
+ * \brief Requests and replies over the pollop* functions, matched
+ * 	up by an ID sent with each of them.
+ *
+ * Any number of calls may be outstanding on a connection at once.
+ * Each completes when its reply arrives, by calling the callback it
+ * was made with, whatever order the replies come in.
+ *
+ * Example usage:
+ *
+ * \code
+ * rpc *calls = open_rpc(on_request, on_message, &state);
+ * callop(calls, SRV_FILENO, OP_LOOKUP, key, key_len, on_found, &state);
+ * pollop(rpc_callback, calls, -1);
+ * \endcode
+ */
+typedef struct rpc rpc;
+
+/**
+ * \brief Creates an RPC layer with no outstanding calls.
+ *
+ * \param handler The callback for requests, or NULL to drop them,
+ * 	closing any file descriptors they carry.
+ * \param fallback The callback for ordinary messages, or NULL to
+ * 	drop them in the same way.
+ * \param context The context pointer to pass to both.
+ *
+ * \returns The new RPC layer, or NULL on allocation failure.
+ */
+rpc *open_rpc(rpc_request_callback *handler, pollop_callback *fallback, void *context);
+
+/**
+ * \brief Releases an RPC layer created with open_rpc().
+ *
+ * Outstanding calls are forgotten without calling their callbacks.
+ */
+void close_rpc(rpc *calls);
+
+/**
+ * \brief Sends a request to the file descriptor given in fd,
+ * 	without waiting for the reply.
+ *
+ * \param calls The RPC layer to match the reply up in.
+ * \param fd The file descriptor to send the request to.
+ * \param opcode The opcode of the request.
+ * \param buf The payload of the request.
+ * \param len The length of the payload.
+ * \param done The callback to call with the reply, which is passed
+ * 	the opcode and payload given to replyop().
+ * \param context The context pointer to pass to done.
+ *
+ * \returns 0 on success, or -1 on failure, in which case done is
+ * 	never called.
+ */
+int callop(
+	rpc *calls,
+	int fd,
+	int opcode,
+	const void *buf,
+	int len,
+	pollop_callback *done,
+	void *context
+);
+
+/**
+ * \brief Answers the request with the given ID, received from fd.
+ *
+ * \returns The number of bytes written, or -1 on failure.
+ */
+ssize_t replyop(int fd, unsigned id, int opcode, const void *buf, int len);
+
+/**
+ * \brief Completes every call outstanding on fd with RPC_CANCELLED,
+ * 	as when the connection has hung up.
+ *
+ * \returns The number of calls cancelled.
+ */
+int cancel_calls(rpc *calls, int fd);
+
+/**
+ * \brief A pollop_callback that completes calls with their replies,
+ * 	and passes requests and other messages on, for the rpc given
+ * 	as its context.
+ *
+ * While any RPC layer is open, requests and replies are passed to
+ * the callback a pollop* function was given, so this one may also be
+ * reached as an op_dispatcher's fallback, or from a callback that
+ * wraps it. Other callbacks should pass on or ignore reserved opcodes
+ * they don't know. It may be used with dispatchop(), and calls may be
+ * made from any thread.
+ */
+void rpc_callback(
+	int fd,
+	int opcode,
+	void *buf,
+	int len,
+	struct msghdr header,
+	void *context
+);
+
+/**
+ * \brief Enables buffered reads on the given file descriptor for
+ * 	the pollop* functions.
+ *
+ * By default, each message is read with one call for the header and
+ * another for the data, into memory allocated for that message. In
+ * buffered mode, each read fills a buffer kept for the file
+ * descriptor with as much data as is available, and the callback is
+ * called once for every complete message in it. The buf pointer passed
+ * to the callback points into this buffer, so it is only valid until
+ * the callback returns, and is not guaranteed to be aligned.
+ *
+ * Messages larger than the buffer grow it to fit.
+ *
+ * Ancillary data is passed to the callback for the message it was
+ * sent with, provided it was sent with sendmsgop().
+ *
+ * \param fd The file descriptor to buffer reads for.
+ * \param size The size of the buffer in bytes, or 0 to return
+ * 	to unbuffered reads.
+ *
+ * \returns 0 on success, or -1 on failure. Buffered mode can't be
+ * 	disabled while a partial message is buffered or from inside
+ * 	a callback for the file descriptor; in these cases, errno is
+ * 	set to EBUSY.
+ */
+int recvbufop(int fd, size_t size);
+
 /**
  * \brief Convenience function for closing all file descriptors
  * 	passed in ancillary data.
@@ -326,6 +1382,21 @@ void close_opcode_db(opcode_db *db);
  */
 int get_opcode(const opcode_db *db, const char *name);
 
+/**
+ * \brief Queries the database given in db for the name of the
+ * 	given opcode.
+ *
+ * \param db The database to query.
+ * \param opcode The opcode to query.
+ * \param name The buffer to write the name into, which is always
+ * 	null-terminated.
+ * \param len The size of the buffer.
+ *
+ * \returns The length of the name, as with snprintf(), or -1 if
+ * 	no name has the opcode.
+ */
+int get_opcode_name(const opcode_db *db, int opcode, char *name, size_t len);
+
 /**
  * \brief Initializes an array of struct pollfd for
  * 	the server and all currently-connected clients.
@@ -0,0 +1,80 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2025  Marcus Harrison
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRVSH_TRACE
+#define SRVSH_TRACE
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \file
+ *
+ * The format of the files written when SRVSH_TRACE is set, shared
+ * by libsrvsh and srvsh-trace. Each process maps its own file, named
+ * srvsh-<pid>.trace, and writes to it without locking: a
+ * struct trace_file, followed by a ring of capacity records.
+ */
+
+/**
+ * \brief "SRVT", read as a little-endian integer.
+ */
+#define TRACE_MAGIC 0x54565253u
+
+/**
+ * \brief Changes whenever the layout of the file does.
+ */
+#define TRACE_VERSION 1
+
+enum trace_direction {
+	TRACE_RECV,
+	TRACE_SEND,
+};
+
+struct trace_file {
+	uint32_t magic;
+	uint32_t version;
+	// records in the ring
+	uint64_t capacity;
+	// records ever claimed; record i is in slot i % capacity
+	_Atomic uint64_t head;
+	char padding[40];
+};
+
+struct trace_record {
+	// i + 1 for record i once it's written, 0 while it's written
+	_Atomic uint64_t sequence;
+	// CLOCK_MONOTONIC, in nanoseconds, which all processes share
+	uint64_t time;
+	uint64_t size;
+	int32_t pid;
+	int32_t fd;
+	int32_t opcode;
+	// enum trace_direction
+	int32_t direction;
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // SRVSH_TRACE
@@ -0,0 +1,187 @@
+#include "srvsh/srvsh.h"
+#include "srvsh/trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <locale.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// gettext placeholder
+#define _(str) str
+#define perror_exit(str) perror(str), exit(EXIT_FAILURE)
+
+struct event {
+	uint64_t time;
+	uint64_t size;
+	uint64_t index;
+	int32_t pid;
+	int32_t fd;
+	int32_t opcode;
+	int32_t direction;
+};
+
+static struct event *events = NULL;
+static size_t events_count = 0;
+static size_t events_size = 0;
+
+static void add_event(struct event event)
+{
+	if (events_count == events_size) {
+		events_size = events_size ? events_size * 2 : 1024;
+		events = realloc(events, events_size * sizeof(*events));
+		if (!events)
+			perror_exit(_("Failed to allocate events"));
+	}
+	events[events_count++] = event;
+}
+
+/*
+ * Copies the records still in the ring of a trace file. A record is
+ * skipped if its writer was interrupted, or lapped while it was read.
+ */
+static void read_trace(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return;
+	}
+
+	struct stat st = { 0 };
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct trace_file))
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, _("%s: Not a trace file\n"), path);
+		return;
+	}
+
+	struct trace_file *file = map;
+	const size_t available = ((size_t)st.st_size - sizeof(*file)) / sizeof(struct trace_record);
+	if (
+		file->magic != TRACE_MAGIC
+		|| file->version != TRACE_VERSION
+		|| file->capacity == 0
+		|| file->capacity > available
+	) {
+		fprintf(stderr, _("%s: Not a trace file\n"), path);
+		munmap(map, (size_t)st.st_size);
+		return;
+	}
+
+	struct trace_record *records = (struct trace_record *)(file + 1);
+	const uint64_t head = atomic_load_explicit(&file->head, memory_order_acquire);
+	const uint64_t first = head > file->capacity ? head - file->capacity : 0;
+	for (uint64_t index = first; index < head; index++) {
+		struct trace_record *record = &records[index % file->capacity];
+		if (atomic_load_explicit(&record->sequence, memory_order_acquire) != index + 1)
+			continue;
+		const struct event event = {
+			.time = record->time,
+			.size = record->size,
+			.index = index,
+			.pid = record->pid,
+			.fd = record->fd,
+			.opcode = record->opcode,
+			.direction = record->direction,
+		};
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&record->sequence, memory_order_relaxed) != index + 1)
+			continue;
+		add_event(event);
+	}
+	munmap(map, (size_t)st.st_size);
+}
+
+static void read_path(const char *path)
+{
+	struct stat st = { 0 };
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		read_trace(path);
+		return;
+	}
+
+	char pattern[PATH_MAX];
+	if (snprintf(pattern, sizeof(pattern), "%s/srvsh-*.trace", path) >= (int)sizeof(pattern))
+		return;
+	glob_t globs = { 0 };
+	if (glob(pattern, 0, NULL, &globs) == 0)
+		for (char **file = globs.gl_pathv; *file; file++)
+			read_trace(*file);
+	globfree(&globs);
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct event *left = a;
+	const struct event *right = b;
+	if (left->time != right->time)
+		return left->time < right->time ? -1 : 1;
+	if (left->pid != right->pid)
+		return left->pid < right->pid ? -1 : 1;
+	if (left->index != right->index)
+		return left->index < right->index ? -1 : 1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	setlocale(LC_ALL, "");
+	const char *database = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		if (opt != 'd')
+			goto usage;
+		database = optarg;
+	}
+	if (optind == argc)
+		goto usage;
+
+	for (int arg = optind; arg < argc; arg++)
+		read_path(argv[arg]);
+
+	qsort(events, events_count, sizeof(*events), compare_events);
+
+	opcode_db *db = database ? open_opcode_db_at(database) : open_opcode_db();
+	char name[256];
+	const uint64_t start = events_count ? events[0].time : 0;
+	printf("%-16s %8s %6s %-4s %-24s %12s\n", "time", "pid", "fd", "dir", "opcode", "size");
+	for (size_t i = 0; i < events_count; i++) {
+		const struct event *event = &events[i];
+		if (get_opcode_name(db, event->opcode, name, sizeof(name)) < 0)
+			snprintf(name, sizeof(name), "%d", (int)event->opcode);
+		const uint64_t elapsed = event->time - start;
+		printf(
+			"%6llu.%09llu %8d %6d %-4s %-24s %12llu\n",
+			(unsigned long long)(elapsed / 1000000000),
+			(unsigned long long)(elapsed % 1000000000),
+			(int)event->pid,
+			(int)event->fd,
+			event->direction == TRACE_SEND ? "send" : "recv",
+			name,
+			(unsigned long long)event->size
+		);
+	}
+	close_opcode_db(db);
+	free(events);
+	return EXIT_SUCCESS;
+
+usage:
+	fprintf(
+		stderr,
+		_("Usage: %s [-d opcode-database] <trace-file-or-directory>...\n"),
+		basename(argv[0])
+	);
+	return EXIT_FAILURE;
+}
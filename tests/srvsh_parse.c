@@ -0,0 +1,175 @@
+/*
+ * srvsh - A server/client shell script interpreter
+ * Copyright (C) 2025  Marcus Harrison
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "srvsh.h"
+#include "parse.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+// The socket type SRVSH_SOCKET_TYPE asks for
+int expected_type(void)
+{
+	const char *value = getenv("SRVSH_SOCKET_TYPE");
+	return value && strcmp(value, "seqpacket") == 0 ?
+		SOCK_SEQPACKET :
+		SOCK_STREAM;
+}
+
+int socket_type(int fd)
+{
+	int type = -1;
+	socklen_t length = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0)
+		return -1;
+	return type;
+}
+
+// Succeeds if the variable has the value, or is unset for "-"
+int probe_env(const char *name, const char *expected)
+{
+	const char *value = getenv(name);
+	if (strcmp(expected, "-") == 0)
+		return value != NULL;
+	return !value || strcmp(value, expected) != 0;
+}
+
+int probe_client(void)
+{
+	return socket_type(SRV_FILENO) != expected_type();
+}
+
+int probe_server(int expected_clients)
+{
+	if (cli_count() != expected_clients)
+		return 1;
+	for (int fd = CLI_BEGIN; fd < CLI_BEGIN + expected_clients; fd++)
+		if (socket_type(fd) != expected_type())
+			return 1;
+	return 0;
+}
+
+// Runs a script, returning the worst exit status of what it started
+int run_script(const char *script)
+{
+	const struct libadt_const_lptr file = {
+		.buffer = script,
+		.size = 1,
+		.length = (ssize_t)strlen(script),
+	};
+	if (srvsh_parse_script(file) < 0)
+		return -1;
+
+	int worst_exit = 0;
+	int wstatus = 0;
+	while (wait(&wstatus) > 0) {
+		assert(WIFEXITED(wstatus));
+		if (WEXITSTATUS(wstatus) > worst_exit)
+			worst_exit = WEXITSTATUS(wstatus);
+	}
+	assert(errno == ECHILD);
+	return worst_exit;
+}
+
+void test_command_assignment(void)
+{
+	// only for the command they come before
+	assert(run_script(
+		"PARSE_TEST=value /proc/self/exe env PARSE_TEST value\n"
+		"/proc/self/exe env PARSE_TEST -\n"
+	) == 0);
+	assert(!getenv("PARSE_TEST"));
+
+	// which the probe really does check
+	assert(run_script(
+		"PARSE_TEST=value /proc/self/exe env PARSE_TEST other\n"
+	) == 1);
+
+	// several of them, where the last one wins
+	assert(run_script(
+		"PARSE_TEST=1 OTHER_TEST=2 PARSE_TEST=3 /proc/self/exe env PARSE_TEST 3\n"
+		"PARSE_TEST=1 OTHER_TEST=2 /proc/self/exe env OTHER_TEST 2\n"
+	) == 0);
+
+	// an argument that looks like one is just an argument
+	assert(run_script(
+		"/proc/self/exe env PARSE_TEST=value -\n"
+	) == 0);
+}
+
+void test_server_assignment(void)
+{
+	// for the server and everything in its block, however deep
+	assert(run_script(
+		"SRVSH_SOCKET_TYPE=seqpacket /proc/self/exe server 3 {\n"
+		"	/proc/self/exe client\n"
+		"	/proc/self/exe env SRVSH_SOCKET_TYPE seqpacket\n"
+		"	/proc/self/exe server 1 {\n"
+		"		/proc/self/exe client\n"
+		"	}\n"
+		"}\n"
+		"/proc/self/exe server 1 {\n"
+		"	/proc/self/exe client\n"
+		"}\n"
+		"/proc/self/exe env SRVSH_SOCKET_TYPE -\n"
+	) == 0);
+	assert(!getenv("SRVSH_SOCKET_TYPE"));
+
+	// a block needs a server to run it
+	assert(run_script(
+		"PARSE_TEST=value {\n"
+		"	/proc/self/exe client\n"
+		"}\n"
+	) == -1);
+}
+
+void test_bare_assignment(void)
+{
+	// for the statements after them, in this block only
+	assert(run_script(
+		"/proc/self/exe server 2 {\n"
+		"	PARSE_TEST=inner\n"
+		"	/proc/self/exe env PARSE_TEST inner\n"
+		"	/proc/self/exe env PARSE_TEST inner\n"
+		"}\n"
+		"/proc/self/exe env PARSE_TEST -\n"
+		"PARSE_TEST=outer\n"
+		"/proc/self/exe env PARSE_TEST outer\n"
+	) == 0);
+	assert(strcmp(getenv("PARSE_TEST"), "outer") == 0);
+	assert(unsetenv("PARSE_TEST") == 0);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 3 && strcmp(argv[1], "env") == 0)
+		return probe_env(argv[2], argv[3]);
+	if (argc > 1 && strcmp(argv[1], "client") == 0)
+		return probe_client();
+	if (argc > 2 && strcmp(argv[1], "server") == 0)
+		return probe_server(atoi(argv[2]));
+
+	test_command_assignment();
+	test_server_assignment();
+	test_bare_assignment();
+}
@@ -17,11 +17,24 @@
  */
 
 #include "srvsh.h"
+#include "trace.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#ifdef SRVSH_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 int
 	server = SRV_FILENO,
@@ -69,6 +82,48 @@ void test_writeop(void)
 	assert(buffer.payload == 2);
 }
 
+void test_writeopv(void)
+{
+	struct {
+		int first;
+		short second;
+	} fixed = { 1, 2 };
+	char blob[] = "blob";
+	int trailer = 3;
+	struct iovec iov[] = {
+		{ .iov_base = &fixed, .iov_len = sizeof(fixed) },
+		{ .iov_base = NULL, .iov_len = 0 },
+		{ .iov_base = blob, .iov_len = sizeof(blob) },
+		{ .iov_base = &trailer, .iov_len = sizeof(trailer) },
+	};
+	const int size = sizeof(fixed) + sizeof(blob) + sizeof(trailer);
+
+	ssize_t result = writeopv(client, 4, iov, 4);
+	assert(result == sizeof(struct srvsh_header) + size);
+
+	char buffer[sizeof(struct srvsh_header) + size];
+	assert(read(server, buffer, sizeof(buffer)) == result);
+	struct srvsh_header header = { 0 };
+	memcpy(&header, buffer, sizeof(header));
+	assert(header.opcode == 4);
+	assert(header.size == size);
+
+	char *payload = buffer + sizeof(header);
+	assert(memcmp(payload, &fixed, sizeof(fixed)) == 0);
+	assert(memcmp(payload + sizeof(fixed), blob, sizeof(blob)) == 0);
+	assert(memcmp(payload + sizeof(fixed) + sizeof(blob), &trailer, sizeof(trailer)) == 0);
+
+	// an empty message
+	assert(writeopv(client, 5, NULL, 0) == sizeof(struct srvsh_header));
+	assert(read(server, &header, sizeof(header)) == sizeof(header));
+	assert(header.opcode == 5 && header.size == 0);
+
+	errno = 0;
+	assert(writeopv(client, 6, iov, -1) == -1 && errno == EINVAL);
+	errno = 0;
+	assert(writeopv(client, 6, iov, (int)sysconf(_SC_IOV_MAX)) == -1 && errno == EINVAL);
+}
+
 void test_sendmsgop(void)
 {
 	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -182,8 +237,2138 @@ void test_pollopfds(void)
 	assert(callback_run == true);
 }
 
-int main()
+int buffered_calls = 0;
+int buffered_fd = -1;
+
+void test_recvbufop_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	assert(fd == client);
+	assert(opcode == buffered_calls);
+
+	int expected[64] = { 0 };
+	for (int i = 0; i < 64; i++)
+		expected[i] = opcode * 10 + i;
+
+	if (opcode == 3) {
+		assert(size == sizeof(expected));
+		assert(memcmp(data, expected, sizeof(expected)) == 0);
+	} else {
+		assert(size == sizeof(int));
+		assert(memcmp(data, expected, sizeof(int)) == 0);
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+	if (opcode == 1) {
+		assert(cmsg);
+		assert(cmsg->cmsg_type == SCM_RIGHTS);
+		memcpy(&buffered_fd, CMSG_DATA(cmsg), sizeof(int));
+	} else {
+		assert(!cmsg);
+	}
+
+	buffered_calls++;
+}
+
+void test_recvbufop(void)
+{
+	assert(recvbufop(client, 64) == 0);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(sock >= 0);
+
+	union {
+		char buf[CMSG_SPACE(sizeof(sock))];
+		struct cmsghdr align;
+	} buf = { 0 };
+	buf.align.cmsg_level = SOL_SOCKET;
+	buf.align.cmsg_type = SCM_RIGHTS;
+	buf.align.cmsg_len = CMSG_LEN(sizeof(sock));
+	memcpy(CMSG_DATA(&buf.align), &sock, sizeof(sock));
+
+	// larger than the buffer, so it has to grow
+	int large[64] = { 0 };
+	for (int i = 0; i < 64; i++)
+		large[i] = 30 + i;
+
+	writesrv(0, &(int){ 0 }, sizeof(int));
+	sendmsgop(server, 1, &(int){ 10 }, sizeof(int), &buf, sizeof(buf));
+	writesrv(2, &(int){ 20 }, sizeof(int));
+	writesrv(3, large, sizeof(large));
+	close(sock);
+
+	buffered_calls = 0;
+	struct pollfd fd = {.fd = client};
+	while (buffered_calls < 4)
+		pollopfd(fd, test_recvbufop_callback, NULL, -1);
+
+	assert(buffered_calls == 4);
+	assert(buffered_fd >= 0);
+	assert(close(buffered_fd) == 0);
+
+	assert(recvbufop(client, 0) == 0);
+	test_pollopfd();
+}
+
+bool spawn_nothing(void *context)
+{
+	return true;
+}
+
+void test_corkop(void)
+{
+	assert(corkop(server, 64, -1) == 0);
+
+	for (int i = 0; i < 3; i++)
+		assert(writesrv(i, &i, sizeof(i)) == sizeof(struct srvsh_header) + sizeof(i));
+
+	struct pollfd fd = {.fd = client, .events = POLLIN};
+	assert(poll(&fd, 1, 0) == 0);
+
+	assert(flushop(server) == 3 * (sizeof(struct srvsh_header) + sizeof(int)));
+
+	struct {
+		struct srvsh_header header;
+		int payload;
+	} buffer[3] = { 0 };
+	assert(read(client, buffer, sizeof(buffer)) == sizeof(buffer));
+	for (int i = 0; i < 3; i++) {
+		assert(buffer[i].header.opcode == i);
+		assert(buffer[i].payload == i);
+	}
+
+	// with no delay, the next pollop call sends it
+	assert(corkop(server, 64, 0) == 0);
+	callback_run = false;
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	pollopfd((struct pollfd){.fd = client}, test_pollop_callback, &client, 0);
+	assert(callback_run == true);
+
+	// poll wakes up to flush once the delay passes
+	assert(corkop(server, 64, 10) == 0);
+	callback_run = false;
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	pollopfd((struct pollfd){.fd = client}, test_pollop_callback, &client, -1);
+	assert(callback_run == true);
+
+	// a forked child leaves what we've corked for us to send
+	assert(corkop(server, 64, -1) == 0);
+	assert(writesrv(42, "stale", 5) == sizeof(struct srvsh_header) + 5);
+	struct clistate child = srvexecl(spawn_nothing, NULL, "/bin/true", "/bin/true", NULL);
+	assert(child.socket >= 0);
+	assert(waitpid(child.pid, NULL, 0) == child.pid);
+	char stale[sizeof(struct srvsh_header) + 5];
+	assert(recv(child.socket, stale, sizeof(stale), MSG_DONTWAIT) == 0);
+	close(child.socket);
+	assert(flushop(server) == sizeof(stale));
+	assert(read(client, stale, sizeof(stale)) == sizeof(stale));
+
+	assert(corkop(server, 0, 0) == 0);
+	test_writesrv();
+}
+
+int counted_calls = 0;
+
+void test_counting_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	test_pollop_callback(fd, opcode, data, size, header, context);
+	counted_calls++;
+}
+
+// What POLLOP_IO_URING should end up as, going by the build and kernel
+enum pollop_backend expected_uring_backend(void)
+{
+#ifdef SRVSH_IO_URING
+	struct io_uring_params params = { 0 };
+	int fd = (int)syscall(__NR_io_uring_setup, 8, &params);
+	if (fd < 0)
+		return POLLOP_POLL;
+	close(fd);
+	return params.features & IORING_FEAT_EXT_ARG ?
+		POLLOP_IO_URING :
+		POLLOP_POLL;
+#else
+	return POLLOP_POLL;
+#endif
+}
+
+void test_set_pollop_backend(void)
+{
+	assert(set_pollop_backend(POLLOP_EPOLL) == 0);
+	assert(get_pollop_backend() == POLLOP_EPOLL);
+	test_pollop();
+
+	assert(set_pollop_backend(POLLOP_EPOLL_EDGE) == 0);
+	assert(get_pollop_backend() == POLLOP_EPOLL_EDGE);
+	counted_calls = 0;
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	pollop(test_counting_callback, &client, -1);
+	assert(counted_calls == 2);
+
+	// falls back to poll when io_uring isn't available
+	assert(set_pollop_backend(POLLOP_IO_URING) == 0);
+	assert(get_pollop_backend() == expected_uring_backend());
+	counted_calls = 0;
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	while (counted_calls < 2)
+		pollop(test_counting_callback, &client, -1);
+	assert(counted_calls == 2);
+
+	assert(corkop(server, 64, 0) == 0);
+	test_pollop();
+	assert(corkop(server, 0, 0) == 0);
+
+	assert(set_pollop_backend(POLLOP_POLL) == 0);
+	assert(get_pollop_backend() == POLLOP_POLL);
+	test_pollop();
+}
+
+// A frame that arrives in pieces is delivered once it's all there,
+// without pollop() waiting for the rest in the meantime
+void test_pollop_partial_frame(void)
+{
+	const enum pollop_backend backends[] = { POLLOP_POLL, POLLOP_EPOLL, POLLOP_EPOLL_EDGE };
+	const struct srvsh_header header = { .opcode = 5, .size = sizeof(int) };
+	char frame[sizeof(header) + sizeof(int)];
+	memcpy(frame, &header, sizeof(header));
+	memcpy(frame + sizeof(header), &(int){ 6 }, sizeof(int));
+
+	for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+		assert(set_pollop_backend(backends[i]) == 0);
+		callback_run = false;
+
+		// half a header, then the rest of it with half the body
+		assert(write(server, frame, 4) == 4);
+		pollop(test_pollop_callback, &client, 0);
+		assert(write(server, frame + 4, 6) == 6);
+		pollop(test_pollop_callback, &client, 0);
+		assert(!callback_run);
+
+		assert(write(server, frame + 10, 2) == 2);
+		while (!callback_run)
+			pollop(test_pollop_callback, &client, -1);
+	}
+
+	// and frames that arrive whole still do
+	test_pollop();
+}
+
+void test_set_pollop_budget(void)
+{
+	assert(set_pollop_budget(-1) == -1);
+	assert(set_pollop_budget(4) == 0);
+
+	counted_calls = 0;
+	for (int i = 0; i < 3; i++)
+		writesrv(5, &(int){ 6 }, sizeof(int));
+	pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, -1);
+	assert(counted_calls == 3);
+
+	// hangups don't stop other fds being processed, whichever
+	// one the rotation starts from
+	for (int i = 0; i < 2; i++) {
+		int sockets[2] = { 0 };
+		assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+		close(sockets[1]);
+
+		counted_calls = 0;
+		writesrv(5, &(int){ 6 }, sizeof(int));
+		writesrv(5, &(int){ 6 }, sizeof(int));
+		struct pollfd fds[2] = {
+			{.fd = sockets[0], .events = POLLIN},
+			{.fd = client, .events = POLLIN},
+		};
+		struct pollfd result = pollopfds(fds, 2, test_counting_callback, &client, -1);
+		assert(counted_calls == 2);
+		assert(fds[0].fd == ~sockets[0]);
+		assert(result.fd == sockets[0]);
+		assert(result.revents & POLLHUP);
+		close(sockets[0]);
+	}
+
+	assert(set_pollop_backend(POLLOP_EPOLL) == 0);
+	counted_calls = 0;
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	pollop(test_counting_callback, &client, -1);
+	assert(counted_calls == 2);
+
+	assert(set_pollop_backend(POLLOP_POLL) == 0);
+	assert(set_pollop_budget(0) == 0);
+}
+
+void test_dispatchop(void)
+{
+	// dispatchop() runs until the clients hang up, so give it a
+	// connection of its own
+	int saved_server = dup(server);
+	int saved_client = dup(client);
+	int sockets[2] = { 0 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+	assert(dup2(sockets[0], server) == server);
+	assert(dup2(sockets[1], client) == client);
+	close(sockets[0]);
+	close(sockets[1]);
+
+	counted_calls = 0;
+	for (int i = 0; i < 3; i++)
+		writesrv(5, &(int){ 6 }, sizeof(int));
+	close(server);
+	struct traffic_stats before = { 0 };
+	struct traffic_stats after = { 0 };
+	get_traffic_stats(client, &before);
+	assert(dispatchop(2, test_counting_callback, &client) == 0);
+	assert(counted_calls == 3);
+
+	// the workers count what they read
+	get_traffic_stats(client, &after);
+	assert(after.messages_in == before.messages_in + 3);
+	assert(after.hangups == before.hangups + 1);
+
+	assert(dup2(saved_server, server) == server);
+	assert(dup2(saved_client, client) == client);
+	close(saved_server);
+	close(saved_client);
+}
+
+int fallback_calls = 0;
+
+void test_fallback_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	assert(opcode == 7 || opcode == 100);
+	assert(context == &fallback_calls);
+	fallback_calls++;
+}
+
+void test_op_dispatcher(void)
+{
+	op_dispatcher *dispatcher = open_op_dispatcher(
+		test_fallback_callback,
+		&fallback_calls
+	);
+	assert(dispatcher);
+	assert(set_op_handler(dispatcher, -1, test_counting_callback, &client) == -1);
+	assert(set_op_handler(dispatcher, 5, test_counting_callback, &client) == 0);
+
+	counted_calls = 0;
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	writesrv(7, &(int){ 6 }, sizeof(int));
+	while (counted_calls + fallback_calls < 2)
+		pollopfd((struct pollfd){.fd = client}, op_dispatcher_callback, dispatcher, -1);
+	assert(counted_calls == 1);
+	assert(fallback_calls == 1);
+
+	// per-connection handlers come first
+	callback_run = false;
+	assert(set_fd_op_handler(dispatcher, client, 5, test_pollop_callback, &client) == 0);
+	writesrv(5, &(int){ 6 }, sizeof(int));
+	pollopfd((struct pollfd){.fd = client}, op_dispatcher_callback, dispatcher, -1);
+	assert(callback_run == true);
+	assert(counted_calls == 1);
+
+	assert(op_dispatch_count(dispatcher, 5) == 2);
+	assert(op_dispatch_count(dispatcher, 7) == 0);
+
+	// past the end of the table, but still counted as a fallback
+	writesrv(100, &(int){ 6 }, sizeof(int));
+	while (fallback_calls < 2)
+		pollopfd((struct pollfd){.fd = client}, op_dispatcher_callback, dispatcher, -1);
+	assert(op_dispatch_count(dispatcher, 100) == 0);
+	assert(op_fallback_count(dispatcher) == 2);
+	close_op_dispatcher(dispatcher);
+}
+
+void test_tally_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	(*(int *)context)++;
+}
+
+// Sets an override on one end of a new pair, then lets it go either
+// by hanging up or with closeop(), and puts a new pair at its numbers
+void test_dispatch_reuse(op_dispatcher *dispatcher, int pair[2], bool hang_up)
+{
+	static int override_calls = 0;
+	override_calls = 0;
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	assert(set_fd_op_handler(dispatcher, pair[1], 5, test_tally_callback, &override_calls) == 0);
+	assert(writeop(pair[0], 5, "", 0) == sizeof(struct srvsh_header));
+	pollopfd((struct pollfd){.fd = pair[1]}, op_dispatcher_callback, dispatcher, -1);
+	assert(override_calls == 1);
+
+	const int numbers[2] = { pair[0], pair[1] };
+	if (hang_up) {
+		close(pair[0]);
+		struct pollfd result = pollopfd((struct pollfd){.fd = pair[1]}, op_dispatcher_callback, dispatcher, -1);
+		assert(result.revents & POLLHUP);
+		close(pair[1]);
+	} else {
+		closeop(pair[0]);
+		closeop(pair[1]);
+	}
+
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	assert(pair[0] == numbers[0] && pair[1] == numbers[1]);
+}
+
+// A new connection doesn't inherit the overrides of an old one
+void test_op_dispatcher_reuse(void)
+{
+	int shared_calls = 0;
+	op_dispatcher *dispatcher = open_op_dispatcher(NULL, NULL);
+	assert(dispatcher);
+	assert(set_op_handler(dispatcher, 5, test_tally_callback, &shared_calls) == 0);
+
+	for (int hang_up = 0; hang_up < 2; hang_up++) {
+		int pair[2] = { -1, -1 };
+		test_dispatch_reuse(dispatcher, pair, hang_up);
+
+		shared_calls = 0;
+		assert(writeop(pair[0], 5, "", 0) == sizeof(struct srvsh_header));
+		pollopfd((struct pollfd){.fd = pair[1]}, op_dispatcher_callback, dispatcher, -1);
+		assert(shared_calls == 1);
+
+		closeop(pair[0]);
+		closeop(pair[1]);
+	}
+	close_op_dispatcher(dispatcher);
+}
+
+unsigned rpc_ids[64] = { 0 };
+int rpc_requests = 0;
+
+void test_rpc_request(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	unsigned id,
+	void *context
+)
+{
+	assert(fd == server);
+	assert(opcode == 20);
+	assert(size == sizeof(int));
+	assert(*(int *)data == rpc_requests);
+	rpc_ids[rpc_requests++] = id;
+}
+
+struct rpc_result {
+	int opcode;
+	int value;
+	int order;
+};
+
+int rpc_completions = 0;
+
+void test_rpc_done(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	struct rpc_result *result = context;
+	assert(fd == client);
+	result->opcode = opcode;
+	result->value = size == sizeof(int) ? *(int *)data : -1;
+	result->order = rpc_completions++;
+}
+
+int wrapped_calls = 0;
+
+void test_rpc_wrapper(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	wrapped_calls++;
+	rpc_callback(fd, opcode, data, size, header, context);
+}
+
+void test_rpc(void)
+{
+	rpc *calls = open_rpc(NULL, test_fallback_callback, &fallback_calls);
+	rpc *served = open_rpc(test_rpc_request, NULL, NULL);
+	assert(calls && served);
+
+	// several calls go out before any reply comes back
+	struct rpc_result results[3] = { 0 };
+	for (int i = 0; i < 3; i++)
+		assert(callop(calls, client, 20, &i, sizeof(i), test_rpc_done, &results[i]) == 0);
+
+	rpc_requests = 0;
+	while (rpc_requests < 3)
+		pollopfd((struct pollfd){.fd = server}, rpc_callback, served, -1);
+
+	// and the replies come back in reverse
+	for (int i = 2; i >= 0; i--) {
+		int value = 100 + i;
+		assert(replyop(server, rpc_ids[i], 21, &value, sizeof(value)) > 0);
+	}
+
+	rpc_completions = 0;
+	while (rpc_completions < 3)
+		pollopfd((struct pollfd){.fd = client}, rpc_callback, calls, -1);
+	for (int i = 0; i < 3; i++) {
+		assert(results[i].opcode == 21);
+		assert(results[i].value == 100 + i);
+		assert(results[i].order == 2 - i);
+	}
+
+	// other messages go to the fallback
+	fallback_calls = 0;
+	writesrv(7, &(int){ 6 }, sizeof(int));
+	pollopfd((struct pollfd){.fd = client}, rpc_callback, calls, -1);
+	assert(fallback_calls == 1);
+
+	// a cancelled call doesn't complete again when its reply comes
+	rpc_completions = 0;
+	assert(callop(calls, client, 20, &(int){ 0 }, sizeof(int), test_rpc_done, &results[0]) == 0);
+	assert(cancel_calls(calls, client) == 1);
+	assert(rpc_completions == 1);
+	assert(results[0].opcode == RPC_CANCELLED);
+	assert(cancel_calls(calls, client) == 0);
+
+	rpc_requests = 0;
+	pollopfd((struct pollfd){.fd = server}, rpc_callback, served, -1);
+	assert(rpc_requests == 1);
+	assert(replyop(server, rpc_ids[0], 21, NULL, 0) > 0);
+	pollopfd((struct pollfd){.fd = client}, rpc_callback, calls, -1);
+	assert(rpc_completions == 1);
+
+	// rpc_callback() may be a dispatcher's fallback
+	op_dispatcher *dispatcher = open_op_dispatcher(rpc_callback, served);
+	assert(dispatcher);
+	rpc_requests = 0;
+	assert(callop(calls, client, 20, &(int){ 0 }, sizeof(int), test_rpc_done, &results[0]) == 0);
+	pollopfd((struct pollfd){.fd = server}, op_dispatcher_callback, dispatcher, -1);
+	assert(rpc_requests == 1);
+	close_op_dispatcher(dispatcher);
+
+	// or be called from another callback
+	rpc_completions = 0;
+	assert(replyop(server, rpc_ids[0], 21, NULL, 0) > 0);
+	wrapped_calls = 0;
+	pollopfd((struct pollfd){.fd = client}, test_rpc_wrapper, calls, -1);
+	assert(wrapped_calls == 1);
+	assert(rpc_completions == 1);
+
+	// many outstanding at once
+	int sockets[2] = { 0 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+	for (int i = 0; i < 200; i++)
+		assert(callop(calls, sockets[0], 20, &i, sizeof(i), NULL, NULL) == 0);
+	assert(cancel_calls(calls, sockets[0]) == 200);
+	close(sockets[0]);
+	close(sockets[1]);
+
+	// and many rounds of them, answered out of order
+	struct rpc_result round[64] = { 0 };
+	for (int r = 0; r < 200; r++) {
+		for (int i = 0; i < 64; i++)
+			assert(callop(calls, client, 20, &i, sizeof(i), test_rpc_done, &round[i]) == 0);
+
+		rpc_requests = 0;
+		while (rpc_requests < 64)
+			pollopfd((struct pollfd){.fd = server}, rpc_callback, served, -1);
+		for (int i = 0; i < 64; i++) {
+			int value = (i * 37 + r) % 64;
+			assert(replyop(server, rpc_ids[value], 21, &value, sizeof(value)) > 0);
+		}
+
+		rpc_completions = 0;
+		while (rpc_completions < 64)
+			pollopfd((struct pollfd){.fd = client}, rpc_callback, calls, -1);
+		for (int i = 0; i < 64; i++)
+			assert(round[i].value == i);
+	}
+	assert(cancel_calls(calls, client) == 0);
+
+	close_rpc(calls);
+	close_rpc(served);
+}
+
+bool echo_done = false;
+
+void echo_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	if (opcode == 0) {
+		echo_done = true;
+		return;
+	}
+
+	// reply to file descriptors with how many there were
+	if (header.msg_controllen) {
+		int count = 0;
+		for (
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+			cmsg;
+			cmsg = CMSG_NXTHDR(&header, cmsg)
+		)
+			count++;
+		close_cmsg_fds(header);
+		writesrv(opcode, &count, sizeof(count));
+		return;
+	}
+
+	writesrv(opcode, data, size);
+}
+
+int test_socket_type(int fd)
+{
+	int type = -1;
+	socklen_t length = sizeof(type);
+	assert(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) == 0);
+	return type;
+}
+
+int echo(void)
+{
+	while (!echo_done)
+		if (pollopsrv(echo_callback, NULL, -1).fd < 0)
+			return 1;
+
+	// this end has to have been set up as asked, too
+	const char *type = getenv("SRVSH_SOCKET_TYPE");
+	if (getenv("SRVSH_SHM_RING") && !is_shm(SRV_FILENO))
+		return 1;
+	if (type && strcmp(type, "seqpacket") == 0)
+		return test_socket_type(SRV_FILENO) != SOCK_SEQPACKET;
+	return 0;
+}
+
+bool bulk_received = false;
+
+void test_sendbulkop_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	const char *expected = context;
+	assert(fd == client);
+	assert(opcode == 8);
+	assert(size == 1 << 20);
+	assert(memcmp(data, expected, size) == 0);
+
+	// the memfd comes with the message, and is closed the usual way
+	assert(CMSG_FIRSTHDR(&header));
+	close_cmsg_fds(header);
+	bulk_received = true;
+}
+
+void test_sendbulkop(void)
 {
+	char *payload = malloc(1 << 20);
+	assert(payload);
+	for (int i = 0; i < 1 << 20; i++)
+		payload[i] = (char)i;
+
+	assert(sendbulkop(server, 8, payload, 1 << 20) > 0);
+
+	bulk_received = false;
+	struct pollfd fd = {.fd = client};
+	while (!bulk_received)
+		pollopfd(fd, test_sendbulkop_callback, payload, -1);
+	free(payload);
+}
+
+int queued_next = 0;
+int queued_cmsg_at = -1;
+int queued_fd = -1;
+
+void test_nonblockop_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	assert(opcode == 9);
+	assert(size == 1024);
+
+	int sequence = -1;
+	memcpy(&sequence, data, sizeof(sequence));
+	assert(sequence == queued_next);
+
+	if (header.msg_controllen) {
+		assert(sequence == queued_cmsg_at);
+		memcpy(&queued_fd, CMSG_DATA(CMSG_FIRSTHDR(&header)), sizeof(int));
+	}
+	queued_next++;
+}
+
+void test_nonblockop(void)
+{
+	int sockets[2] = { -1, -1 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+	assert(nonblockop(sockets[0], 1 << 16) == 0);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(sock >= 0);
+	union {
+		char buf[CMSG_SPACE(sizeof(sock))];
+		struct cmsghdr align;
+	} buf = { 0 };
+	buf.align.cmsg_level = SOL_SOCKET;
+	buf.align.cmsg_type = SCM_RIGHTS;
+	buf.align.cmsg_len = CMSG_LEN(sizeof(sock));
+	memcpy(CMSG_DATA(&buf.align), &sock, sizeof(sock));
+
+	// nobody is reading, so a blocking write would stall long
+	// before the limit is reached
+	char payload[1024] = { 0 };
+	int sent = 0;
+	for (;; sent++) {
+		memcpy(payload, &sent, sizeof(sent));
+
+		ssize_t result = 0;
+		if (queuedop(sockets[0]) && queued_cmsg_at < 0) {
+			queued_cmsg_at = sent;
+			result = sendmsgop(sockets[0], 9, payload, sizeof(payload), &buf, sizeof(buf));
+			close(sock);
+		} else {
+			result = writeop(sockets[0], 9, payload, sizeof(payload));
+		}
+
+		if (result < 0) {
+			assert(errno == EAGAIN);
+			break;
+		}
+	}
+	assert(queuedop(sockets[0]) > 1 << 16);
+
+	// what's corked stays corked while the queue is full
+	assert(corkop(sockets[0], 4096, -1) == 0);
+	memcpy(payload, &sent, sizeof(sent));
+	assert(writeop(sockets[0], 9, payload, sizeof(payload)) > 0);
+	assert(flushop(sockets[0]) == -1 && errno == EAGAIN);
+
+	// Reading the other end lets the queue drain. The reader has to
+	// be buffered, or it would wait for the rest of a message that's
+	// still queued in this process
+	assert(recvbufop(sockets[1], 4096) == 0);
+	struct pollfd fd = {.fd = sockets[1]};
+	while (queued_next < sent)
+		pollopfd(fd, test_nonblockop_callback, NULL, -1);
+	assert(queuedop(sockets[0]) == 0);
+	assert(queued_fd >= 0);
+	assert(close(queued_fd) == 0);
+
+	assert(flushop(sockets[0]) > 0);
+	while (queued_next <= sent)
+		pollopfd(fd, test_nonblockop_callback, NULL, -1);
+	assert(corkop(sockets[0], 0, 0) == 0);
+
+	assert(nonblockop(sockets[0], 0) == 0);
+	assert(recvbufop(sockets[1], 0) == 0);
+	closeop(sockets[0]);
+	closeop(sockets[1]);
+}
+
+char record_frame[100000];
+
+void test_nonblockop_records_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	assert(opcode == 10);
+	assert(size == sizeof(record_frame));
+	assert(memcmp(data, record_frame, size) == 0);
+	counted_calls++;
+}
+
+// A frame split across records is queued whole, or not at all
+void test_nonblockop_records(void)
+{
+	int sockets[2] = { -1, -1 };
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets) == 0);
+	// less than a record, so the limit is passed partway through a frame
+	assert(nonblockop(sockets[0], 1 << 12) == 0);
+	for (size_t i = 0; i < sizeof(record_frame); i++)
+		record_frame[i] = (char)i;
+
+	int sent = 0;
+	while (writeop(sockets[0], 10, record_frame, sizeof(record_frame)) > 0)
+		sent++;
+	assert(errno == EAGAIN);
+
+	counted_calls = 0;
+	struct pollfd fd = {.fd = sockets[1]};
+	while (counted_calls < sent)
+		pollopfd(fd, test_nonblockop_records_callback, NULL, -1);
+	assert(queuedop(sockets[0]) == 0);
+
+	// with nothing of a frame left behind
+	char byte = 0;
+	assert(recv(sockets[1], &byte, 1, MSG_DONTWAIT) == -1 && errno == EAGAIN);
+
+	assert(nonblockop(sockets[0], 0) == 0);
+	closeop(sockets[0]);
+	closeop(sockets[1]);
+}
+
+int echo_replies = 0;
+int echo_opcodes[2] = { 0 };
+int echo_size = -1;
+char *echo_data = NULL;
+
+void test_echo_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	// a single poll can pass on several messages from the ring
+	echo_opcodes[echo_replies++ % 2] = opcode;
+	echo_size = size;
+	echo_data = realloc(echo_data, size);
+	memcpy(echo_data, data, size);
+}
+
+void test_echo_wait(int fd, int replies)
+{
+	echo_replies = 0;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while (echo_replies < replies)
+		pollopfd(pfd, test_echo_callback, NULL, -1);
+	assert(echo_replies == replies);
+}
+
+void test_echo_roundtrip(int fd, int opcode, void *data, int size)
+{
+	assert(writeop(fd, opcode, data, size) == sizeof(struct srvsh_header) + size);
+	test_echo_wait(fd, 1);
+	assert(echo_opcodes[0] == opcode);
+	assert(echo_size == size);
+	assert(memcmp(echo_data, data, size) == 0);
+}
+
+struct clistate spawn_echo(const char *name, const char *value)
+{
+	assert(setenv(name, value, 1) == 0);
+	struct clistate child = cliexecl(
+		"/proc/self/exe",
+		"/proc/self/exe",
+		"echo",
+		NULL
+	);
+	assert(unsetenv(name) == 0);
+	assert(child.socket >= 0);
+	return child;
+}
+
+void stop_echo(struct clistate child)
+{
+	writeop(child.socket, 0, NULL, 0);
+	int status = -1;
+	assert(waitpid(child.pid, &status, 0) == child.pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	closeop(child.socket);
+}
+
+void test_echo_cmsg(int fd)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	assert(sock >= 0);
+	union {
+		char buf[CMSG_SPACE(sizeof(sock))];
+		struct cmsghdr align;
+	} buf = { 0 };
+	buf.align.cmsg_level = SOL_SOCKET;
+	buf.align.cmsg_type = SCM_RIGHTS;
+	buf.align.cmsg_len = CMSG_LEN(sizeof(sock));
+	memcpy(CMSG_DATA(&buf.align), &sock, sizeof(sock));
+	writeop(fd, 103, &(int){ 0 }, sizeof(int));
+	sendmsgop(fd, 104, NULL, 0, &buf, sizeof(buf));
+	close(sock);
+	test_echo_wait(fd, 2);
+	assert(echo_opcodes[0] == 103);
+	assert(echo_opcodes[1] == 104);
+	assert(*(int*)echo_data == 1);
+}
+
+int large[40000];
+
+/*
+ * A server with a client started by a spawner, before the server is
+ * exec'd, as srvsh runs a block. The client sends the server a few
+ * messages, each its opcode over and over, which the server echoes
+ * back and passes on.
+ */
+#define TREE_MESSAGES 5
+#define TREE_INTS 2048
+
+int tree_received = 0;
+
+// What sending a message should have taken, for the settings in use
+void test_tree_written(ssize_t written, int size)
+{
+	if (getenv("SRVSH_COMPRESS"))
+		assert(written > 0 && written < size);
+	else if (getenv("SRVSH_HEADER"))
+		assert(written > size && written < (ssize_t)sizeof(struct srvsh_header) + size);
+	else
+		assert(written == (ssize_t)sizeof(struct srvsh_header) + size);
+}
+
+// Checks both ends of a connection in the tree have the settings
+void test_tree_check(int fd)
+{
+	struct compress_stats compressed = { 0 };
+	assert(get_compress_stats(fd, &compressed) == 0);
+	assert(!getenv("SRVSH_COMPRESS") == !compressed.decompressed);
+
+	struct credit_state credit = { 0 };
+	assert(get_credit_state(fd, &credit) == 0);
+	assert(!getenv("SRVSH_CREDIT") == !credit.window);
+
+	assert(!getenv("SRVSH_SHM_RING") == !is_shm(fd));
+}
+
+void test_tree_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	int payload[TREE_INTS];
+	assert(size == sizeof(payload));
+	memcpy(payload, data, size);
+	for (int i = 0; i < TREE_INTS; i++)
+		assert(payload[i] == opcode);
+	tree_received++;
+}
+
+void relay_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	test_tree_callback(fd, opcode, data, size, header, context);
+	assert(writesrv(opcode, data, size) > 0);
+	test_tree_written(writeop(fd, opcode, data, size), size);
+	if (tree_received == TREE_MESSAGES)
+		test_tree_check(fd);
+}
+
+// Runs until both ends are done, since either may still need credit
+int relay(void)
+{
+	bool server_gone = false;
+	bool client_gone = false;
+	while (!server_gone || !client_gone) {
+		struct pollfd result = pollop(relay_callback, NULL, -1);
+		if (result.fd < 0)
+			return 1;
+		if (result.revents & POLLHUP)
+			*(result.fd == SRV_FILENO ? &server_gone : &client_gone) = true;
+	}
+	return tree_received == TREE_MESSAGES ? 0 : 1;
+}
+
+int scatter(void)
+{
+	int payload[TREE_INTS];
+	for (int opcode = 1; opcode <= TREE_MESSAGES; opcode++) {
+		for (int i = 0; i < TREE_INTS; i++)
+			payload[i] = opcode;
+		test_tree_written(writesrv(opcode, payload, sizeof(payload)), sizeof(payload));
+	}
+
+	while (tree_received < TREE_MESSAGES) {
+		struct pollfd result = pollopsrv(test_tree_callback, NULL, -1);
+		if (result.fd < 0 || (result.revents & POLLHUP && tree_received < TREE_MESSAGES))
+			return 1;
+	}
+	test_tree_check(SRV_FILENO);
+
+	// leaving something the server sent unread would reset the
+	// connection, so wait for it to hang up
+	assert(shutdown(SRV_FILENO, SHUT_WR) == 0);
+	for (;;) {
+		struct pollfd result = pollopsrv(test_tree_callback, NULL, -1);
+		if (result.fd < 0)
+			return 1;
+		if (result.revents & POLLHUP)
+			return 0;
+	}
+}
+
+bool spawn_scatter(void *context)
+{
+	return cliexecl("/proc/self/exe", "/proc/self/exe", "scatter", NULL).socket >= 0;
+}
+
+// Runs the tree with the variable name set for all of it, if there is one
+void test_tree(const char *name, const char *value)
+{
+	if (name)
+		assert(setenv(name, value, 1) == 0);
+	struct clistate child = srvexecl(
+		spawn_scatter,
+		NULL,
+		"/proc/self/exe",
+		"/proc/self/exe",
+		"relay",
+		NULL
+	);
+	if (name)
+		assert(unsetenv(name) == 0);
+	assert(child.socket >= 0);
+
+	tree_received = 0;
+	struct pollfd pfd = { .fd = child.socket, .events = POLLIN };
+	while (tree_received < TREE_MESSAGES) {
+		struct pollfd result = pollopfd(pfd, test_tree_callback, NULL, -1);
+		assert(!(result.revents & POLLHUP) || tree_received == TREE_MESSAGES);
+	}
+
+	// as in scatter(), so a doorbell left unread doesn't reset the
+	// relay's connection
+	assert(shutdown(child.socket, SHUT_WR) == 0);
+	for (;;) {
+		struct pollfd result = pollopfd(pfd, test_tree_callback, NULL, -1);
+		assert(result.fd >= 0);
+		if (result.revents & POLLHUP)
+			break;
+	}
+	closeop(child.socket);
+	int status = -1;
+	assert(waitpid(child.pid, &status, 0) == child.pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void test_shm(void)
+{
+	struct clistate child = spawn_echo("SRVSH_SHM_RING", "64k");
+	assert(is_shm(child.socket));
+
+	for (int i = 1; i <= 100; i++)
+		test_echo_roundtrip(child.socket, i, &i, sizeof(i));
+
+	// too big for the ring, so it goes over the socket
+	for (int i = 0; i < 40000; i++)
+		large[i] = i;
+	test_echo_roundtrip(child.socket, 101, large, sizeof(large));
+	test_echo_roundtrip(child.socket, 102, large, 4096);
+
+	// file descriptors go over the socket too, but stay in order
+	test_echo_cmsg(child.socket);
+
+	// which includes the memfd of a bulk message
+	assert(sendbulkop(child.socket, 103, large, sizeof(large)) > 0);
+	test_echo_wait(child.socket, 1);
+	assert(echo_opcodes[0] == 103);
+	assert(*(int *)echo_data == 1);
+	test_echo_roundtrip(child.socket, 104, large, 4096);
+
+	stop_echo(child);
+
+	// a server exec'd after its clients were started offers them the
+	// ring itself, since what it had mapped before is gone
+	test_tree("SRVSH_SHM_RING", "64k");
+}
+
+// A new socket given the number gets standard headers
+void test_fresh_number(int number)
+{
+	int pair[2] = { 0 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+	if (pair[0] != number) {
+		assert(dup2(pair[0], number) == number);
+		close(pair[0]);
+		pair[0] = number;
+	}
+	assert(writeop(pair[0], 1, "abcd", 4) == sizeof(struct srvsh_header) + 4);
+	close(pair[0]);
+	close(pair[1]);
+}
+
+// Reads the records written to a SOCK_SEQPACKET socket as they are
+void test_seqpacket_records(void)
+{
+	int pair[2] = { -1, -1 };
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == 0);
+	static char record[1 << 17];
+	const ssize_t header = sizeof(struct srvsh_header);
+
+	// each frame is a record of its own
+	assert(writeop(pair[0], 1, "ab", 2) == header + 2);
+	assert(writeop(pair[0], 2, "cde", 3) == header + 3);
+	assert(recv(pair[1], record, sizeof(record), 0) == header + 2);
+	assert(recv(pair[1], record, sizeof(record), 0) == header + 3);
+
+	// a record larger than any libsrvsh sends is reported, rather
+	// than cut short
+	assert(send(pair[0], record, 100000, 0) == 100000);
+	struct pollfd result = pollopfd((struct pollfd){.fd = pair[1]}, test_echo_callback, NULL, -1);
+	assert(result.fd < 0 && errno == EMSGSIZE);
+
+	// a larger one is split into records of up to 64KiB, which the
+	// reader puts back together
+	for (int i = 0; i < 40000; i++)
+		large[i] = i;
+	assert(writeop(pair[0], 3, large, 100000) == header + 100000);
+	assert(recv(pair[1], record, sizeof(record), MSG_PEEK) == 65536);
+	test_echo_wait(pair[1], 1);
+	assert(echo_opcodes[0] == 3 && echo_size == 100000);
+	assert(memcmp(echo_data, large, 100000) == 0);
+
+	// a corked buffer goes out as one record, and never grows
+	// larger than a record can be
+	assert(corkop(pair[0], 1 << 20, -1) == 0);
+	for (int i = 0; i < 10; i++)
+		assert(writeop(pair[0], 4, large, 10000) == header + 10000);
+	assert(flushop(pair[0]) >= 0);
+	ssize_t total = 0;
+	int records = 0;
+	for (ssize_t received; (received = recv(pair[1], record, sizeof(record), MSG_DONTWAIT)) > 0;) {
+		assert(received <= 65536);
+		total += received;
+		records++;
+	}
+	assert(total == 10 * (header + 10000));
+	assert(records == 2);
+	assert(corkop(pair[0], 0, 0) == 0);
+
+	closeop(pair[0]);
+	closeop(pair[1]);
+}
+
+void test_seqpacket(void)
+{
+	test_seqpacket_records();
+
+	struct clistate child = spawn_echo("SRVSH_SOCKET_TYPE", "seqpacket");
+	assert(test_socket_type(child.socket) == SOCK_SEQPACKET);
+
+	for (int i = 1; i <= 100; i++)
+		test_echo_roundtrip(child.socket, i, &i, sizeof(i));
+
+	// split across several records
+	for (int i = 0; i < 40000; i++)
+		large[i] = i;
+	test_echo_roundtrip(child.socket, 101, large, sizeof(large));
+
+	// records that start and end partway through segments
+	struct iovec iov[] = {
+		{ .iov_base = large, .iov_len = 10000 },
+		{ .iov_base = (char *)large + 10000, .iov_len = 1 },
+		{ .iov_base = (char *)large + 10001, .iov_len = sizeof(large) - 10001 },
+	};
+	assert(writeopv(child.socket, 102, iov, 3) == sizeof(struct srvsh_header) + sizeof(large));
+	test_echo_wait(child.socket, 1);
+	assert(echo_opcodes[0] == 102);
+	assert(echo_size == sizeof(large));
+	assert(memcmp(echo_data, large, sizeof(large)) == 0);
+
+	test_echo_cmsg(child.socket);
+
+	// a corked buffer is flushed as one record holding both frames
+	assert(corkop(child.socket, 1 << 20, -1) == 0);
+	writeop(child.socket, 105, &(int){ 5 }, sizeof(int));
+	writeop(child.socket, 106, &(int){ 6 }, sizeof(int));
+	assert(flushop(child.socket) > 0);
+	test_echo_wait(child.socket, 2);
+	assert(echo_opcodes[0] == 105);
+	assert(echo_opcodes[1] == 106);
+	assert(corkop(child.socket, 0, 0) == 0);
+
+	// the next socket with the number doesn't inherit the setting,
+	// whether the connection was closed with closeop()
+	const int number = child.socket;
+	stop_echo(child);
+	test_fresh_number(number);
+
+	// or the hang-up was seen first
+	child = spawn_echo("SRVSH_HEADER", "compact");
+	writeop(child.socket, 0, NULL, 0);
+	assert(waitpid(child.pid, NULL, 0) == child.pid);
+	struct pollfd polls[] = { { .fd = child.socket } };
+	while (polls[0].fd >= 0)
+		pollopfds(polls, 1, test_echo_callback, NULL, -1);
+	close(child.socket);
+	test_fresh_number(child.socket);
+}
+
+void test_compact_header(void)
+{
+	struct clistate child = spawn_echo("SRVSH_HEADER", "compact");
+
+	// a one-byte opcode and a one-byte size, up to opcode 63
+	for (int i = 1; i <= 100; i++) {
+		assert(writeop(child.socket, i, &i, sizeof(i)) == (i < 64 ? 2 : 3) + sizeof(i));
+		test_echo_wait(child.socket, 1);
+		assert(echo_opcodes[0] == i);
+		assert(*(int*)echo_data == i);
+	}
+
+	for (int i = 0; i < 40000; i++)
+		large[i] = i;
+	assert(writeop(child.socket, 300, large, sizeof(large)) == 2 + 3 + sizeof(large));
+	test_echo_wait(child.socket, 1);
+	assert(echo_opcodes[0] == 300);
+	assert(echo_size == sizeof(large));
+	assert(memcmp(echo_data, large, sizeof(large)) == 0);
+
+	test_echo_cmsg(child.socket);
+
+	// corked frames are packed the same way
+	assert(corkop(child.socket, 1 << 20, -1) == 0);
+	writeop(child.socket, 105, NULL, 0);
+	writeop(child.socket, 106, NULL, 0);
+	assert(flushop(child.socket) == 6);
+	test_echo_wait(child.socket, 2);
+	assert(echo_opcodes[0] == 105);
+	assert(echo_opcodes[1] == 106);
+	assert(corkop(child.socket, 0, 0) == 0);
+
+	stop_echo(child);
+
+	// a server exec'd after its clients were started reads theirs
+	// the same way
+	test_tree(NULL, NULL);
+	test_tree("SRVSH_HEADER", "compact");
+}
+
+void test_creditop(void)
+{
+	// the client end lets the server end have two messages outstanding
+	assert(creditop(client, 2, 0) == 0);
+	assert(creditop(client, 2, 0) == -1 && errno == EBUSY);
+	pollopfd((struct pollfd){.fd = server}, test_counting_callback, &client, -1);
+
+	struct credit_state state = { 0 };
+	assert(get_credit_state(server, &state) == 0);
+	assert(state.limited);
+	assert(state.messages == 2);
+	assert(state.bytes == -1);
+
+	// the third waits for the first two to be handled
+	for (int i = 0; i < 3; i++)
+		assert(writesrv(5, &(int){ 6 }, sizeof(int)) == sizeof(struct srvsh_header) + sizeof(int));
+	assert(get_credit_state(server, &state) == 0);
+	assert(state.messages == 0);
+	assert(state.held == 1);
+	assert(state.held_bytes == sizeof(int));
+	assert(state.stalls == 1);
+
+	counted_calls = 0;
+	while (counted_calls < 2)
+		pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, -1);
+	while (state.held) {
+		pollopfd((struct pollfd){.fd = server}, test_counting_callback, &client, -1);
+		assert(get_credit_state(server, &state) == 0);
+	}
+	pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, -1);
+	assert(counted_calls == 3);
+
+	assert(get_credit_state(client, &state) == 0);
+	assert(state.window == 2);
+	assert(!state.limited);
+
+	// and then the limit is lifted
+	assert(creditop(client, 0, 0) == 0);
+	while (state.limited) {
+		pollopfd((struct pollfd){.fd = server}, test_counting_callback, &client, -1);
+		assert(get_credit_state(server, &state) == 0);
+	}
+	assert(state.messages == -1);
+
+	// both ends of a child's connection are limited from the start,
+	// here to two of these messages at a time
+	struct clistate child = spawn_echo("SRVSH_CREDIT", "4:64");
+	assert(get_credit_state(child.socket, &state) == 0);
+	assert(state.limited);
+	assert(state.window == 4 && state.window_bytes == 64);
+
+	char payload[32] = { 0 };
+	int sent = 0;
+	while (writeop(child.socket, 20 + sent, payload, sizeof(payload)) > 0)
+		sent++;
+
+	// and no more than that are held back
+	assert(errno == EAGAIN);
+	assert(sent == 4);
+	assert(get_credit_state(child.socket, &state) == 0);
+	assert(state.held == 2 && state.held_bytes == 64);
+
+	// until credit comes back
+	echo_replies = 0;
+	struct pollfd pfd = { .fd = child.socket, .events = POLLIN };
+	while (sent < 10) {
+		if (writeop(child.socket, 20 + sent, payload, sizeof(payload)) > 0)
+			sent++;
+		else
+			pollopfd(pfd, test_echo_callback, NULL, -1);
+	}
+	while (echo_replies < 10)
+		pollopfd(pfd, test_echo_callback, NULL, -1);
+	assert(echo_opcodes[1] == 29);
+	assert(get_credit_state(child.socket, &state) == 0);
+	assert(state.held == 0);
+
+	stop_echo(child);
+
+	// a server exec'd after its client was started grants it credit
+	test_tree("SRVSH_CREDIT", "4");
+}
+
+int stuck_received = 0;
+
+void test_broadcastop_stuck_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	(void)fd;
+	(void)header;
+	(void)context;
+	assert(opcode == 15 + stuck_received);
+	if (opcode == 15) {
+		assert(size == 60000);
+		assert(memcmp(data, large, (size_t)size) == 0);
+	} else {
+		assert(size == sizeof(int));
+		assert(*(int *)data == opcode);
+	}
+	stuck_received++;
+}
+
+void test_broadcastop_stuck(void)
+{
+	// nobody reads this one, so it can only take part of a message
+	int sockets[2] = { -1, -1 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+	int sndbuf = 4096;
+	assert(setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+
+	// the broadcast returns anyway, with the rest queued
+	assert(broadcastop(sockets, 1, 15, large, 60000) == 1);
+	const size_t queued = queuedop(sockets[0]);
+	assert(queued > 0);
+
+	// and what comes after waits behind it
+	int payload = 16;
+	assert(broadcastop(sockets, 1, 16, &payload, sizeof(payload)) == 1);
+	assert(queuedop(sockets[0]) > queued);
+
+	// which the pollop* functions send as the reader catches up
+	assert(recvbufop(sockets[1], 4096) == 0);
+	struct pollfd fd = { .fd = sockets[1] };
+	while (stuck_received < 2)
+		pollopfd(fd, test_broadcastop_stuck_callback, NULL, -1);
+	assert(queuedop(sockets[0]) == 0);
+
+	// a plain write blocks as it always did
+	payload = 17;
+	assert(writeop(sockets[0], 17, &payload, sizeof(payload)) > 0);
+	while (stuck_received < 3)
+		pollopfd(fd, test_broadcastop_stuck_callback, NULL, -1);
+
+	assert(recvbufop(sockets[1], 0) == 0);
+	closeop(sockets[0]);
+	closeop(sockets[1]);
+}
+
+void test_broadcastop(void)
+{
+	// to every client, which here is just the one
+	int payload = 11;
+	assert(broadcastop(NULL, 0, 11, &payload, sizeof(payload)) == 1);
+
+	struct {
+		struct srvsh_header header;
+		int payload;
+	} buffer = { 0 };
+	assert(read(server, &buffer, sizeof(buffer)) == sizeof(buffer));
+	assert(buffer.header.opcode == 11);
+	assert(buffer.header.size == sizeof(payload));
+	assert(buffer.payload == 11);
+
+	struct clistate children[] = {
+		spawn_echo("SRVSH_HEADER", "compact"),
+		spawn_echo("SRVSH_SOCKET_TYPE", "seqpacket"),
+		spawn_echo("SRVSH_HEADER", "standard"),
+	};
+	int fds[3] = { 0 };
+	for (int i = 0; i < 3; i++)
+		fds[i] = children[i].socket;
+
+	// the last one can't take it all at once, so it's finished last
+	int sndbuf = 4096;
+	assert(setsockopt(fds[2], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+
+	for (int i = 0; i < 40000; i++)
+		large[i] = i;
+	const int size = 60000;
+	assert(broadcastop(fds, 3, 12, large, size) == 3);
+	for (int i = 0; i < 3; i++) {
+		test_echo_wait(fds[i], 1);
+		assert(echo_opcodes[0] == 12);
+		assert(echo_size == size);
+		assert(memcmp(echo_data, large, size) == 0);
+	}
+
+	// large ones go in a memfd, which echo counts
+	assert(broadcastop(fds, 3, 13, large, sizeof(large)) == 3);
+	for (int i = 0; i < 3; i++) {
+		test_echo_wait(fds[i], 1);
+		assert(echo_opcodes[0] == 13);
+		assert(*(int *)echo_data == 1);
+	}
+
+	for (int i = 0; i < 3; i++)
+		stop_echo(children[i]);
+
+	// one that's gone is skipped
+	int sockets[2] = { 0 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+	close(sockets[1]);
+	int targets[] = { sockets[0], client };
+	errno = 0;
+	assert(broadcastop(targets, 2, 14, &payload, sizeof(payload)) == 1);
+	assert(errno == EPIPE);
+	assert(read(server, &buffer, sizeof(buffer)) == sizeof(buffer));
+	assert(buffer.header.opcode == 14);
+	close(sockets[0]);
+
+	test_broadcastop_stuck();
+}
+
+void test_compress(void)
+{
+	struct clistate child = spawn_echo("SRVSH_COMPRESS", "1k");
+
+	// small messages go as they are
+	int small = 7;
+	test_echo_roundtrip(child.socket, 8, &small, sizeof(small));
+
+	struct compress_stats stats = { 0 };
+	assert(get_compress_stats(child.socket, &stats) == 0);
+	assert(stats.compressed == 0 && stats.decompressed == 0);
+
+	// repeating data, with runs that overlap their own matches
+	for (int i = 0; i < 40000; i++)
+		large[i] = i % 1000 < 500 ? i % 7 : 0;
+	ssize_t written = writeop(child.socket, 9, large, sizeof(large));
+	assert(written > 0 && written < (ssize_t)sizeof(large) / 4);
+	test_echo_wait(child.socket, 1);
+	assert(echo_opcodes[0] == 9);
+	assert(echo_size == sizeof(large));
+	assert(memcmp(echo_data, large, sizeof(large)) == 0);
+
+	assert(get_compress_stats(child.socket, &stats) == 0);
+	assert(stats.compressed == 1);
+	assert(stats.decompressed == 1);
+	assert(stats.failed == 0);
+	assert(stats.raw_bytes == sizeof(large));
+	assert(stats.compressed_bytes < stats.raw_bytes / 4);
+
+	// gathered from segments first
+	struct iovec iov[] = {
+		{ .iov_base = large, .iov_len = sizeof(large) / 2 },
+		{ .iov_base = large + 20000, .iov_len = sizeof(large) / 2 },
+	};
+	assert(writeopv(child.socket, 9, iov, 2) < (ssize_t)sizeof(large) / 4);
+	test_echo_wait(child.socket, 1);
+	assert(echo_size == sizeof(large));
+	assert(memcmp(echo_data, large, sizeof(large)) == 0);
+	assert(get_compress_stats(child.socket, &stats) == 0);
+	assert(stats.compressed == 2);
+
+	// data that doesn't compress is sent as it is
+	unsigned state = 1;
+	for (int i = 0; i < 40000; i++) {
+		state = state * 1103515245 + 12345;
+		large[i] = (int)state;
+	}
+	test_echo_roundtrip(child.socket, 10, large, sizeof(large));
+	assert(get_compress_stats(child.socket, &stats) == 0);
+	assert(stats.skipped == 1);
+	assert(stats.compressed == 2);
+
+	test_echo_cmsg(child.socket);
+
+	// and compression can be turned off
+	assert(compressop(child.socket, COMPRESS_LZ, 0) == 0);
+	for (int i = 0; i < 40000; i++)
+		large[i] = 0;
+	assert(writeop(child.socket, 11, large, sizeof(large)) == sizeof(struct srvsh_header) + sizeof(large));
+	test_echo_wait(child.socket, 1);
+	assert(echo_opcodes[0] == 11);
+	assert(memcmp(echo_data, large, sizeof(large)) == 0);
+
+	stop_echo(child);
+
+	errno = 0;
+	assert(compressop(client, 0, 1024) == -1 && errno == EINVAL);
+
+	// both ways between a server and a client started before it
+	test_tree("SRVSH_COMPRESS", "1k");
+}
+
+/*
+ * Reads a forwarded frame from fd into buf, returning how many file
+ * descriptors came with it, after closing them.
+ */
+int test_forwarded(int fd, struct srvsh_header *header, void *buf)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = { 0 };
+	struct iovec iov = {
+		.iov_base = header,
+		.iov_len = sizeof(*header),
+	};
+	struct msghdr msghdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = &control,
+		.msg_controllen = sizeof(control),
+	};
+	assert(recvmsg(fd, &msghdr, MSG_WAITALL) == sizeof(*header));
+	if (header->size)
+		assert(recv(fd, buf, header->size, MSG_WAITALL) == header->size);
+
+	int fds = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msghdr); cmsg; cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+		int passed = -1;
+		memcpy(&passed, CMSG_DATA(cmsg), sizeof(passed));
+		assert(close(passed) == 0);
+		fds++;
+	}
+	return fds;
+}
+
+int relay_to = -1;
+
+void test_relay_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	(void)fd;
+	(void)context;
+	assert(forwardop(relay_to, opcode, data, size, header) > 0);
+	counted_calls++;
+}
+
+void test_held_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	assert(opcode == 30 && size == sizeof(int));
+	assert(*(int *)data == counted_calls++);
+}
+
+unsigned forward_request_id = 0;
+
+void test_forward_request(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	unsigned id,
+	void *context
+)
+{
+	assert(opcode == 40 && size == sizeof(int) && *(int *)data == 41);
+	forward_request_id = id;
+}
+
+void test_forward_done(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	assert(opcode == 42 && size == sizeof(int) && *(int *)data == 43);
+	counted_calls++;
+}
+
+void test_forward(void)
+{
+	int in[2] = { 0 };
+	int out[2] = { 0 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, in) == 0);
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, out) == 0);
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control = { 0 };
+	struct cmsghdr *cmsg = &control.align;
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &in[0], sizeof(int));
+
+	errno = 0;
+	assert(set_forward(in[1], SRVSH_OPCODE_RESERVED, out[0]) == -1 && errno == EINVAL);
+	assert(set_forward(in[1], 30, out[0]) == 0);
+
+	// large bodies are spliced across, file descriptors and all
+	const int size = 60000;
+	for (int i = 0; i < 40000; i++)
+		large[i] = i;
+	assert(sendmsgop(in[0], 30, large, size, cmsg, sizeof(control)) > 0);
+	counted_calls = 0;
+	pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, -1);
+	assert(counted_calls == 0);
+
+	struct srvsh_header header = { 0 };
+	static int forwarded[40000];
+	assert(test_forwarded(out[1], &header, forwarded) == 1);
+	assert(header.opcode == 30);
+	assert(header.size == size);
+	assert(memcmp(forwarded, large, size) == 0);
+
+	// small ones are relayed as they are
+	assert(writeop(in[0], 30, &(int){ 31 }, sizeof(int)) > 0);
+	pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, -1);
+	assert(test_forwarded(out[1], &header, forwarded) == 0);
+	assert(header.opcode == 30 && header.size == sizeof(int));
+	assert(forwarded[0] == 31);
+
+	// bulk messages go by the opcode they carry, as the same memfd
+	assert(sendbulkop(in[0], 30, large, sizeof(large)) > 0);
+	pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, -1);
+	assert(counted_calls == 0);
+	assert(test_forwarded(out[1], &header, forwarded) == 1);
+	assert(header.size == sizeof(int) && forwarded[0] == 30);
+
+	// a callback can relay them too
+	assert(set_forward(in[1], 30, -1) == 0);
+	relay_to = out[0];
+	assert(sendmsgop(in[0], 30, large, size, cmsg, sizeof(control)) > 0);
+	pollopfd((struct pollfd){.fd = in[1]}, test_relay_callback, NULL, -1);
+	assert(counted_calls == 1);
+	assert(test_forwarded(out[1], &header, forwarded) == 1);
+	assert(header.opcode == 30 && header.size == size);
+	assert(memcmp(forwarded, large, size) == 0);
+
+	// everything else
+	assert(set_forward(in[1], FORWARD_ALL, out[0]) == 0);
+	assert(writeop(in[0], 32, &(int){ 33 }, sizeof(int)) > 0);
+	pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, -1);
+	assert(counted_calls == 1);
+	assert(test_forwarded(out[1], &header, forwarded) == 0);
+	assert(header.opcode == 32 && forwarded[0] == 33);
+
+	// including requests, and replies on the way back
+	rpc *calls = open_rpc(NULL, NULL, NULL);
+	rpc *served = open_rpc(test_forward_request, NULL, NULL);
+	assert(calls && served);
+	assert(set_forward(out[0], FORWARD_ALL, in[1]) == 0);
+	counted_calls = 0;
+	assert(callop(calls, in[0], 40, &(int){ 41 }, sizeof(int), test_forward_done, NULL) == 0);
+	pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, -1);
+	forward_request_id = 0;
+	pollopfd((struct pollfd){.fd = out[1]}, rpc_callback, served, -1);
+	assert(forward_request_id != 0);
+	assert(replyop(out[1], forward_request_id, 42, &(int){ 43 }, sizeof(int)) > 0);
+	pollopfd((struct pollfd){.fd = out[0]}, test_counting_callback, &client, -1);
+	pollopfd((struct pollfd){.fd = in[0]}, rpc_callback, calls, -1);
+	assert(counted_calls == 1);
+	assert(set_forward(out[0], FORWARD_ALL, -1) == 0);
+	close_rpc(calls);
+	close_rpc(served);
+	assert(set_forward(in[1], FORWARD_ALL, -1) == 0);
+
+	// A message waiting for credit to go on holds back its source's,
+	// so what waits here is bounded by the source's window
+	struct credit_state state = { 0 };
+	assert(creditop(out[1], 1, 0) == 0);
+	assert(creditop(in[1], 2, 0) == 0);
+	pollopfd((struct pollfd){.fd = out[0]}, test_counting_callback, &client, -1);
+	pollopfd((struct pollfd){.fd = in[0]}, test_counting_callback, &client, -1);
+	assert(set_forward(in[1], 30, out[0]) == 0);
+	for (int i = 0; i < 3; i++)
+		assert(writeop(in[0], 30, &i, sizeof(i)) > 0);
+
+	// only the first goes on, and only it is given back
+	do {
+		pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, -1);
+		assert(get_credit_state(out[0], &state) == 0);
+	} while (state.messages);
+	pollopfd((struct pollfd){.fd = in[0]}, test_counting_callback, &client, -1);
+	assert(get_credit_state(in[0], &state) == 0);
+	assert(state.messages == 0 && state.held == 0);
+
+	// which lets the third go from the source, to wait as well
+	do {
+		pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, -1);
+		assert(get_credit_state(out[0], &state) == 0);
+	} while (state.held < 2);
+
+	// the rest is given back as they go on
+	counted_calls = 0;
+	while (counted_calls < 3) {
+		pollopfd((struct pollfd){.fd = out[1]}, test_held_callback, NULL, -1);
+		pollopfd((struct pollfd){.fd = out[0]}, test_counting_callback, &client, -1);
+	}
+	while (state.messages < 2) {
+		pollopfd((struct pollfd){.fd = in[0]}, test_counting_callback, &client, -1);
+		assert(get_credit_state(in[0], &state) == 0);
+	}
+	assert(set_forward(in[1], 30, -1) == 0);
+
+	// which the next sockets with these numbers mustn't inherit
+	for (int i = 0; i < 2; i++) {
+		closeop(in[i]);
+		closeop(out[i]);
+	}
+
+	// a source that stops partway through a spliced body leaves
+	// nothing of the frame behind it
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, in) == 0);
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, out) == 0);
+	assert(set_forward(in[1], 30, out[0]) == 0);
+	header = (struct srvsh_header) { .opcode = 30, .size = size };
+	assert(write(in[0], &header, sizeof(header)) == sizeof(header));
+	assert(write(in[0], large, size / 2) == size / 2);
+	assert(shutdown(in[0], SHUT_WR) == 0);
+	pollopfd((struct pollfd){.fd = in[1]}, test_counting_callback, &client, 1000);
+	char byte = 0;
+	assert(recv(out[1], &byte, 1, MSG_DONTWAIT) == -1 && errno == EAGAIN);
+	for (int i = 0; i < 2; i++) {
+		closeop(in[i]);
+		closeop(out[i]);
+	}
+}
+
+struct timer_counts {
+	int fired[3];
+	op_timer *timers[3];
+};
+
+void test_timer_callback(op_timer *timer, void *context)
+{
+	struct timer_counts *counts = context;
+	for (int i = 0; i < 3; i++)
+		if (counts->timers[i] == timer)
+			counts->fired[i]++;
+
+	// the third closes itself on its second firing
+	if (timer == counts->timers[2] && counts->fired[2] == 2) {
+		close_timer(timer);
+		counts->timers[2] = NULL;
+	}
+}
+
+void test_timers(void)
+{
+	struct timer_counts counts = { 0 };
+	for (int i = 0; i < 3; i++)
+		assert((counts.timers[i] = open_timer(test_timer_callback, &counts)));
+
+	errno = 0;
+	assert(set_timer(counts.timers[0], 0, -1) == -1 && errno == EINVAL);
+
+	// every 5ms, once after 30ms, and every 2ms until it closes itself
+	assert(set_timer(counts.timers[0], 5, 5) == 0);
+	assert(set_timer(counts.timers[1], 30, 0) == 0);
+	assert(set_timer(counts.timers[2], 2, 2) == 0);
+
+	// they fire while waiting, without the wait returning early
+	struct pollfd result = pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, 50);
+	assert(result.fd == 0 && result.revents == 0);
+	assert(counts.fired[0] >= 3);
+	assert(counts.fired[1] == 1);
+	assert(counts.fired[2] == 2 && !counts.timers[2]);
+
+	// disarmed, they don't fire again
+	assert(set_timer(counts.timers[0], -1, 0) == 0);
+	const int fired = counts.fired[0];
+	pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, 20);
+	assert(counts.fired[0] == fired);
+	assert(counts.fired[1] == 1);
+
+	// one that comes due alongside a message fires too
+	assert(set_timer(counts.timers[1], 0, 0) == 0);
+	assert(writeop(server, 5, &(int){ 6 }, sizeof(int)) > 0);
+	counted_calls = 0;
+	while (!counted_calls)
+		pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, -1);
+	assert(counts.fired[1] == 2);
+
+	close_timer(counts.timers[0]);
+	close_timer(counts.timers[1]);
+}
+
+int signalled = 0;
+pid_t exited_pid = 0;
+int exited_status = 0;
+
+void test_signal_callback(int signo, const struct signalfd_siginfo *info, void *context)
+{
+	assert(context == &signalled);
+	assert(info->ssi_pid == (unsigned)getpid());
+	signalled = signo;
+}
+
+void test_child_callback(pid_t pid, int status, void *context)
+{
+	assert(context == &exited_pid);
+	exited_pid = pid;
+	exited_status = status;
+}
+
+// Fails if the signals test_watches() watches were left blocked
+int sigmask_probe(void)
+{
+	sigset_t blocked;
+	if (pthread_sigmask(SIG_BLOCK, NULL, &blocked) != 0)
+		return 2;
+	return sigismember(&blocked, SIGUSR1) || sigismember(&blocked, SIGUSR2);
+}
+
+void test_watches(void)
+{
+	errno = 0;
+	assert(watch_signal(SIGKILL, test_signal_callback, &signalled) == -1 && errno == EINVAL);
+
+	// signals arrive as callbacks, without interrupting the wait
+	assert(watch_signal(SIGUSR1, test_signal_callback, &signalled) == 0);
+	assert(watch_signal(SIGUSR2, test_signal_callback, &signalled) == 0);
+	assert(kill(getpid(), SIGUSR1) == 0);
+	struct pollfd result = pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, 10);
+	assert(result.fd == 0);
+	assert(signalled == SIGUSR1);
+
+	// programs started meanwhile don't start with them blocked
+	struct clistate child = cliexecl("/proc/self/exe", "/proc/self/exe", "sigmask", NULL);
+	assert(child.socket >= 0);
+	int status = -1;
+	assert(waitpid(child.pid, &status, 0) == child.pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	closeop(child.socket);
+
+	assert(unwatch_signal(SIGUSR2) == 0);
+	assert(kill(getpid(), SIGUSR1) == 0);
+	signalled = 0;
+	pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, 10);
+	assert(signalled == SIGUSR1);
+
+	// and are unblocked again afterwards
+	assert(unwatch_signal(SIGUSR1) == 0);
+	sigset_t blocked;
+	assert(pthread_sigmask(SIG_BLOCK, NULL, &blocked) == 0);
+	assert(!sigismember(&blocked, SIGUSR1) && !sigismember(&blocked, SIGUSR2));
+
+	// children are reaped as they exit
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0)
+		_exit(3);
+	assert(watch_child(pid, test_child_callback, &exited_pid) == 0);
+	while (!exited_pid)
+		pollopfd((struct pollfd){.fd = client}, test_counting_callback, &client, 10);
+	assert(exited_pid == pid);
+	assert(WIFEXITED(exited_status) && WEXITSTATUS(exited_status) == 3);
+
+	errno = 0;
+	assert(watch_child(pid, test_child_callback, &exited_pid) == -1 && errno == ESRCH);
+
+	// or forgotten
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0)
+		_exit(0);
+	assert(watch_child(pid, test_child_callback, &exited_pid) == 0);
+	assert(unwatch_child(pid) == 0);
+	assert(waitpid(pid, NULL, 0) == pid);
+}
+
+struct coroutine_totals {
+	int sums[2];
+	int hangups;
+};
+
+void test_coroutine_rest(int fd, void *context)
+{
+	struct coroutine_totals *totals = context;
+	struct op_message message = { 0 };
+	while (recvop(fd, &message) > 0)
+		totals->sums[1] += *(int *)message.buf;
+	totals->hangups++;
+}
+
+void test_coroutine(int fd, void *context)
+{
+	struct coroutine_totals *totals = context;
+
+	// the first takes one message and hands the rest to another
+	struct op_message message = { 0 };
+	assert(recvop(fd, &message) == 1);
+	assert(message.opcode == 40 && message.len == sizeof(int));
+	totals->sums[0] += *(int *)message.buf;
+	assert(spawn_coroutine(fd, test_coroutine_rest, totals) == 0);
+}
+
+void test_coroutines(void)
+{
+	struct op_message message = { 0 };
+	errno = 0;
+	assert(recvop(client, &message) == -1 && errno == EINVAL);
+
+	// the second round gets the same numbers for new sockets
+	for (int round = 0; round < 2; round++) {
+		int pairs[3][2] = { 0 };
+		struct coroutine_totals totals = { 0 };
+		for (int i = 0; i < 3; i++) {
+			assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) == 0);
+
+			for (int value = 1; value <= 10; value++)
+				assert(writeop(pairs[i][1], 40, &value, sizeof(value)) > 0);
+			close(pairs[i][1]);
+			assert(spawn_coroutine(pairs[i][0], test_coroutine, &totals) == 0);
+		}
+
+		// with a budget, more is read than the first coroutine
+		// waits for
+		assert(set_pollop_budget(4 * round) == 0);
+		assert(run_coroutines() == 0);
+		assert(set_pollop_budget(0) == 0);
+
+		assert(totals.sums[0] == 3);
+		assert(totals.sums[1] == 3 * (55 - 1));
+		assert(totals.hangups == 3);
+
+		for (int i = 0; i < 3; i++)
+			closeop(pairs[i][0]);
+	}
+}
+
+void test_traffic_callback(
+	int fd,
+	int opcode,
+	void *data,
+	int size,
+	struct msghdr header,
+	void *context
+)
+{
+	close_cmsg_fds(header);
+	counted_calls++;
+}
+
+void test_traffic_stats(void)
+{
+	int sockets[2] = { 0 };
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+
+	// earlier tests may have left counts on these numbers
+	struct traffic_stats before = { 0 };
+	struct traffic_stats sent = { 0 };
+	struct traffic_stats received = { 0 };
+	assert(get_opcode_stats(50, &before) == 0);
+	assert(get_traffic_stats(sockets[0], &sent) == 0);
+	assert(get_traffic_stats(sockets[1], &received) == 0);
+
+	for (int i = 0; i < 3; i++)
+		assert(writeop(sockets[0], 50, large, 100) > 0);
+	assert(sendbulkop(sockets[0], 51, large, sizeof(large)) > 0);
+
+	struct traffic_stats stats = { 0 };
+	assert(get_traffic_stats(sockets[0], &stats) == 0);
+	assert(stats.messages_out - sent.messages_out == 4);
+	assert(stats.bytes_out - sent.bytes_out == 300 + sizeof(large));
+	assert(get_traffic_stats(sockets[1], &stats) == 0);
+	assert(stats.messages_in == received.messages_in);
+	assert(stats.queued_in > 300);
+
+	// bulk messages count as what they carry
+	counted_calls = 0;
+	while (counted_calls < 4)
+		pollopfd((struct pollfd){.fd = sockets[1]}, test_traffic_callback, NULL, -1);
+	assert(get_traffic_stats(sockets[1], &stats) == 0);
+	assert(stats.messages_in - received.messages_in == 4);
+	assert(stats.bytes_in - received.bytes_in == 300 + sizeof(large));
+	assert(stats.queued_in == 0);
+
+	assert(get_opcode_stats(50, &stats) == 0);
+	assert(stats.messages_in - before.messages_in == 3);
+	assert(stats.messages_out - before.messages_out == 3);
+	assert(stats.bytes_in - before.bytes_in == 300);
+	assert(get_opcode_stats(51, &stats) == 0);
+	assert(stats.bytes_out >= sizeof(large));
+
+	close(sockets[0]);
+	pollopfd((struct pollfd){.fd = sockets[1]}, test_traffic_callback, NULL, -1);
+	assert(get_traffic_stats(sockets[1], &stats) == 0);
+	assert(stats.hangups - received.hangups == 1);
+
+	int pipe_fds[2] = { 0 };
+	assert(pipe(pipe_fds) == 0);
+	assert(dump_traffic_stats(pipe_fds[1]) == 0);
+	close(pipe_fds[1]);
+	static char dump[65536];
+	ssize_t length = 0;
+	for (ssize_t got; (got = read(pipe_fds[0], dump + length, sizeof(dump) - 1 - length)) > 0;)
+		length += got;
+	dump[length] = '\0';
+	close(pipe_fds[0]);
+	assert(strstr(dump, "opcode"));
+	assert(strstr(dump, "\n51 "));
+
+	close(sockets[1]);
+	errno = 0;
+	assert(get_traffic_stats(sockets[1], &stats) == -1 && errno == EBADF);
+}
+
+void test_trace(void)
+{
+	char dir[] = "/tmp/srvsh-trace-XXXXXX";
+	assert(mkdtemp(dir));
+	struct clistate child = spawn_echo("SRVSH_TRACE", dir);
+	for (int i = 1; i <= 3; i++)
+		test_echo_roundtrip(child.socket, 200 + i, large, i * 100);
+	stop_echo(child);
+
+	char path[64];
+	snprintf(path, sizeof(path), "%s/srvsh-%d.trace", dir, (int)child.pid);
+	int fd = open(path, O_RDONLY);
+	assert(fd >= 0);
+	const off_t size = lseek(fd, 0, SEEK_END);
+	struct trace_file *file = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+	assert(file != MAP_FAILED);
+	close(fd);
+	assert(file->magic == TRACE_MAGIC);
+	assert(file->version == TRACE_VERSION);
+
+	// each message in, each reply out, then the opcode asking it to stop
+	const struct trace_record *records = (const struct trace_record *)(file + 1);
+	assert(file->head == 7);
+	for (int i = 0; i < 7; i++) {
+		assert(records[i].sequence == (uint64_t)i + 1);
+		assert(records[i].pid == child.pid);
+		assert(records[i].fd == SRV_FILENO);
+		assert(i == 0 || records[i].time >= records[i - 1].time);
+	}
+	for (int i = 0; i < 3; i++) {
+		assert(records[2 * i].direction == TRACE_RECV);
+		assert(records[2 * i + 1].direction == TRACE_SEND);
+		assert(records[2 * i + 1].opcode == 201 + i);
+		assert(records[2 * i + 1].size == (uint64_t)(i + 1) * 100);
+	}
+	assert(records[6].opcode == 0);
+	munmap(file, (size_t)size);
+	assert(unlink(path) == 0);
+
+	// srvsh-trace names the opcodes with the opcode database
+	snprintf(path, sizeof(path), "%s/opcodes", dir);
+	FILE *db_file = fopen(path, "w");
+	assert(db_file);
+	fputs("# echo\nQUIT 0\nFIRST 201\nSECOND\n", db_file);
+	fclose(db_file);
+	opcode_db *db = open_opcode_db_at(path);
+	assert(db);
+	char name[8];
+	assert(get_opcode_name(db, 202, name, sizeof(name)) == 6);
+	assert(strcmp(name, "SECOND") == 0);
+	assert(get_opcode_name(db, 0, name, sizeof(name)) == 4);
+	assert(strcmp(name, "QUIT") == 0);
+	assert(get_opcode_name(db, 203, name, sizeof(name)) == -1);
+	close_opcode_db(db);
+	assert(unlink(path) == 0);
+	assert(rmdir(dir) == 0);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "echo") == 0)
+		return echo();
+	if (argc > 1 && strcmp(argv[1], "relay") == 0)
+		return relay();
+	if (argc > 1 && strcmp(argv[1], "scatter") == 0)
+		return scatter();
+	if (argc > 1 && strcmp(argv[1], "sigmask") == 0)
+		return sigmask_probe();
+
 	if (setenv("SRVSH_CLIENTS_END", "5", 1) < 0)
 		return 1;
 
@@ -212,8 +2397,34 @@ int main()
 	test_cli_count();
 	test_writesrv();
 	test_writeop();
+	test_writeopv();
 	test_sendmsgop();
+	test_sendbulkop();
 	test_pollop();
 	test_pollopfd();
 	test_pollopfds();
+	test_recvbufop();
+	test_corkop();
+	test_nonblockop();
+	test_nonblockop_records();
+	test_set_pollop_backend();
+	test_pollop_partial_frame();
+	test_set_pollop_budget();
+	test_timers();
+	test_watches();
+	test_coroutines();
+	test_dispatchop();
+	test_op_dispatcher();
+	test_op_dispatcher_reuse();
+	test_rpc();
+	test_shm();
+	test_seqpacket();
+	test_compact_header();
+	test_compress();
+	test_broadcastop();
+	test_creditop();
+	test_forward();
+	test_traffic_stats();
+	test_trace();
+	free(echo_data);
 }